@@ -4,44 +4,427 @@
 #include <string>
 #include <cstdint>
 #include <bitset>
+#include <sstream>
+#include <array>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <type_traits>
+#include <fstream>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+
+// Trace output produced by CPU4Bit::step()
+enum class TraceMode {
+    Silent,    // No formatting at all on the hot path
+    Buffered,  // Trace text collected in memory, read with traceText()
+    Verbose    // Trace printed to std::cout as each instruction executes
+};
+
+// Native code generation is only available on x86-64 Linux
+#if defined(__x86_64__) && defined(__linux__)
+#define CPU4BIT_HAS_JIT 1
+#include <sys/mman.h>
+#endif
+
+// Program corpora are memory-mapped and result files written with writev
+// where POSIX exists; iostreams elsewhere
+#if defined(__unix__) || defined(__APPLE__)
+#define CPU4BIT_HAS_MMAP 1
+#define CPU4BIT_HAS_WRITEV 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// Execution engine used by CPU4Bit::run()
+enum class Engine {
+    Interpreter,  // Reference step() loop
+    Predecoded,   // 256-entry table of pre-resolved handlers
+    Threaded,     // Computed-goto loop (GCC/Clang), Predecoded elsewhere
+    BlockCache,   // Cached straight-line blocks ending at JMP/JZ/HLT
+    JIT,          // x86-64 native code (Linux), Threaded elsewhere
+    CountedLoop,  // Interpreter that skips counted loops in closed form
+    JumpTable     // Power-of-two jump tables for store-free programs
+};
+
+// Number of engines; update it when adding one after JumpTable
+static const size_t ENGINE_COUNT = (size_t)Engine::JumpTable + 1;
+
+// Default trace mode for new CPUs, e.g. -DCPU4BIT_DEFAULT_TRACE=Silent.
+// Define CPU4BIT_DISABLE_TRACE to compile tracing out of step() entirely.
+#ifndef CPU4BIT_DEFAULT_TRACE
+#define CPU4BIT_DEFAULT_TRACE Verbose
+#endif
+
+// Full architectural state of one CPU. All bytes, no padding: copies are
+// a memcpy, equality a memcmp, and arrays of states are dense.
+struct MachineState {
+    uint8_t reg[4];
+    uint8_t pc;
+    uint8_t zero;
+    uint8_t running;
+    uint8_t ram[16];
+    
+    bool operator==(const MachineState& other) const {
+        return std::memcmp(this, &other, sizeof(MachineState)) == 0;
+    }
+    bool operator!=(const MachineState& other) const { return !(*this == other); }
+    
+    // One pass over the state as three words
+    size_t hash() const {
+        uint64_t w[3] = {};
+        std::memcpy(w, this, sizeof(MachineState));
+        uint64_t h = w[0] * 0x9E3779B97F4A7C15ULL;
+        h = (h ^ (h >> 29) ^ w[1]) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 32) ^ w[2]) * 0x94D049BB133111EBULL;
+        return (size_t)(h ^ (h >> 31));
+    }
+};
+
+static_assert(sizeof(MachineState) == 23, "MachineState must stay packed");
+static_assert(std::is_trivially_copyable<MachineState>::value, "MachineState must stay trivially copyable");
+
+// For unordered containers of states
+struct MachineStateHash {
+    size_t operator()(const MachineState& s) const { return s.hash(); }
+};
+
+// Result of infinite-loop detection in CPU4Bit::run()
+struct CycleInfo {
+    bool detected = false;
+    int start = 0;   // Steps before the state first enters the cycle
+    int length = 0;  // Steps per trip around the cycle
+};
+
+// Memoized results of whole runs. A run that starts right after reset()
+// and loadProgram() depends only on the RAM image, maxSteps and whether
+// cycle detection is on, so that is the key. Not thread-safe; share one
+// cache per thread.
+class ResultCache {
+public:
+    enum class Eviction {
+        LRU,   // Drop the least recently used entry
+        FIFO   // Drop the oldest entry
+    };
+    
+    struct Key {
+        uint8_t image[16];
+        int maxSteps;
+        bool detectCycles;
+        
+        bool operator==(const Key& other) const {
+            return std::memcmp(image, other.image, 16) == 0 &&
+                   maxSteps == other.maxSteps && detectCycles == other.detectCycles;
+        }
+    };
+    
+    struct Result {
+        MachineState state;
+        std::vector<uint8_t> output;
+        int steps;
+        CycleInfo cycle;
+    };
+    
+    explicit ResultCache(size_t capacity = 4096, Eviction eviction = Eviction::LRU)
+        : capacity(capacity), eviction(eviction) {}
+    
+    // Cached result for key, or nullptr
+    const Result* find(const Key& key) {
+        auto it = index.find(key);
+        if(it == index.end()) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        if(eviction == Eviction::LRU) {
+            entries.splice(entries.begin(), entries, it->second);
+        }
+        return &it->second->second;
+    }
+    
+    void insert(const Key& key, const Result& result) {
+        if(capacity == 0 || index.count(key)) return;
+        if(entries.size() >= capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+            evictions++;
+        }
+        entries.emplace_front(key, result);
+        index[key] = entries.begin();
+    }
+    
+    void clear() {
+        entries.clear();
+        index.clear();
+    }
+    
+    void setCapacity(size_t newCapacity) {
+        capacity = newCapacity;
+        while(entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+            evictions++;
+        }
+    }
+    
+    size_t size() const { return entries.size(); }
+    size_t getCapacity() const { return capacity; }
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+    uint64_t getEvictions() const { return evictions; }
+    
+private:
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            // The image as two words, mixed with the run parameters
+            uint64_t lo, hi;
+            std::memcpy(&lo, key.image, 8);
+            std::memcpy(&hi, key.image + 8, 8);
+            uint64_t h = lo * 0x9E3779B97F4A7C15ULL;
+            h = (h ^ (h >> 29) ^ hi) * 0xBF58476D1CE4E5B9ULL;
+            h = (h ^ (h >> 32) ^ ((uint64_t)(uint32_t)key.maxSteps << 1) ^ key.detectCycles)
+                * 0x94D049BB133111EBULL;
+            return (size_t)(h ^ (h >> 31));
+        }
+    };
+    
+    typedef std::list<std::pair<Key, Result>> EntryList;
+    
+    size_t capacity;
+    Eviction eviction;
+    EntryList entries;  // Most recently inserted (or used, for LRU) first
+    std::unordered_map<Key, EntryList::iterator, KeyHash> index;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Checkpoints stored back to back, 23 bytes each. Reserve up front and
+// push() never allocates; indices stay valid until clear().
+class SnapshotArena {
+public:
+    explicit SnapshotArena(size_t reserveCount = 0) { states.reserve(reserveCount); }
+    
+    size_t push(const MachineState& s) {
+        states.push_back(s);
+        return states.size() - 1;
+    }
+    
+    const MachineState& operator[](size_t index) const { return states[index]; }
+    const MachineState* data() const { return states.data(); }
+    size_t size() const { return states.size(); }
+    size_t capacity() const { return states.capacity(); }
+    void reserve(size_t count) { states.reserve(count); }
+    void clear() { states.clear(); }
+    
+private:
+    std::vector<MachineState> states;
+};
+
+// Append-only record of runs, enough to replay them bit-exact. Layout
+// (integers little endian):
+//   header  "C4RL" + version byte
+//   'S'     MachineState (23 bytes)     - state set outside of run()
+//   'R'     flags (bit 0: cycle detection), steps (u32), OUT count (u32),
+//           OUT values, MachineState after the run
+// Recording appends one 'R' record per run(); 'S' records only appear when
+// the state was changed between runs (reset(), loadProgram(), ...).
+class ExecutionLog {
+public:
+    static const uint8_t VERSION = 1;
+    static const size_t HEADER_SIZE = 5;
+    enum RecordType : uint8_t { SET_STATE = 'S', RUN = 'R' };
+    
+    struct Record {
+        RecordType type;
+        bool detectCycles;
+        uint32_t steps;
+        uint32_t outCount;
+        const uint8_t* out;  // Points into the log
+        MachineState state;  // New state ('S') or state after the run ('R')
+    };
+    
+    ExecutionLog() {}
+    ExecutionLog(const uint8_t* data, size_t size) : bytes(data, data + size) {}
+    
+    bool empty() const { return bytes.empty(); }
+    const std::vector<uint8_t>& data() const { return bytes; }
+    void clear() { bytes.clear(); }
+    
+    void appendState(const MachineState& s) {
+        header();
+        bytes.push_back(SET_STATE);
+        append(&s, sizeof(MachineState));
+    }
+    
+    void appendRun(bool detectCycles, uint32_t steps, const uint8_t* out, uint32_t outCount,
+                   const MachineState& after) {
+        header();
+        bytes.push_back(RUN);
+        bytes.push_back(detectCycles ? 1 : 0);
+        appendU32(steps);
+        appendU32(outCount);
+        append(out, outCount);
+        append(&after, sizeof(MachineState));
+    }
+    
+    // Record at offset (start at HEADER_SIZE), advancing offset past it.
+    // False at the end of the log or on a truncated/unknown record.
+    bool next(size_t& offset, Record& record) const {
+        if(offset >= bytes.size()) return false;
+        const uint8_t type = bytes[offset];
+        size_t at = offset + 1;
+        record.type = (RecordType)type;
+        record.detectCycles = false;
+        record.steps = 0;
+        record.outCount = 0;
+        record.out = nullptr;
+        if(type == RUN) {
+            if(at + 9 > bytes.size()) return false;
+            record.detectCycles = bytes[at] & 1;
+            record.steps = readU32(at + 1);
+            record.outCount = readU32(at + 5);
+            at += 9;
+            if(at + record.outCount > bytes.size()) return false;
+            record.out = bytes.data() + at;
+            at += record.outCount;
+        } else if(type != SET_STATE) {
+            return false;
+        }
+        if(at + sizeof(MachineState) > bytes.size()) return false;
+        std::memcpy(&record.state, bytes.data() + at, sizeof(MachineState));
+        offset = at + sizeof(MachineState);
+        return true;
+    }
+    
+    bool validHeader() const {
+        return bytes.size() >= HEADER_SIZE && std::memcmp(bytes.data(), "C4RL", 4) == 0 &&
+               bytes[4] == VERSION;
+    }
+    
+private:
+    std::vector<uint8_t> bytes;
+    
+    void header() {
+        if(bytes.empty()) {
+            bytes.insert(bytes.end(), { 'C', '4', 'R', 'L', VERSION });
+        }
+    }
+    void append(const void* p, size_t n) {
+        const uint8_t* b = static_cast<const uint8_t*>(p);
+        bytes.insert(bytes.end(), b, b + n);
+    }
+    void appendU32(uint32_t v) {
+        for(int i = 0; i < 4; i++) bytes.push_back((v >> (8 * i)) & 0xFF);
+    }
+    uint32_t readU32(size_t at) const {
+        return bytes[at] | (bytes[at + 1] << 8) | (bytes[at + 2] << 16) | ((uint32_t)bytes[at + 3] << 24);
+    }
+};
+
+// Outcome of CPU4Bit::replay()
+struct ReplayReport {
+    bool ok = true;
+    bool malformed = false;    // Bad header or truncated record
+    size_t runs = 0;           // Run records replayed
+    long long steps = 0;       // Instructions executed
+    size_t mismatchRun = 0;    // First run that differed, if !ok
+    size_t predecodedRuns = 0; // Runs with cycle detection, which step on the predecoded engine
+};
 
 class CPU4Bit {
 private:
-    // 4-bit registers (0-15)
-    uint8_t regA;
-    uint8_t regB;
-    uint8_t regC;
-    uint8_t regD;
+    // Registers, PC, flags and RAM in one trivially copyable block
+    MachineState state;
+    
+    // Values written by OUT
+    std::vector<uint8_t> outputLog;
+    
+    // Engine selected for run()
+    Engine engine = Engine::Interpreter;
+    
+    // Infinite-loop detection
+    bool cycleDetection = false;
+    CycleInfo cycle;
+    
+    // Whole-run memoization; pristine is true from reset() until the
+    // registers change or the CPU runs
+    ResultCache* resultCache = nullptr;
+    bool pristine = true;
+    
+    // Recording; recordedState is the state at the end of the last
+    // recorded run
+    ExecutionLog* recorder = nullptr;
+    MachineState recordedState;
+    bool recordedAny = false;
     
-    // Program counter (can address 16 memory locations)
-    uint8_t PC;
+    // Translated blocks, allocated on first use of Engine::BlockCache
+    struct BlockCacheState;
+    std::unique_ptr<BlockCacheState> blockCache;
     
-    // Zero flag for conditional operations
-    bool zeroFlag;
+    // Superinstruction fusion in the block cache, and how often each fired
+    enum Fusion { FUSE_LDA_LDB_ADD, FUSE_INC_JZ, FUSE_DEC_JZ, FUSE_LDA_ALU, FUSION_KINDS };
+    bool fusion = true;
+    uint64_t fusionHits[FUSION_KINDS] = {};
     
-    // 16 bytes of RAM (4-bit addresses)
-    uint8_t RAM[16];
+    // Native code, allocated on first use of Engine::JIT
+    struct JitState;
+    std::unique_ptr<JitState> jit;
     
-    // Running state
-    bool running;
+    // Next-state and jump tables, allocated on first use of Engine::JumpTable
+    struct JumpTableState;
+    std::unique_ptr<JumpTableState> jumpTable;
+    size_t jumpTableLimit = 256u << 20;
+    
+    // Reverse execution: a checkpoint every historyInterval steps, plus an
+    // undo record for each step since the latest one
+    struct UndoRecord {
+        uint8_t flags;  // PC in bits 0-3, zero flag in bit 4, bit 5 set for OUT
+        uint8_t slot;   // Register 0-3, RAM byte 4-19, or NO_SLOT
+        uint8_t old;    // Value the step overwrote
+    };
+    static const uint8_t NO_SLOT = 0xFF;
+    bool timeTravel = false;
+    int historyInterval = 64;
+    int historyStep = 0;  // Steps since the history started
+    int logBase = 0;      // Step of the checkpoint undoLog starts from
+    SnapshotArena checkpoints;
+    std::vector<size_t> checkpointOutputs;  // OUT count at each checkpoint
+    std::vector<UndoRecord> undoLog;
+    
+    // Tracing
+    TraceMode traceMode = TraceMode::CPU4BIT_DEFAULT_TRACE;
+    std::ostringstream traceBuffer;
     
     // Mask to ensure 4-bit values
-    const uint8_t MASK_4BIT = 0x0F;
+    static constexpr uint8_t MASK_4BIT = 0x0F;
     
     // Helper function to mask values to 4 bits
-    uint8_t mask4bit(uint8_t value) {
+    static uint8_t mask4bit(uint8_t value) {
         return value & MASK_4BIT;
     }
     
     // Get register by number
+    static uint8_t& reg(MachineState& s, uint8_t regNum) {
+        return s.reg[regNum & 0x03];
+    }
     uint8_t& getRegister(uint8_t regNum) {
-        switch(regNum & 0x03) {
-            case 0: return regA;
-            case 1: return regB;
-            case 2: return regC;
-            case 3: return regD;
-            default: return regA; // Should never happen
-        }
+        return reg(state, regNum);
     }
     
     std::string getRegisterName(uint8_t regNum) {
@@ -54,436 +437,7077 @@ private:
         }
     }
 
-public:
-    // Instruction opcodes (4-bit)
-    enum Opcode {
-        NOP   = 0x0,  // No operation
-        LDA   = 0x1,  // Load immediate to A
-        LDB   = 0x2,  // Load immediate to B
-        STA   = 0x3,  // Store A to memory
-        STB   = 0x4,  // Store B to memory
-        ADD   = 0x5,  // Add B to A (result in A)
-        SUB   = 0x6,  // Subtract B from A (result in A)
-        JMP   = 0x7,  // Jump to address
-        JZ    = 0x8,  // Jump if zero flag set
-        MOV   = 0x9,  // Move between registers
-        LDM   = 0xA,  // Load from memory to A
-        OUT   = 0xB,  // Output register value
-        INC   = 0xC,  // Increment register
-        DEC   = 0xD,  // Decrement register
-        ALU   = 0xE,  // Extended ALU operations (uses operand for sub-opcode)
-        HLT   = 0xF   // Halt
-    };
-    
-    // ALU sub-opcodes (used when opcode = 0xE)
-    enum ALUOp {
-        AND_OP = 0x0,  // A & B -> A
-        OR_OP  = 0x1,  // A | B -> A
-        XOR_OP = 0x2,  // A ^ B -> A
-        NOT_OP = 0x3,  // ~A -> A
-        SHL_OP = 0x4,  // A << 1 -> A (shift left)
-        SHR_OP = 0x5,  // A >> 1 -> A (shift right)
-        ROL_OP = 0x6,  // Rotate A left
-        ROR_OP = 0x7   // Rotate A right
-    };
-    
-    CPU4Bit() {
-        reset();
-    }
-    
-    void reset() {
-        regA = 0;
-        regB = 0;
-        regC = 0;
-        regD = 0;
-        PC = 0;
-        zeroFlag = false;
-        running = true;
-        
-        // Clear RAM
-        for(int i = 0; i < 16; i++) {
-            RAM[i] = 0;
-        }
-    }
-    
-    // Load program into RAM
-    void loadProgram(const std::vector<uint8_t>& program) {
-        for(size_t i = 0; i < program.size() && i < 16; i++) {
-            RAM[i] = program[i];
-        }
-    }
-    
-    // Execute one instruction
-    void step() {
-        if(!running) return;
-        
-        // Fetch instruction
-        uint8_t instruction = RAM[PC];
+    // Decode and execute a single instruction on state (PC still points
+    // at it); OUT values go to out.push_back(). Shared by everything that
+    // needs the reference semantics outside a CPU4Bit.
+    template<typename Output>
+    static void execute(MachineState& state, uint8_t instruction, Output& out) {
         uint8_t opcode = (instruction >> 4) & MASK_4BIT;
         uint8_t operand = instruction & MASK_4BIT;
         
-        std::cout << "PC=" << std::hex << std::setw(1) << (int)PC 
-                  << " Instr=0x" << std::setw(2) << std::setfill('0') << (int)instruction
-                  << " Op=0x" << (int)opcode << " Operand=0x" << (int)operand
-                  << std::setfill(' ') << std::dec;
+        state.pc = mask4bit(state.pc + 1); // Increment PC
         
-        PC = mask4bit(PC + 1); // Increment PC
-        
-        // Decode and execute
         switch(opcode) {
             case NOP:
-                std::cout << " NOP" << std::endl;
                 break;
                 
             case LDA:
-                regA = mask4bit(operand);
-                std::cout << " LDA #" << (int)operand << " -> A=" << (int)regA << std::endl;
+                state.reg[0] = mask4bit(operand);
                 break;
                 
             case LDB:
-                regB = mask4bit(operand);
-                std::cout << " LDB #" << (int)operand << " -> B=" << (int)regB << std::endl;
+                state.reg[1] = mask4bit(operand);
                 break;
                 
             case STA:
-                RAM[operand] = regA;
-                std::cout << " STA [" << (int)operand << "] <- A=" << (int)regA << std::endl;
+                state.ram[operand] = state.reg[0];
                 break;
                 
             case STB:
-                RAM[operand] = regB;
-                std::cout << " STB [" << (int)operand << "] <- B=" << (int)regB << std::endl;
+                state.ram[operand] = state.reg[1];
                 break;
                 
             case ADD:
-                regA = mask4bit(regA + regB);
-                zeroFlag = (regA == 0);
-                std::cout << " ADD A+B -> A=" << (int)regA << " Z=" << zeroFlag << std::endl;
+                state.reg[0] = mask4bit(state.reg[0] + state.reg[1]);
+                state.zero = (state.reg[0] == 0);
                 break;
                 
             case SUB:
-                regA = mask4bit(regA - regB);
-                zeroFlag = (regA == 0);
-                std::cout << " SUB A-B -> A=" << (int)regA << " Z=" << zeroFlag << std::endl;
+                state.reg[0] = mask4bit(state.reg[0] - state.reg[1]);
+                state.zero = (state.reg[0] == 0);
                 break;
                 
             case JMP:
-                PC = mask4bit(operand);
-                std::cout << " JMP -> PC=" << (int)PC << std::endl;
+                state.pc = mask4bit(operand);
                 break;
                 
             case JZ:
-                if(zeroFlag) {
-                    PC = mask4bit(operand);
-                    std::cout << " JZ (taken) -> PC=" << (int)PC << std::endl;
-                } else {
-                    std::cout << " JZ (not taken)" << std::endl;
+                if(state.zero) {
+                    state.pc = mask4bit(operand);
                 }
                 break;
                 
             case MOV: {
                 uint8_t src = (operand >> 2) & 0x03;
                 uint8_t dst = operand & 0x03;
-                uint8_t value = getRegister(src);
-                getRegister(dst) = value;
-                std::cout << " MOV " << getRegisterName(src) << "->" << getRegisterName(dst) 
-                         << " (value=" << (int)value << ")" << std::endl;
+                reg(state, dst) = reg(state, src);
                 break;
             }
                 
             case LDM:
-                regA = RAM[operand];
-                std::cout << " LDM [" << (int)operand << "] -> A=" << (int)regA << std::endl;
+                state.reg[0] = state.ram[operand];
                 break;
                 
             case OUT:
-                std::cout << " OUT " << getRegisterName(operand & 0x03) 
-                         << "=" << (int)getRegister(operand & 0x03) << " ***" << std::endl;
+                out.push_back(reg(state, operand & 0x03));
                 break;
                 
             case INC:
-                getRegister(operand & 0x03) = mask4bit(getRegister(operand & 0x03) + 1);
-                zeroFlag = (getRegister(operand & 0x03) == 0);
-                std::cout << " INC " << getRegisterName(operand & 0x03) 
-                         << "=" << (int)getRegister(operand & 0x03) << std::endl;
+                reg(state, operand & 0x03) = mask4bit(reg(state, operand & 0x03) + 1);
+                state.zero = (reg(state, operand & 0x03) == 0);
                 break;
                 
             case DEC:
-                getRegister(operand & 0x03) = mask4bit(getRegister(operand & 0x03) - 1);
-                zeroFlag = (getRegister(operand & 0x03) == 0);
-                std::cout << " DEC " << getRegisterName(operand & 0x03) 
-                         << "=" << (int)getRegister(operand & 0x03) << std::endl;
+                reg(state, operand & 0x03) = mask4bit(reg(state, operand & 0x03) - 1);
+                state.zero = (reg(state, operand & 0x03) == 0);
                 break;
                 
-            case ALU: {
+            case ALU:
                 // Extended ALU operations using operand as sub-opcode
                 switch(operand & 0x0F) {
-                    case AND_OP:
-                        regA = mask4bit(regA & regB);
-                        zeroFlag = (regA == 0);
-                        std::cout << " AND A&B -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
-                        break;
-                        
-                    case OR_OP:
-                        regA = mask4bit(regA | regB);
-                        zeroFlag = (regA == 0);
-                        std::cout << " OR A|B -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
-                        break;
-                        
-                    case XOR_OP:
-                        regA = mask4bit(regA ^ regB);
-                        zeroFlag = (regA == 0);
-                        std::cout << " XOR A^B -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
-                        break;
-                        
-                    case NOT_OP:
-                        regA = mask4bit(~regA);
-                        zeroFlag = (regA == 0);
-                        std::cout << " NOT ~A -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
-                        break;
-                        
-                    case SHL_OP:
-                        regA = mask4bit(regA << 1);
-                        zeroFlag = (regA == 0);
-                        std::cout << " SHL A<<1 -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
-                        break;
-                        
-                    case SHR_OP:
-                        regA = mask4bit(regA >> 1);
-                        zeroFlag = (regA == 0);
-                        std::cout << " SHR A>>1 -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
-                        break;
-                        
+                    case AND_OP: state.reg[0] = mask4bit(state.reg[0] & state.reg[1]); break;
+                    case OR_OP:  state.reg[0] = mask4bit(state.reg[0] | state.reg[1]); break;
+                    case XOR_OP: state.reg[0] = mask4bit(state.reg[0] ^ state.reg[1]); break;
+                    case NOT_OP: state.reg[0] = mask4bit(~state.reg[0]);       break;
+                    case SHL_OP: state.reg[0] = mask4bit(state.reg[0] << 1);   break;
+                    case SHR_OP: state.reg[0] = mask4bit(state.reg[0] >> 1);   break;
                     case ROL_OP: {
                         // Rotate left: shift left and wrap MSB to LSB
-                        uint8_t msb = (regA & 0x08) >> 3;  // Get bit 3
-                        regA = mask4bit((regA << 1) | msb);
-                        zeroFlag = (regA == 0);
-                        std::cout << " ROL rotate left -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
+                        uint8_t msb = (state.reg[0] & 0x08) >> 3;  // Get bit 3
+                        state.reg[0] = mask4bit((state.reg[0] << 1) | msb);
                         break;
                     }
-                        
                     case ROR_OP: {
                         // Rotate right: shift right and wrap LSB to MSB
-                        uint8_t lsb = (regA & 0x01) << 3;  // Get bit 0, move to bit 3
-                        regA = mask4bit((regA >> 1) | lsb);
-                        zeroFlag = (regA == 0);
-                        std::cout << " ROR rotate right -> A=" << (int)regA << " (0b" 
-                                 << std::bitset<4>(regA) << ")" << std::endl;
+                        uint8_t lsb = (state.reg[0] & 0x01) << 3;  // Get bit 0, move to bit 3
+                        state.reg[0] = mask4bit((state.reg[0] >> 1) | lsb);
                         break;
                     }
-                        
                     default:
-                        std::cout << " UNKNOWN ALU OP: 0x" << std::hex << (int)operand 
-                                 << std::dec << std::endl;
-                        break;
+                        return; // Unknown ALU op: flags untouched
                 }
+                state.zero = (state.reg[0] == 0);
                 break;
-            }
                 
             case HLT:
-                running = false;
-                std::cout << " HLT - CPU Halted" << std::endl;
-                break;
-                
-            default:
-                std::cout << " UNKNOWN OPCODE!" << std::endl;
+                state.running = false;
                 break;
         }
     }
     
-    // Run until halt
-    void run(int maxSteps = 100) {
-        int steps = 0;
-        while(running && steps < maxSteps) {
-            step();
-            steps++;
-        }
-        if(steps >= maxSteps) {
-            std::cout << "Max steps reached!" << std::endl;
-        }
+    void execute(uint8_t instruction) {
+        execute(state, instruction, outputLog);
     }
     
-    void printState() {
-        std::cout << "\n=== CPU State ===" << std::endl;
-        std::cout << "A=" << (int)regA << " B=" << (int)regB 
-                  << " C=" << (int)regC << " D=" << (int)regD << std::endl;
-        std::cout << "PC=" << (int)PC << " Zero=" << zeroFlag 
-                  << " Running=" << running << std::endl;
+    // Stream trace lines go to for the current mode
+    std::ostream& traceStream() {
+        if(traceMode == TraceMode::Buffered) return traceBuffer;
+        return std::cout;
+    }
+    
+    // Format one executed instruction; register values are post-execution
+    void traceInstruction(uint8_t fetchPC, uint8_t instruction) {
+        uint8_t opcode = (instruction >> 4) & MASK_4BIT;
+        uint8_t operand = instruction & MASK_4BIT;
+        std::ostream& out = traceStream();
         
-        std::cout << "\n=== RAM ===" << std::endl;
-        for(int i = 0; i < 16; i++) {
-            std::cout << std::hex << std::setw(1) << i << ":0x" 
-                     << std::setw(2) << std::setfill('0') << (int)RAM[i] << " ";
-            if((i + 1) % 8 == 0) std::cout << std::endl;
+        out << "PC=" << std::hex << std::setw(1) << (int)fetchPC 
+            << " Instr=0x" << std::setw(2) << std::setfill('0') << (int)instruction
+            << " Op=0x" << (int)opcode << " Operand=0x" << (int)operand
+            << std::setfill(' ') << std::dec;
+        
+        switch(opcode) {
+            case NOP:
+                out << " NOP";
+                break;
+            case LDA:
+                out << " LDA #" << (int)operand << " -> A=" << (int)state.reg[0];
+                break;
+            case LDB:
+                out << " LDB #" << (int)operand << " -> B=" << (int)state.reg[1];
+                break;
+            case STA:
+                out << " STA [" << (int)operand << "] <- A=" << (int)state.reg[0];
+                break;
+            case STB:
+                out << " STB [" << (int)operand << "] <- B=" << (int)state.reg[1];
+                break;
+            case ADD:
+                out << " ADD A+B -> A=" << (int)state.reg[0] << " Z=" << (int)state.zero;
+                break;
+            case SUB:
+                out << " SUB A-B -> A=" << (int)state.reg[0] << " Z=" << (int)state.zero;
+                break;
+            case JMP:
+                out << " JMP -> PC=" << (int)state.pc;
+                break;
+            case JZ:
+                if(state.zero) {
+                    out << " JZ (taken) -> PC=" << (int)state.pc;
+                } else {
+                    out << " JZ (not taken)";
+                }
+                break;
+            case MOV: {
+                uint8_t src = (operand >> 2) & 0x03;
+                uint8_t dst = operand & 0x03;
+                out << " MOV " << getRegisterName(src) << "->" << getRegisterName(dst) 
+                    << " (value=" << (int)getRegister(dst) << ")";
+                break;
+            }
+            case LDM:
+                out << " LDM [" << (int)operand << "] -> A=" << (int)state.reg[0];
+                break;
+            case OUT:
+                out << " OUT " << getRegisterName(operand & 0x03) 
+                    << "=" << (int)getRegister(operand & 0x03) << " ***";
+                break;
+            case INC:
+                out << " INC " << getRegisterName(operand & 0x03) 
+                    << "=" << (int)getRegister(operand & 0x03);
+                break;
+            case DEC:
+                out << " DEC " << getRegisterName(operand & 0x03) 
+                    << "=" << (int)getRegister(operand & 0x03);
+                break;
+            case ALU: {
+                const char* text = nullptr;
+                switch(operand) {
+                    case AND_OP: text = " AND A&B -> A="; break;
+                    case OR_OP:  text = " OR A|B -> A="; break;
+                    case XOR_OP: text = " XOR A^B -> A="; break;
+                    case NOT_OP: text = " NOT ~A -> A="; break;
+                    case SHL_OP: text = " SHL A<<1 -> A="; break;
+                    case SHR_OP: text = " SHR A>>1 -> A="; break;
+                    case ROL_OP: text = " ROL rotate left -> A="; break;
+                    case ROR_OP: text = " ROR rotate right -> A="; break;
+                }
+                if(text) {
+                    out << text << (int)state.reg[0] << " (0b" << std::bitset<4>(state.reg[0]) << ")";
+                } else {
+                    out << " UNKNOWN ALU OP: 0x" << std::hex << (int)operand << std::dec;
+                }
+                break;
+            }
+            case HLT:
+                out << " HLT - CPU Halted";
+                break;
+        }
+        
+        // Verbose keeps the original per-line flush
+        if(traceMode == TraceMode::Verbose) {
+            out << std::endl;
+        } else {
+            out << '\n';
         }
-        std::cout << std::dec << std::setfill(' ') << std::endl;
     }
-};
 
-int main() {
-    CPU4Bit cpu;
-    
-    std::cout << "===== 4-Bit CPU Simulator =====" << std::endl;
-    std::cout << "\n=== Example 1: Basic Addition ===" << std::endl;
+    // ---- Predecoded engine ----
+    // Every instruction byte maps to a handler with its operand fields
+    // already extracted, so the hot loop never looks at opcode bits.
+    typedef void (*Handler)(CPU4Bit& cpu, uint8_t a, uint8_t b);
     
-    // Program: Add 5 + 3 and output result
-    std::vector<uint8_t> program1 = {
-        0x15,  // LDA #5   - Load 5 into A
-        0x23,  // LDB #3   - Load 3 into B
-        0x50,  // ADD      - Add B to A
-        0xB0,  // OUT A    - Output A (should be 8)
-        0xF0   // HLT      - Halt
+    struct DecodedOp {
+        Handler handler;
+        uint8_t a;
+        uint8_t b;
     };
     
-    cpu.loadProgram(program1);
-    cpu.run();
-    cpu.printState();
-    
-    std::cout << "\n=== Example 2: Countdown Loop ===" << std::endl;
-    cpu.reset();
-    
-    // Program: Count down from 5 to 0
-    std::vector<uint8_t> program2 = {
-        0x15,  // 0: LDA #5    - Load 5 into A
-        0xB0,  // 1: OUT A     - Output A
-        0xD0,  // 2: DEC A     - Decrement A
-        0x81,  // 3: JZ 1      - Jump to address 1 (OUT) if zero
-        0x71,  // 4: JMP 1     - Jump back to OUT
-        0xF0   // 5: HLT       - Halt (unreachable in this program)
-    };
+    static void opNop(CPU4Bit&, uint8_t, uint8_t) {}
+    static void opLda(CPU4Bit& c, uint8_t a, uint8_t) { c.state.reg[0] = a; }
+    static void opLdb(CPU4Bit& c, uint8_t a, uint8_t) { c.state.reg[1] = a; }
+    static void opSta(CPU4Bit& c, uint8_t a, uint8_t) { c.state.ram[a] = c.state.reg[0]; }
+    static void opStb(CPU4Bit& c, uint8_t a, uint8_t) { c.state.ram[a] = c.state.reg[1]; }
+    static void opJmp(CPU4Bit& c, uint8_t a, uint8_t) { c.state.pc = a; }
+    static void opJz(CPU4Bit& c, uint8_t a, uint8_t) { if(c.state.zero) c.state.pc = a; }
+    static void opLdm(CPU4Bit& c, uint8_t a, uint8_t) { c.state.reg[0] = c.state.ram[a]; }
+    static void opHlt(CPU4Bit& c, uint8_t, uint8_t) { c.state.running = false; }
     
-    cpu.loadProgram(program2);
-    cpu.run(20);  // Limit steps to prevent infinite loop
-    cpu.printState();
+    static void opAdd(CPU4Bit& c, uint8_t, uint8_t) {
+        c.state.reg[0] = c.mask4bit(c.state.reg[0] + c.state.reg[1]);
+        c.state.zero = (c.state.reg[0] == 0);
+    }
     
-    std::cout << "\n=== Example 3: Memory Operations ===" << std::endl;
-    cpu.reset();
+    static void opSub(CPU4Bit& c, uint8_t, uint8_t) {
+        c.state.reg[0] = c.mask4bit(c.state.reg[0] - c.state.reg[1]);
+        c.state.zero = (c.state.reg[0] == 0);
+    }
     
-    // Program: Store and load from memory
-    std::vector<uint8_t> program3 = {
-        0x1A,  // 0: LDA #10   - Load 10 into A
-        0x3F,  // 1: STA [15]  - Store A to RAM[15]
-        0x10,  // 2: LDA #0    - Clear A
-        0xB0,  // 3: OUT A     - Output A (0)
-        0xAF,  // 4: LDM [15]  - Load from RAM[15] to A
-        0xB0,  // 5: OUT A     - Output A (10)
-        0xF0   // 6: HLT       - Halt
-    };
+    template<int Src, int Dst>
+    static void opMov(CPU4Bit& c, uint8_t, uint8_t) {
+        c.getRegister(Dst) = c.getRegister(Src);
+    }
     
-    cpu.loadProgram(program3);
-    cpu.run();
-    cpu.printState();
+    template<int R>
+    static void opOut(CPU4Bit& c, uint8_t, uint8_t) {
+        c.outputLog.push_back(c.getRegister(R));
+    }
     
-    std::cout << "\n=== Example 4: Bitwise Operations (AND, OR, XOR) ===" << std::endl;
-    cpu.reset();
+    template<int R>
+    static void opInc(CPU4Bit& c, uint8_t, uint8_t) {
+        uint8_t& r = c.getRegister(R);
+        r = c.mask4bit(r + 1);
+        c.state.zero = (r == 0);
+    }
     
-    // Program: Demonstrate bitwise operations
-    // A=1100 (12), B=1010 (10)
-    std::vector<uint8_t> program4 = {
-        0x1C,  // 0: LDA #12   - Load 12 (0b1100) into A
-        0x2A,  // 1: LDB #10   - Load 10 (0b1010) into B
-        0xB0,  // 2: OUT A     - Output A=12
-        0xB1,  // 3: OUT B     - Output B=10
-        0xE0,  // 4: AND       - A & B = 0b1000 (8)
-        0xB0,  // 5: OUT A     - Output result
-        0x1C,  // 6: LDA #12   - Reload A
-        0xE1,  // 7: OR        - A | B = 0b1110 (14)
-        0xB0,  // 8: OUT A     - Output result
-        0x1C,  // 9: LDA #12   - Reload A
-        0xE2,  // A: XOR       - A ^ B = 0b0110 (6)
-        0xB0,  // B: OUT A     - Output result
-        0xF0   // C: HLT       - Halt
-    };
-    
-    cpu.loadProgram(program4);
-    cpu.run();
-    cpu.printState();
+    template<int R>
+    static void opDec(CPU4Bit& c, uint8_t, uint8_t) {
+        uint8_t& r = c.getRegister(R);
+        r = c.mask4bit(r - 1);
+        c.state.zero = (r == 0);
+    }
     
-    std::cout << "\n=== Example 5: NOT Operation ===" << std::endl;
-    cpu.reset();
+    // ALU sub-operation as a pure function of A and B
+    template<int Op>
+    static uint8_t aluResult(uint8_t a, uint8_t b) {
+        switch(Op) {
+            case AND_OP: return (a & b) & 0x0F;
+            case OR_OP:  return (a | b) & 0x0F;
+            case XOR_OP: return (a ^ b) & 0x0F;
+            case NOT_OP: return (~a) & 0x0F;
+            case SHL_OP: return (a << 1) & 0x0F;
+            case SHR_OP: return (a >> 1) & 0x0F;
+            case ROL_OP: return ((a << 1) | ((a & 0x08) >> 3)) & 0x0F;
+            default:     return ((a >> 1) | ((a & 0x01) << 3)) & 0x0F;  // ROR_OP
+        }
+    }
     
-    // Program: Demonstrate NOT operation
-    std::vector<uint8_t> program5 = {
-        0x15,  // 0: LDA #5    - Load 5 (0b0101) into A
-        0xB0,  // 1: OUT A     - Output A=5
-        0xE3,  // 2: NOT       - ~A = 0b1010 (10)
-        0xB0,  // 3: OUT A     - Output A=10
-        0xE3,  // 4: NOT       - ~A = 0b0101 (5) - back to original
-        0xB0,  // 5: OUT A     - Output A=5
-        0xF0   // 6: HLT       - Halt
-    };
+    template<int Op>
+    static void opAlu(CPU4Bit& c, uint8_t, uint8_t) {
+        c.state.reg[0] = aluResult<Op>(c.state.reg[0], c.state.reg[1]);
+        c.state.zero = (c.state.reg[0] == 0);
+    }
     
-    cpu.loadProgram(program5);
-    cpu.run();
-    cpu.printState();
+    // Build the table once; it is shared by all CPUs
+    static const DecodedOp* dispatchTable() {
+        static const std::array<DecodedOp, 256> table = [] {
+            static const Handler movHandlers[16] = {
+                opMov<0,0>, opMov<0,1>, opMov<0,2>, opMov<0,3>,
+                opMov<1,0>, opMov<1,1>, opMov<1,2>, opMov<1,3>,
+                opMov<2,0>, opMov<2,1>, opMov<2,2>, opMov<2,3>,
+                opMov<3,0>, opMov<3,1>, opMov<3,2>, opMov<3,3>
+            };
+            static const Handler outHandlers[4] = { opOut<0>, opOut<1>, opOut<2>, opOut<3> };
+            static const Handler incHandlers[4] = { opInc<0>, opInc<1>, opInc<2>, opInc<3> };
+            static const Handler decHandlers[4] = { opDec<0>, opDec<1>, opDec<2>, opDec<3> };
+            static const Handler aluHandlers[8] = {
+                opAlu<AND_OP>, opAlu<OR_OP>, opAlu<XOR_OP>, opAlu<NOT_OP>,
+                opAlu<SHL_OP>, opAlu<SHR_OP>, opAlu<ROL_OP>, opAlu<ROR_OP>
+            };
+            
+            std::array<DecodedOp, 256> t{};
+            for(int i = 0; i < 256; i++) {
+                uint8_t operand = i & 0x0F;
+                DecodedOp op = { opNop, operand, 0 };
+                switch(i >> 4) {
+                    case NOP: op.handler = opNop; break;
+                    case LDA: op.handler = opLda; break;
+                    case LDB: op.handler = opLdb; break;
+                    case STA: op.handler = opSta; break;
+                    case STB: op.handler = opStb; break;
+                    case ADD: op.handler = opAdd; break;
+                    case SUB: op.handler = opSub; break;
+                    case JMP: op.handler = opJmp; break;
+                    case JZ:  op.handler = opJz;  break;
+                    case MOV: op.handler = movHandlers[operand]; break;
+                    case LDM: op.handler = opLdm; break;
+                    case OUT: op.handler = outHandlers[operand & 0x03]; break;
+                    case INC: op.handler = incHandlers[operand & 0x03]; break;
+                    case DEC: op.handler = decHandlers[operand & 0x03]; break;
+                    case ALU: op.handler = operand < 8 ? aluHandlers[operand] : opNop; break;
+                    case HLT: op.handler = opHlt; break;
+                }
+                t[i] = op;
+            }
+            return t;
+        }();
+        return table.data();
+    }
+    
+    int runPredecoded(int maxSteps) {
+        const DecodedOp* table = dispatchTable();
+        int steps = 0;
+        while(state.running && steps < maxSteps) {
+            const DecodedOp& op = table[state.ram[state.pc]];
+            state.pc = mask4bit(state.pc + 1);
+            op.handler(*this, op.a, op.b);
+            steps++;
+        }
+        return steps;
+    }
+
+    // ---- Threaded engine ----
+    // Handler kinds for the computed-goto loop, indexed by instruction byte
+    enum ThreadedKind : uint8_t {
+        K_NOP, K_LDA, K_LDB, K_STA, K_STB, K_ADD, K_SUB, K_JMP, K_JZ, K_MOV, K_LDM,
+        K_OUT, K_INC, K_DEC, K_AND, K_OR, K_XOR, K_NOT, K_SHL, K_SHR, K_ROL, K_ROR, K_HLT
+    };
+    
+    static const uint8_t* threadedKinds() {
+        static const std::array<uint8_t, 256> kinds = [] {
+            static const uint8_t byOpcode[16] = {
+                K_NOP, K_LDA, K_LDB, K_STA, K_STB, K_ADD, K_SUB, K_JMP,
+                K_JZ, K_MOV, K_LDM, K_OUT, K_INC, K_DEC, K_NOP, K_HLT
+            };
+            std::array<uint8_t, 256> k{};
+            for(int i = 0; i < 256; i++) {
+                k[i] = byOpcode[i >> 4];
+                if((i >> 4) == ALU) {
+                    k[i] = (i & 0x0F) < 8 ? K_AND + (i & 0x0F) : K_NOP;
+                }
+            }
+            return k;
+        }();
+        return kinds.data();
+    }
+    
+#if defined(__GNUC__)
+    // Each handler fetches and jumps to the next one itself, and does
+    // the maxSteps accounting on the way.
+    int runThreaded(int maxSteps) {
+        static void* const labels[] = {
+            &&op_nop, &&op_lda, &&op_ldb, &&op_sta, &&op_stb, &&op_add, &&op_sub, &&op_jmp,
+            &&op_jz, &&op_mov, &&op_ldm, &&op_out, &&op_inc, &&op_dec, &&op_and, &&op_or,
+            &&op_xor, &&op_not, &&op_shl, &&op_shr, &&op_rol, &&op_ror, &&op_hlt
+        };
+        const uint8_t* kinds = threadedKinds();
+        
+        if(!state.running || maxSteps <= 0) return 0;
+        
+        uint8_t reg[4] = { state.reg[0], state.reg[1], state.reg[2], state.reg[3] };
+        uint8_t pc = state.pc;
+        bool zero = state.zero;
+        uint8_t instruction, operand;
+        int steps = 0;
+        
+#define CPU4BIT_DISPATCH()                          \
+        do {                                        \
+            if(++steps >= maxSteps) goto done;      \
+            instruction = state.ram[pc];                  \
+            operand = instruction & 0x0F;           \
+            pc = (pc + 1) & 0x0F;                   \
+            goto *labels[kinds[instruction]];       \
+        } while(0)
+        
+        instruction = state.ram[pc];
+        operand = instruction & 0x0F;
+        pc = (pc + 1) & 0x0F;
+        goto *labels[kinds[instruction]];
+        
+    op_nop: CPU4BIT_DISPATCH();
+    op_lda: reg[0] = operand; CPU4BIT_DISPATCH();
+    op_ldb: reg[1] = operand; CPU4BIT_DISPATCH();
+    op_sta: state.ram[operand] = reg[0]; CPU4BIT_DISPATCH();
+    op_stb: state.ram[operand] = reg[1]; CPU4BIT_DISPATCH();
+    op_add: reg[0] = (reg[0] + reg[1]) & 0x0F; zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_sub: reg[0] = (reg[0] - reg[1]) & 0x0F; zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_jmp: pc = operand; CPU4BIT_DISPATCH();
+    op_jz:  if(zero) pc = operand; CPU4BIT_DISPATCH();
+    op_mov: reg[operand & 0x03] = reg[(operand >> 2) & 0x03]; CPU4BIT_DISPATCH();
+    op_ldm: reg[0] = state.ram[operand]; CPU4BIT_DISPATCH();
+    op_out: outputLog.push_back(reg[operand & 0x03]); CPU4BIT_DISPATCH();
+    op_inc: {
+        uint8_t& r = reg[operand & 0x03];
+        r = (r + 1) & 0x0F;
+        zero = (r == 0);
+        CPU4BIT_DISPATCH();
+    }
+    op_dec: {
+        uint8_t& r = reg[operand & 0x03];
+        r = (r - 1) & 0x0F;
+        zero = (r == 0);
+        CPU4BIT_DISPATCH();
+    }
+    op_and: reg[0] = aluResult<AND_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_or:  reg[0] = aluResult<OR_OP>(reg[0], reg[1]);  zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_xor: reg[0] = aluResult<XOR_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_not: reg[0] = aluResult<NOT_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_shl: reg[0] = aluResult<SHL_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_shr: reg[0] = aluResult<SHR_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_rol: reg[0] = aluResult<ROL_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_ror: reg[0] = aluResult<ROR_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_DISPATCH();
+    op_hlt:
+        state.running = false;
+        steps++;
+        
+#undef CPU4BIT_DISPATCH
+        
+    done:
+        state.reg[0] = reg[0];
+        state.reg[1] = reg[1];
+        state.reg[2] = reg[2];
+        state.reg[3] = reg[3];
+        state.pc = pc;
+        state.zero = zero;
+        return steps;
+    }
+#else
+    int runThreaded(int maxSteps) {
+        return runPredecoded(maxSteps);
+    }
+#endif
+
+    // ---- Block cache engine ----
+    // A block is the run of instructions starting at some PC and ending
+    // at JZ/HLT (or after 16 instructions); it follows JMPs, which cost no
+    // op, only a step. Blocks are
+    // keyed by start PC and remember which RAM bytes they were decoded
+    // from, so a store into any of those bytes drops them. Ops are
+    // ThreadedKinds (plus the fused kinds below) run by a computed-goto
+    // loop with the registers in locals, like the threaded engine, but
+    // with decoding, the PC update and the step count done once per block.
+    enum FusedKind : uint8_t {
+        K_LDA_LDB_ADD = K_HLT + 1,  // a = n, b = m
+        K_INC_JZ,                   // a = register, b = jump target
+        K_DEC_JZ,
+        K_LDA_ALU,                  // a = n, b = ThreadedKind of the ALU op
+        K_BLOCK_END,                // Follows the last op of every block
+        BLOCK_KINDS
+    };
+    
+    struct BlockOp {
+        uint8_t kind;
+        uint8_t a;
+        uint8_t b;
+        uint8_t next;   // PC after this op
+        uint8_t end;    // Instructions in the block up to and including this op
+    };
+    
+    struct Block {
+        uint8_t length;     // Instructions; 0 if not translated
+        uint8_t endPc;      // PC after the block if its JZ is not taken
+        uint16_t coverage;  // Bit i set if RAM[i] is part of the block
+        uint8_t fused[FUSION_KINDS];  // Fused ops of each kind in the block
+        uint64_t runs;      // Complete runs not yet added to fusionHits
+        BlockOp ops[17];    // Up to 16 ops, then K_BLOCK_END
+    };
+    
+    struct BlockCacheState {
+        Block blocks[16];
+        uint16_t codeMask = 0;  // Union of all valid blocks' coverage
+        uint8_t image[16];      // RAM as last seen by this engine
+    };
+    
+    static int fusionOf(uint8_t kind) {
+        switch(kind) {
+            case K_LDA_LDB_ADD: return FUSE_LDA_LDB_ADD;
+            case K_INC_JZ:      return FUSE_INC_JZ;
+            case K_DEC_JZ:      return FUSE_DEC_JZ;
+            case K_LDA_ALU:     return FUSE_LDA_ALU;
+            default:            return -1;
+        }
+    }
+    
+    // Fusion hits are counted per complete block run and added up here
+    // when the block goes away, keeping counters off the per-op path
+    void foldFusionHits(Block& block) {
+        for(int k = 0; k < FUSION_KINDS; k++) fusionHits[k] += block.runs * block.fused[k];
+        block.runs = 0;
+    }
+    void foldFusionHits() {
+        if(!blockCache) return;
+        for(Block& block : blockCache->blocks) foldFusionHits(block);
+    }
+    uint64_t fusionHitCount(int k) const {
+        uint64_t hits = fusionHits[k];
+        if(blockCache) {
+            for(const Block& block : blockCache->blocks) hits += block.runs * block.fused[k];
+        }
+        return hits;
+    }
+    
+    // Superinstructions: common sequences run as one op. Each one leaves
+    // registers and the zero flag exactly as the sequence would.
+    // Fill op with a fused op for the sequence at instructions[0].
+    // Returns the number of instructions it covers, or 0 if none matches.
+    static int fuse(const uint8_t* instructions, int remaining, BlockOp& op) {
+        if(remaining < 2) return 0;
+        
+        uint8_t op0 = instructions[0] >> 4;
+        uint8_t op1 = instructions[1] >> 4;
+        uint8_t operand0 = instructions[0] & 0x0F;
+        uint8_t operand1 = instructions[1] & 0x0F;
+        
+        if(remaining > 2 && op0 == LDA && op1 == LDB && (instructions[2] >> 4) == ADD) {
+            op.kind = K_LDA_LDB_ADD;
+            op.a = operand0;
+            op.b = operand1;
+            return 3;
+        }
+        if((op0 == INC || op0 == DEC) && op1 == JZ) {
+            op.kind = (op0 == INC) ? K_INC_JZ : K_DEC_JZ;
+            op.a = operand0 & 0x03;
+            op.b = operand1;
+            return 2;
+        }
+        if(op0 == LDA && op1 == ALU && operand1 < 8) {
+            op.kind = K_LDA_ALU;
+            op.a = operand0;
+            op.b = threadedKinds()[instructions[1]];
+            return 2;
+        }
+        return 0;
+    }
+    
+    void translateBlock(uint8_t start) {
+        const uint8_t* kinds = threadedKinds();
+        Block& block = blockCache->blocks[start];
+        block.coverage = 0;
+        block.runs = 0;
+        std::memset(block.fused, 0, sizeof(block.fused));
+        
+        // Collect the instructions first so fusion can look ahead;
+        // after[k] is the PC once instructions[k] has run (and not jumped)
+        uint8_t instructions[16];
+        uint8_t after[16];
+        int length = 0;
+        uint8_t pc = start;
+        while(length < 16) {
+            uint8_t opcode = state.ram[pc] >> 4;
+            instructions[length] = state.ram[pc];
+            block.coverage |= 1 << pc;
+            pc = (opcode == JMP) ? (state.ram[pc] & 0x0F) : mask4bit(pc + 1);
+            after[length++] = pc;
+            if(opcode == JZ || opcode == HLT) break;
+        }
+        block.length = length;
+        block.endPc = pc;
+        
+        int opCount = 0;
+        for(int k = 0; k < length; ) {
+            uint8_t instruction = instructions[k];
+            if((instruction >> 4) == JMP) {
+                k++;  // Already followed
+                continue;
+            }
+            BlockOp& bop = block.ops[opCount++];
+            
+            int count = fusion ? fuse(instructions + k, length - k, bop) : 0;
+            if(count == 0) {
+                count = 1;
+                bop.kind = kinds[instruction];
+                bop.a = instruction & 0x0F;
+                bop.b = 0;
+            } else {
+                block.fused[fusionOf(bop.kind)]++;
+            }
+            k += count;
+            bop.next = after[k - 1];
+            bop.end = k;
+        }
+        block.ops[opCount].kind = K_BLOCK_END;
+        
+        blockCache->codeMask |= block.coverage;
+    }
+    
+    // Drop every block that covers RAM[addr]
+    void invalidateBlocks(uint8_t addr) {
+        uint16_t mask = 0;
+        for(Block& block : blockCache->blocks) {
+            if(block.length && (block.coverage & (1 << addr))) {
+                block.length = 0;
+                foldFusionHits(block);
+            }
+            if(block.length) mask |= block.coverage;
+        }
+        blockCache->codeMask = mask;
+    }
+    
+    int runBlocks(int maxSteps) {
+        if(!blockCache) {
+            blockCache.reset(new BlockCacheState());
+        }
+        BlockCacheState& cache = *blockCache;
+        
+        // RAM may have been changed outside this engine (loadProgram,
+        // writeMemory, another engine) since the blocks were built
+        if(std::memcmp(state.ram, cache.image, 16) != 0) {
+            for(uint8_t addr = 0; addr < 16; addr++) {
+                if((cache.codeMask & (1 << addr)) && state.ram[addr] != cache.image[addr]) {
+                    invalidateBlocks(addr);
+                }
+            }
+            std::memcpy(cache.image, state.ram, 16);
+        }
+        
+#if defined(__GNUC__)
+        // No block contains a K_JMP op: JMPs are followed at translation
+        static void* const labels[BLOCK_KINDS] = {
+            &&op_nop, &&op_lda, &&op_ldb, &&op_sta, &&op_stb, &&op_add, &&op_sub, &&op_nop,
+            &&op_jz, &&op_mov, &&op_ldm, &&op_out, &&op_inc, &&op_dec, &&op_and, &&op_or,
+            &&op_xor, &&op_not, &&op_shl, &&op_shr, &&op_rol, &&op_ror, &&op_hlt,
+            &&op_lda_ldb_add, &&op_inc_jz, &&op_dec_jz, &&op_lda_alu, &&block_done
+        };
+#define CPU4BIT_GOTO_KIND(k) goto *labels[k]
+#else
+#define CPU4BIT_GOTO_KIND(k) do { kind = (k); goto dispatch; } while(0)
+        uint8_t kind;
+#endif
+        
+        if(!state.running) return 0;
+        
+        uint8_t reg[4] = { state.reg[0], state.reg[1], state.reg[2], state.reg[3] };
+        uint8_t pc = state.pc;
+        bool zero = state.zero;
+        int remaining = maxSteps;
+        uint8_t operand, value;
+        Block* block;
+        const BlockOp* op;
+        
+        while(remaining > 0) {
+            block = &cache.blocks[pc];
+            
+            // One compare for both "not translated" (length 0) and "not
+            // enough budget for the whole block"
+            if(unsigned(block->length - 1) >= unsigned(remaining)) {
+                if(block->length == 0) translateBlock(pc);
+                if(block->length > remaining) {
+                    // Finish instruction by instruction
+                    for(int r = 0; r < 4; r++) state.reg[r] = reg[r];
+                    state.pc = pc;
+                    state.zero = zero;
+                    return maxSteps - remaining + runThreaded(remaining);
+                }
+            }
+            
+            // Only a JZ at the end of a block can change where it goes,
+            // so PC is set once up front
+            pc = block->endPc;
+            remaining -= block->length;
+            block->runs++;
+            op = block->ops;
+            
+#define CPU4BIT_NEXT_OP()                           \
+            do {                                    \
+                ++op;                               \
+                operand = op->a;                    \
+                CPU4BIT_GOTO_KIND(op->kind);        \
+            } while(0)
+            
+            operand = op->a;
+            CPU4BIT_GOTO_KIND(op->kind);
+            
+#if !defined(__GNUC__)
+        dispatch:
+            switch(kind) {
+                case K_NOP: goto op_nop;  case K_LDA: goto op_lda;  case K_LDB: goto op_ldb;
+                case K_STA: goto op_sta;  case K_STB: goto op_stb;  case K_ADD: goto op_add;
+                case K_SUB: goto op_sub;  case K_JMP: goto op_nop;  case K_JZ:  goto op_jz;
+                case K_MOV: goto op_mov;  case K_LDM: goto op_ldm;  case K_OUT: goto op_out;
+                case K_INC: goto op_inc;  case K_DEC: goto op_dec;  case K_AND: goto op_and;
+                case K_OR:  goto op_or;   case K_XOR: goto op_xor;  case K_NOT: goto op_not;
+                case K_SHL: goto op_shl;  case K_SHR: goto op_shr;  case K_ROL: goto op_rol;
+                case K_ROR: goto op_ror;  case K_HLT: goto op_hlt;
+                case K_LDA_LDB_ADD: goto op_lda_ldb_add;
+                case K_INC_JZ: goto op_inc_jz;  case K_DEC_JZ: goto op_dec_jz;
+                case K_LDA_ALU: goto op_lda_alu;
+                default: goto block_done;
+            }
+#endif
+            
+        op_nop: CPU4BIT_NEXT_OP();
+        op_lda: reg[0] = operand; CPU4BIT_NEXT_OP();
+        op_ldb: reg[1] = operand; CPU4BIT_NEXT_OP();
+        op_sta: value = reg[0]; goto store;
+        op_stb: value = reg[1]; goto store;
+        op_add: reg[0] = (reg[0] + reg[1]) & 0x0F; zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_sub: reg[0] = (reg[0] - reg[1]) & 0x0F; zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_jz:  if(zero) pc = operand; CPU4BIT_NEXT_OP();
+        op_mov: reg[operand & 0x03] = reg[(operand >> 2) & 0x03]; CPU4BIT_NEXT_OP();
+        op_ldm: reg[0] = state.ram[operand]; CPU4BIT_NEXT_OP();
+        op_out: outputLog.push_back(reg[operand & 0x03]); CPU4BIT_NEXT_OP();
+        op_inc: reg[operand & 0x03] = (reg[operand & 0x03] + 1) & 0x0F; zero = (reg[operand & 0x03] == 0); CPU4BIT_NEXT_OP();
+        op_dec: reg[operand & 0x03] = (reg[operand & 0x03] - 1) & 0x0F; zero = (reg[operand & 0x03] == 0); CPU4BIT_NEXT_OP();
+        op_and: reg[0] = aluResult<AND_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_or:  reg[0] = aluResult<OR_OP>(reg[0], reg[1]);  zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_xor: reg[0] = aluResult<XOR_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_not: reg[0] = aluResult<NOT_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_shl: reg[0] = aluResult<SHL_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_shr: reg[0] = aluResult<SHR_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_rol: reg[0] = aluResult<ROL_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_ror: reg[0] = aluResult<ROR_OP>(reg[0], reg[1]); zero = (reg[0] == 0); CPU4BIT_NEXT_OP();
+        op_hlt: state.running = false; goto halted;
+        op_lda_ldb_add: reg[0] = operand; reg[1] = op->b; goto op_add;
+        op_lda_alu: reg[0] = operand; CPU4BIT_GOTO_KIND(op->b);
+        op_inc_jz: reg[operand] = (reg[operand] + 1) & 0x0F; zero = (reg[operand] == 0); goto op_jz_fused;
+        op_dec_jz: reg[operand] = (reg[operand] - 1) & 0x0F; zero = (reg[operand] == 0); goto op_jz_fused;
+        op_jz_fused: if(zero) pc = op->b; CPU4BIT_NEXT_OP();
+            
+        store:
+            state.ram[operand] = value;
+            if(value != cache.image[operand]) {
+                cache.image[operand] = value;
+                if(cache.codeMask & (1 << operand)) {
+                    // Code was patched: leave the block, the rest of it may be stale.
+                    // The run is partial, so its fused ops are counted here.
+                    block->runs--;
+                    for(const BlockOp* f = block->ops; f != op; f++) {
+                        if(fusionOf(f->kind) >= 0) fusionHits[fusionOf(f->kind)]++;
+                    }
+                    remaining += block->length - op->end;
+                    invalidateBlocks(operand);
+                    pc = op->next;
+                    continue;
+                }
+            }
+            CPU4BIT_NEXT_OP();
+            
+#undef CPU4BIT_NEXT_OP
+        block_done:;
+        }
+#undef CPU4BIT_GOTO_KIND
+        
+    halted:
+        for(int r = 0; r < 4; r++) state.reg[r] = reg[r];
+        state.pc = pc;
+        state.zero = zero;
+        return maxSteps - remaining;
+    }
+
+#ifdef CPU4BIT_HAS_JIT
+    // ---- x86-64 JIT ----
+    // Every address in the image gets its own copy of the straight-line
+    // block starting there (up to the next JMP/JZ/HLT). Guest registers
+    // live in host registers while native code runs:
+    //   A-D = r8d-r11d, Z = dl, remaining steps = ecx,
+    //   OUT count = esi, context = rdi
+    // A block checks and charges the step budget once on entry; if fewer
+    // steps remain than the block needs, native code exits and runJit()
+    // finishes the run with the threaded interpreter. Native code also
+    // returns on HLT, when the OUT buffer fills up, and when a store
+    // changes a byte of reachable code (which then gets recompiled).
+    enum JitExit { JIT_BUDGET, JIT_HALTED, JIT_CODE_MODIFIED, JIT_OUTPUT_FULL };
+    
+    struct JitContext {
+        MachineState machine;
+        uint8_t pad;
+        uint32_t budget;
+        uint32_t outCount;
+        uint8_t out[128];
+    };
+    
+    typedef int (*JitEntry)(JitContext* context, const void* block);
+    
+    struct JitState {
+        static const size_t CODE_SIZE = 65536;
+        uint8_t* code = nullptr;
+        uint32_t blockOffset[16];
+        uint8_t image[16];   // RAM the code was compiled from
+        uint16_t reach = 0;  // Addresses reachable from the entry PC
+        bool compiled = false;
+        
+        JitState() {
+            void* p = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            code = (p == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(p);
+        }
+        ~JitState() {
+            if(code) munmap(code, CODE_SIZE);
+        }
+    };
+    
+    // Minimal x86-64 assembler for the handful of instructions we need
+    struct JitAssembler {
+        std::vector<uint8_t> bytes;
+        std::vector<int> labels;
+        std::vector<std::pair<size_t, int>> fixups;  // rel32 position, label
+        
+        int newLabel() { labels.push_back(-1); return (int)labels.size() - 1; }
+        void bind(int label) { labels[label] = (int)bytes.size(); }
+        
+        void emit(std::initializer_list<uint8_t> b) { bytes.insert(bytes.end(), b); }
+        void emit32(uint32_t v) {
+            for(int i = 0; i < 4; i++) bytes.push_back((v >> (8 * i)) & 0xFF);
+        }
+        void rel32(int label) {
+            fixups.push_back(std::make_pair(bytes.size(), label));
+            emit32(0);
+        }
+        void jmp(int label) { emit({0xE9}); rel32(label); }
+        void jz(int label)  { emit({0x0F, 0x84}); rel32(label); }
+        void jnz(int label) { emit({0x0F, 0x85}); rel32(label); }
+        void jb(int label)  { emit({0x0F, 0x82}); rel32(label); }
+        
+        void link() {
+            for(const auto& f : fixups) {
+                int32_t rel = labels[f.second] - (int32_t)(f.first + 4);
+                std::memcpy(&bytes[f.first], &rel, 4);
+            }
+        }
+        
+        // Guest register r (0-3) lives in r8d + r
+        static uint8_t modrmRR(int reg, int rm) { return 0xC0 | ((reg & 7) << 3) | (rm & 7); }
+        static uint8_t modrmDisp8(int reg) { return 0x40 | ((reg & 7) << 3) | 7; }  // [rdi+disp8]
+        
+        void movImm(int r, uint8_t value) { emit({0x41, (uint8_t)(0xB8 + r)}); emit32(value); }
+        void movRR(int dst, int src) { emit({0x45, 0x89, modrmRR(src, dst)}); }
+        void loadByte(int r, uint8_t disp) { emit({0x44, 0x0F, 0xB6, modrmDisp8(r), disp}); }
+        void storeByte(int r, uint8_t disp) { emit({0x44, 0x88, modrmDisp8(r), disp}); }
+        void cmpByte(int r, uint8_t disp) { emit({0x44, 0x38, modrmDisp8(r), disp}); }
+        void and15(int r) { emit({0x41, 0x83, modrmRR(4, r), 0x0F}); }
+        void setZero(int r) {
+            emit({0x45, 0x85, modrmRR(r, r)});  // test r, r
+            emit({0x0F, 0x94, 0xC2});           // sete dl
+        }
+        // A = (A op B) & 15 for the 01/29/21/09/31 two-register forms
+        void aluAB(uint8_t opcode) { emit({0x45, opcode, modrmRR(1, 0)}); and15(0); }
+    };
+    
+    void compileJit(uint8_t entryPC) {
+        JitState& native = *jit;
+        const uint8_t ctxReg = offsetof(JitContext, machine) + offsetof(MachineState, reg);
+        const uint8_t ctxRam = offsetof(JitContext, machine) + offsetof(MachineState, ram);
+        const uint8_t ctxPC = offsetof(JitContext, machine) + offsetof(MachineState, pc);
+        const uint8_t ctxZero = offsetof(JitContext, machine) + offsetof(MachineState, zero);
+        const uint8_t ctxRunning = offsetof(JitContext, machine) + offsetof(MachineState, running);
+        const uint8_t ctxBudget = offsetof(JitContext, budget);
+        const uint8_t ctxOutCount = offsetof(JitContext, outCount);
+        const uint8_t ctxOut = offsetof(JitContext, out);
+        
+        native.reach = reachableCode(state.ram, entryPC);
+        std::memcpy(native.image, state.ram, 16);
+        
+        JitAssembler as;
+        int block[16];
+        for(int i = 0; i < 16; i++) block[i] = as.newLabel();
+        int commonExit = as.newLabel();
+        
+        // Exits taken from inside a block give back the steps it did not run
+        struct PendingExit { int label; uint8_t pc; JitExit reason; uint8_t unused; };
+        std::vector<PendingExit> exits;
+        auto exitTo = [&](uint8_t pc, JitExit reason, uint8_t unused) {
+            PendingExit e = { as.newLabel(), pc, reason, unused };
+            exits.push_back(e);
+            return e.label;
+        };
+        
+        // Prologue: load guest state, then jump to the entry block (rsi)
+        for(int r = 0; r < 4; r++) as.loadByte(r, ctxReg + r);
+        as.emit({0x0F, 0xB6, 0x57, ctxZero});    // movzx edx, byte [rdi+zero]
+        as.emit({0x8B, 0x4F, ctxBudget});        // mov ecx, [rdi+budget]
+        as.emit({0x48, 0x89, 0xF0});             // mov rax, rsi
+        as.emit({0x8B, 0x77, ctxOutCount});      // mov esi, [rdi+outCount]
+        as.emit({0xFF, 0xE0});                   // jmp rax
+        
+        for(int start = 0; start < 16; start++) {
+            if(!(native.reach & (1 << start))) continue;
+            
+            // Block length: up to and including the first JMP/JZ/HLT
+            int length = 0;
+            for(uint8_t pc = start; length < 16; pc = (pc + 1) & 0x0F) {
+                length++;
+                uint8_t opcode = state.ram[pc] >> 4;
+                if(opcode == JMP || opcode == JZ || opcode == HLT) break;
+            }
+            
+            // The zero flag only has to be materialized if something can
+            // observe it before the next flag write: JZ, the block end, or an
+            // exit to runJit() after OUT/HLT/a store into code
+            bool flagNeeded[16];
+            bool observed = true;
+            for(int k = length - 1; k >= 0; k--) {
+                uint8_t instruction = state.ram[(start + k) & 0x0F];
+                uint8_t opcode = instruction >> 4;
+                uint8_t operand = instruction & 0x0F;
+                bool setsFlag = opcode == ADD || opcode == SUB || opcode == INC ||
+                                opcode == DEC || (opcode == ALU && operand < 8);
+                bool mayExit = opcode == OUT || opcode == HLT ||
+                               ((opcode == STA || opcode == STB) && (native.reach & (1 << operand)));
+                flagNeeded[k] = observed;
+                if(setsFlag) observed = false;
+                if(mayExit || opcode == JZ) observed = true;
+            }
+            
+            as.bind(block[start]);
+            as.emit({0x83, 0xF9, (uint8_t)length});  // cmp ecx, length
+            as.jb(exitTo(start, JIT_BUDGET, 0));
+            as.emit({0x83, 0xE9, (uint8_t)length});  // sub ecx, length
+            
+            uint8_t pc = start;
+            for(int k = 0; k < length; k++, pc = (pc + 1) & 0x0F) {
+                uint8_t instruction = state.ram[pc];
+                uint8_t opcode = instruction >> 4;
+                uint8_t operand = instruction & 0x0F;
+                uint8_t next = (pc + 1) & 0x0F;
+                uint8_t unused = length - k - 1;
+                
+                switch(opcode) {
+                    case NOP:
+                        break;
+                    case LDA:
+                        as.movImm(0, operand);
+                        break;
+                    case LDB:
+                        as.movImm(1, operand);
+                        break;
+                    case STA:
+                    case STB: {
+                        int r = (opcode == STA) ? 0 : 1;
+                        uint8_t disp = ctxRam + operand;
+                        if(native.reach & (1 << operand)) {
+                            // Storing into reachable code: leave if the byte changes
+                            as.cmpByte(r, disp);
+                            as.emit({0x74, 0x09});    // je past the store and exit
+                            as.storeByte(r, disp);
+                            as.jmp(exitTo(next, JIT_CODE_MODIFIED, unused));
+                        } else {
+                            as.storeByte(r, disp);
+                        }
+                        break;
+                    }
+                    case ADD:
+                        as.aluAB(0x01);
+                        if(flagNeeded[k]) as.setZero(0);
+                        break;
+                    case SUB:
+                        as.aluAB(0x29);
+                        if(flagNeeded[k]) as.setZero(0);
+                        break;
+                    case JMP:
+                        as.jmp(block[operand]);
+                        break;
+                    case JZ:
+                        as.emit({0x84, 0xD2});        // test dl, dl
+                        as.jnz(block[operand]);
+                        as.jmp(block[next]);
+                        break;
+                    case MOV: {
+                        int src = (operand >> 2) & 0x03;
+                        int dst = operand & 0x03;
+                        if(src != dst) as.movRR(dst, src);
+                        break;
+                    }
+                    case LDM:
+                        as.loadByte(0, ctxRam + operand);
+                        break;
+                    case OUT: {
+                        int r = operand & 0x03;
+                        // mov [rdi+rsi+out], r; inc esi; cmp esi, capacity
+                        as.emit({0x44, 0x88, (uint8_t)(0x44 | (r << 3)), 0x37, ctxOut});
+                        as.emit({0xFF, 0xC6});
+                        as.emit({0x81, 0xFE}); as.emit32(sizeof(JitContext::out));
+                        as.jz(exitTo(next, JIT_OUTPUT_FULL, unused));
+                        break;
+                    }
+                    case INC:
+                    case DEC: {
+                        int r = operand & 0x03;
+                        as.emit({0x41, 0x83, JitAssembler::modrmRR(opcode == INC ? 0 : 5, r), 0x01});
+                        as.and15(r);
+                        if(flagNeeded[k]) as.setZero(r);
+                        break;
+                    }
+                    case ALU:
+                        switch(operand) {
+                            case AND_OP: as.aluAB(0x21); break;
+                            case OR_OP:  as.aluAB(0x09); break;
+                            case XOR_OP: as.aluAB(0x31); break;
+                            case NOT_OP: as.emit({0x41, 0xF7, 0xD0}); as.and15(0); break;  // not r8d
+                            case SHL_OP: as.emit({0x41, 0xD1, 0xE0}); as.and15(0); break;  // shl r8d, 1
+                            case SHR_OP: as.emit({0x41, 0xD1, 0xE8}); as.and15(0); break;  // shr r8d, 1
+                            case ROL_OP:
+                                as.emit({0x44, 0x89, 0xC0});  // mov eax, r8d
+                                as.emit({0x83, 0xE0, 0x08});  // and eax, 8
+                                as.emit({0xC1, 0xE8, 0x03});  // shr eax, 3
+                                as.emit({0x41, 0xD1, 0xE0});  // shl r8d, 1
+                                as.emit({0x41, 0x09, 0xC0});  // or r8d, eax
+                                as.and15(0);
+                                break;
+                            case ROR_OP:
+                                as.emit({0x44, 0x89, 0xC0});  // mov eax, r8d
+                                as.emit({0x83, 0xE0, 0x01});  // and eax, 1
+                                as.emit({0xC1, 0xE0, 0x03});  // shl eax, 3
+                                as.emit({0x41, 0xD1, 0xE8});  // shr r8d, 1
+                                as.emit({0x41, 0x09, 0xC0});  // or r8d, eax
+                                as.and15(0);
+                                break;
+                        }
+                        if(operand < 8 && flagNeeded[k]) as.setZero(0);
+                        break;
+                    case HLT:
+                        as.emit({0xC6, 0x47, ctxRunning, 0x00});  // running = 0
+                        as.jmp(exitTo(next, JIT_HALTED, 0));
+                        break;
+                }
+            }
+            
+            // 16 instructions without a jump wrap back to the start address
+            uint8_t lastOpcode = state.ram[(start + length - 1) & 0x0F] >> 4;
+            if(lastOpcode != JMP && lastOpcode != JZ && lastOpcode != HLT) {
+                as.jmp(block[pc]);
+            }
+        }
+        
+        // Exits record the guest PC and a reason, then share one epilogue
+        for(const PendingExit& e : exits) {
+            as.bind(e.label);
+            if(e.unused) as.emit({0x83, 0xC1, e.unused});  // add ecx, unused
+            as.emit({0xC6, 0x47, ctxPC, e.pc});           // mov byte [rdi+pc], imm8
+            as.emit({0xB8}); as.emit32(e.reason);          // mov eax, reason
+            as.jmp(commonExit);
+        }
+        
+        as.bind(commonExit);
+        for(int r = 0; r < 4; r++) as.storeByte(r, ctxReg + r);
+        as.emit({0x88, 0x57, ctxZero});      // mov [rdi+zero], dl
+        as.emit({0x89, 0x4F, ctxBudget});    // mov [rdi+budget], ecx
+        as.emit({0x89, 0x77, ctxOutCount});  // mov [rdi+outCount], esi
+        as.emit({0xC3});                     // ret
+        
+        as.link();
+        
+        mprotect(native.code, JitState::CODE_SIZE, PROT_READ | PROT_WRITE);
+        std::memcpy(native.code, as.bytes.data(), as.bytes.size());
+        mprotect(native.code, JitState::CODE_SIZE, PROT_READ | PROT_EXEC);
+        for(int i = 0; i < 16; i++) {
+            native.blockOffset[i] = as.labels[block[i]];
+        }
+        native.compiled = true;
+    }
+    
+    // Compiled code can be reused if the reachable bytes are unchanged
+    bool jitValidFor(const uint8_t* ram, uint8_t pc) const {
+        if(!jit->compiled || !(jit->reach & (1 << pc))) return false;
+        for(int i = 0; i < 16; i++) {
+            if((jit->reach & (1 << i)) && ram[i] != jit->image[i]) return false;
+        }
+        return true;
+    }
+    
+    int runJit(int maxSteps) {
+        if(!state.running || maxSteps <= 0) return 0;
+        if(!jit) jit.reset(new JitState());
+        if(!jit->code) return runThreaded(maxSteps);
+        
+        JitContext context;
+        context.machine = state;
+        context.budget = maxSteps;
+        context.outCount = 0;
+        
+        int reason;
+        do {
+            if(!jitValidFor(context.machine.ram, context.machine.pc)) {
+                std::memcpy(state.ram, context.machine.ram, 16);
+                compileJit(context.machine.pc);
+            }
+            JitEntry entry = reinterpret_cast<JitEntry>(jit->code);
+            reason = entry(&context, jit->code + jit->blockOffset[context.machine.pc]);
+            
+            outputLog.insert(outputLog.end(), context.out, context.out + context.outCount);
+            context.outCount = 0;
+        } while(reason == JIT_CODE_MODIFIED || reason == JIT_OUTPUT_FULL);
+        
+        state = context.machine;
+        
+        // Too few steps left for the next block: finish in the interpreter
+        int steps = maxSteps - context.budget;
+        if(reason == JIT_BUDGET && context.budget > 0) {
+            steps += runThreaded(context.budget);
+        }
+        return steps;
+    }
+#else
+    int runJit(int maxSteps) {
+        return runThreaded(maxSteps);
+    }
+#endif
+
+    // ---- Counted-loop engine ----
+    // Registers an instruction reads and writes, bit n = register n
+    static void registerUse(uint8_t instruction, uint8_t& reads, uint8_t& writes) {
+        const uint8_t operand = instruction & 0x0F;
+        reads = writes = 0;
+        switch(instruction >> 4) {
+            case LDA: case LDM: writes = 1; break;
+            case LDB: writes = 2; break;
+            case STA: reads = 1; break;
+            case STB: reads = 2; break;
+            case ADD: case SUB: reads = 3; writes = 1; break;
+            case MOV: reads = 1 << ((operand >> 2) & 0x03); writes = 1 << (operand & 0x03); break;
+            case OUT: reads = 1 << (operand & 0x03); break;
+            case INC: case DEC: reads = writes = 1 << (operand & 0x03); break;
+            case ALU:
+                if(operand < 8) {
+                    reads = operand <= XOR_OP ? 3 : 1;
+                    writes = 1;
+                }
+                break;
+        }
+    }
+    
+    static bool setsZero(uint8_t instruction) {
+        const uint8_t opcode = instruction >> 4;
+        return opcode == ADD || opcode == SUB || opcode == INC || opcode == DEC ||
+               (opcode == ALU && (instruction & 0x0F) < 8);
+    }
+    
+    // Runs one iteration of the loop starting at state.pc, then applies
+    // every following iteration that takes the same path in closed form.
+    // A loop qualifies if it has no store or HLT and changes at most one
+    // register, the counter, with a single INC/DEC that nothing but OUT
+    // reads. Iterations then differ only in the counter value, so the
+    // JZs that test it pick the counter values at which the path changes.
+    // Returns the steps taken; qualified is false for other loops.
+    int skipCountedLoop(int budget, bool& qualified) {
+        struct PathStep {
+            uint8_t instruction;
+            uint8_t zero;    // Zero flag after the instruction
+            uint8_t value;   // Value written by OUT
+        };
+        PathStep path[16];
+        const MachineState start = state;
+        const uint8_t head = state.pc;
+        uint16_t visited = 0;
+        int length = 0;
+        qualified = false;
+        
+        // One iteration with the reference semantics, recording the path
+        do {
+            if(length == 16 || length == budget || (visited & (1 << state.pc))) return length;
+            visited |= 1 << state.pc;
+            const uint8_t instruction = state.ram[state.pc];
+            execute(state, instruction, outputLog);
+            PathStep& p = path[length++];
+            p.instruction = instruction;
+            p.zero = state.zero;
+            p.value = (instruction >> 4) == OUT ? outputLog.back() : 0;
+            const uint8_t opcode = instruction >> 4;
+            if(opcode == STA || opcode == STB || opcode == HLT) return length;
+        } while(state.pc != head);
+        
+        int counter = -1;
+        for(int r = 0; r < 4; r++) {
+            if(state.reg[r] == start.reg[r]) continue;
+            if(counter >= 0) return length;
+            counter = r;
+        }
+        int counterAt = -1;
+        uint8_t delta = 0;
+        int outs = 0;
+        for(int i = 0; i < length; i++) {
+            const uint8_t opcode = path[i].instruction >> 4;
+            outs += opcode == OUT;
+            uint8_t reads, writes;
+            registerUse(path[i].instruction, reads, writes);
+            if(counter < 0 || !((reads | writes) & (1 << counter)) || opcode == OUT) continue;
+            if((opcode != INC && opcode != DEC) || counterAt >= 0) return length;
+            counterAt = i;
+            delta = opcode == INC ? 1 : 15;
+        }
+        qualified = true;
+        
+        // From the next iteration on, each JZ reads the flag set by the
+        // nearest flag-setting instruction before it, maybe in the previous
+        // iteration. follows has bit c set if an iteration starting with
+        // counter c takes the recorded path.
+        uint16_t follows = 0xFFFF;
+        auto lastSetter = [&](int before) {
+            for(int back = 1; back <= length; back++) {
+                int i = (before - back + length) % length;
+                if(setsZero(path[i].instruction)) return i;
+            }
+            return -1;
+        };
+        for(int j = 0; j < length; j++) {
+            if((path[j].instruction >> 4) != JZ) continue;
+            const bool taken = path[j].zero;
+            const int source = lastSetter(j);
+            if(source >= 0 && source == counterAt) {
+                for(int c = 0; c < 16; c++) {
+                    uint8_t value = source < j ? (c + delta) & 0x0F : c;
+                    if((value == 0) != taken) follows &= ~(1 << c);
+                }
+            } else if((source >= 0 ? path[source].zero : state.zero) != taken) {
+                return length;
+            }
+        }
+        
+        // Iterations that repeat the path: up to the first counter value
+        // that leaves it, or as many as fit in the budget
+        const uint8_t first = counter >= 0 ? state.reg[counter] : 0;
+        int iterations = (budget - length) / length;
+        if(follows != 0xFFFF) {
+            int same = 0;
+            for(uint8_t c = first; same < iterations && (follows & (1 << c)); c = (c + delta) & 0x0F) same++;
+            iterations = same;
+        }
+        if(iterations == 0) return length;
+        
+        if(outs) {
+            outputLog.reserve(outputLog.size() + (size_t)iterations * outs);
+            uint8_t c = first;
+            for(int n = 0; n < iterations; n++, c = (c + delta) & 0x0F) {
+                for(int i = 0; i < length; i++) {
+                    if((path[i].instruction >> 4) != OUT) continue;
+                    if(counter >= 0 && (path[i].instruction & 0x03) == counter) {
+                        outputLog.push_back(i < counterAt ? c : (c + delta) & 0x0F);
+                    } else {
+                        outputLog.push_back(path[i].value);
+                    }
+                }
+            }
+        }
+        if(counter >= 0) {
+            state.reg[counter] = (first + iterations * delta) & 0x0F;
+            if(lastSetter(length) == counterAt) state.zero = state.reg[counter] == 0;
+        }
+        return length + iterations * length;
+    }
+    
+    int runCountedLoops(int maxSteps) {
+        // Heads of loops that did not qualify are retried with backoff
+        uint8_t skip[16] = {}, backoff[16] = {};
+        
+        // State at each head, saved at visits 1, 2, 4, ... (Brent). A 4-bit
+        // counter wraps within 16 iterations, so a loop that keeps running
+        // comes back to an identical state, and from then on repeats the
+        // same steps and OUT values: whole periods are skipped at once.
+        struct Seen {
+            MachineState state;
+            int steps;
+            size_t out;
+            uint32_t visits;
+            uint32_t nextSave;
+        };
+        Seen seen[16];
+        for(Seen& s : seen) {
+            s.visits = 0;
+            s.nextSave = 1;
+        }
+        
+        int steps = 0;
+        while(state.running && steps < maxSteps) {
+            const uint8_t pc = state.pc;
+            const uint8_t instruction = state.ram[pc];
+            execute(state, instruction, outputLog);
+            steps++;
+            
+            // A jump that does not move forward lands on a loop head
+            const uint8_t opcode = instruction >> 4;
+            if((opcode != JMP && opcode != JZ) || state.pc > pc || !state.running) continue;
+            const uint8_t head = state.pc;
+            
+            Seen& s = seen[head];
+            if(s.visits && state == s.state) {
+                const int period = steps - s.steps;
+                const int periods = (maxSteps - steps) / period;
+                const size_t begin = s.out, length = outputLog.size() - s.out;
+                outputLog.resize(outputLog.size() + periods * length);
+                for(int n = 1; n <= periods; n++) {
+                    std::copy_n(outputLog.begin() + begin, length, outputLog.begin() + begin + n * length);
+                }
+                steps += periods * period;
+                s.visits = 0;
+                s.nextSave = 1;
+                continue;
+            }
+            if(++s.visits == s.nextSave) {
+                s.state = state;
+                s.steps = steps;
+                s.out = outputLog.size();
+                s.nextSave *= 2;
+            }
+            
+            if(skip[head]) {
+                skip[head]--;
+                continue;
+            }
+            bool qualified;
+            steps += skipCountedLoop(maxSteps - steps, qualified);
+            backoff[head] = qualified ? 0 : std::min(2 * backoff[head] + 1, 63);
+            skip[head] = backoff[head];
+        }
+        return steps;
+    }
+
+    // ---- Jump-table engine ----
+    // Without STA/STB the RAM never changes, and with 4-bit registers the
+    // rest of the machine is one of 2^21 states: PC, zero flag and A-D.
+    // Each state reached so far gets a slot; level k of the table gives
+    // the slot 2^k steps on, so N steps cost O(log N) lookups. States about
+    // to execute OUT or HLT have no successor in the table (JUMP_STOP) and
+    // are stepped normally, which keeps OUT values and halting exact.
+    static constexpr uint32_t JUMP_STATES = 1u << 21;
+    static constexpr uint32_t JUMP_NONE = 0xFFFFFFFF;
+    static constexpr uint32_t JUMP_STOP = 0xFFFFFFFE;
+    
+    struct JumpTableState {
+        uint8_t image[16];
+        bool usable = false;                        // Image is store-free
+        std::vector<uint32_t> slots;                // State code -> slot, JUMP_NONE if unseen
+        std::vector<uint32_t> codes;                // Slot -> state code
+        std::vector<std::vector<uint32_t>> levels;  // levels[k][slot]: slot 2^k steps on
+    };
+    
+    struct DiscardOutput {
+        void push_back(uint8_t) {}
+    };
+    
+    static uint32_t jumpCode(const MachineState& s) {
+        return s.pc | (s.zero << 4) | (s.reg[0] << 5) | (s.reg[1] << 9) | (s.reg[2] << 13) | (s.reg[3] << 17);
+    }
+    
+    static void decodeJump(uint32_t code, MachineState& s) {
+        s.pc = code & 0x0F;
+        s.zero = (code >> 4) & 1;
+        for(int r = 0; r < 4; r++) s.reg[r] = (code >> (5 + 4 * r)) & 0x0F;
+    }
+    
+    // No stores, and LDM can only load 4-bit values
+    static bool storeFree(const uint8_t* ram) {
+        for(int i = 0; i < 16; i++) {
+            const uint8_t opcode = ram[i] >> 4;
+            if(opcode == STA || opcode == STB) return false;
+            if(opcode == LDM && ram[ram[i] & 0x0F] > MASK_4BIT) return false;
+        }
+        return true;
+    }
+    
+    size_t jumpTableBytes(size_t slotCount, size_t levelCount) const {
+        return (JUMP_STATES + slotCount * (1 + levelCount)) * sizeof(uint32_t);
+    }
+    
+    // Give the state code and everything reachable from it a slot, then
+    // fill every level for the new slots. False if over the memory limit.
+    bool exploreJumps(uint32_t start) {
+        JumpTableState& t = *jumpTable;
+        if(t.slots.empty()) t.slots.assign(JUMP_STATES, JUMP_NONE);
+        if(t.levels.empty()) t.levels.resize(1);
+        if(t.slots[start] != JUMP_NONE) return true;
+        
+        const size_t first = t.codes.size();
+        auto add = [&](uint32_t code) {
+            if(jumpTableBytes(t.codes.size() + 1, t.levels.size()) > jumpTableLimit) return false;
+            t.slots[code] = t.codes.size();
+            t.codes.push_back(code);
+            return true;
+        };
+        if(!add(start)) return false;
+        
+        // Slots are handed out in discovery order, so the new ones form a queue
+        MachineState m;
+        std::memcpy(m.ram, t.image, 16);
+        m.running = 1;
+        DiscardOutput discard;
+        for(size_t slot = first; slot < t.codes.size(); slot++) {
+            decodeJump(t.codes[slot], m);
+            const uint8_t instruction = m.ram[m.pc];
+            const uint8_t opcode = instruction >> 4;
+            uint32_t next = JUMP_STOP;
+            if(opcode != HLT) {
+                execute(m, instruction, discard);
+                const uint32_t code = jumpCode(m);
+                if(t.slots[code] == JUMP_NONE && !add(code)) return false;
+                if(opcode != OUT) next = t.slots[code];
+            }
+            t.levels[0].push_back(next);
+        }
+        
+        for(size_t k = 1; k < t.levels.size(); k++) {
+            const std::vector<uint32_t>& half = t.levels[k - 1];
+            std::vector<uint32_t>& level = t.levels[k];
+            for(size_t slot = first; slot < t.codes.size(); slot++) {
+                const uint32_t mid = half[slot];
+                level.push_back(mid == JUMP_STOP ? JUMP_STOP : half[mid]);
+            }
+        }
+        return true;
+    }
+    
+    // Levels up to 2^(count-1) steps
+    bool addJumpLevels(size_t count) {
+        JumpTableState& t = *jumpTable;
+        if(t.levels.size() >= count) return true;
+        if(jumpTableBytes(t.codes.size(), count) > jumpTableLimit) return false;
+        while(t.levels.size() < count) {
+            const std::vector<uint32_t>& half = t.levels.back();
+            std::vector<uint32_t> level(half.size());
+            for(size_t slot = 0; slot < half.size(); slot++) {
+                level[slot] = half[slot] == JUMP_STOP ? JUMP_STOP : half[half[slot]];
+            }
+            t.levels.push_back(std::move(level));
+        }
+        return true;
+    }
+    
+    // Forget every slot, keeping the index allocated for the next image
+    void dropJumpTable(bool usable) {
+        JumpTableState& t = *jumpTable;
+        t.usable = usable;
+        for(uint32_t code : t.codes) t.slots[code] = JUMP_NONE;
+        t.codes.clear();
+        t.levels.clear();
+    }
+    
+    int runJumpTable(int maxSteps) {
+        if(!state.running || maxSteps <= 0) return 0;
+        if(!jumpTable) {
+            jumpTable.reset(new JumpTableState());
+            std::memcpy(jumpTable->image, state.ram, 16);
+            jumpTable->usable = storeFree(state.ram);
+        }
+        JumpTableState& t = *jumpTable;
+        if(std::memcmp(t.image, state.ram, 16) != 0) {
+            std::memcpy(t.image, state.ram, 16);
+            dropJumpTable(storeFree(state.ram));
+        }
+        bool wide = false;
+        for(uint8_t value : state.reg) wide |= value > MASK_4BIT;
+        size_t levelCount = 1;
+        while(levelCount < 31 && (1 << levelCount) <= maxSteps) levelCount++;
+        if(!t.usable || wide || jumpTableBytes(1, levelCount) > jumpTableLimit) return runThreaded(maxSteps);
+        
+        int steps = 0;
+        while(state.running && steps < maxSteps) {
+            const uint32_t code = jumpCode(state);
+            if(!exploreJumps(code) || !addJumpLevels(levelCount)) {
+                // Over the memory limit: plain stepping for this image
+                dropJumpTable(false);
+                std::vector<uint32_t>().swap(t.slots);
+                std::vector<uint32_t>().swap(t.codes);
+                std::vector<std::vector<uint32_t>>().swap(t.levels);
+                return steps + runThreaded(maxSteps - steps);
+            }
+            
+            // Longest jump that stays within the budget and before OUT/HLT
+            uint32_t slot = t.slots[code];
+            for(int k = (int)levelCount - 1; k >= 0; k--) {
+                const uint32_t next = t.levels[k][slot];
+                if(next != JUMP_STOP && (1 << k) <= maxSteps - steps) {
+                    slot = next;
+                    steps += 1 << k;
+                }
+            }
+            decodeJump(t.codes[slot], state);
+            if(steps < maxSteps) {
+                execute(state, state.ram[state.pc], outputLog);
+                steps++;
+            }
+        }
+        return steps;
+    }
+
+    // ---- Cycle detection ----
+    // One untraced step from s
+    MachineState nextState(const MachineState& s) {
+        state = s;
+        execute(state.ram[state.pc]);
+        return state;
+    }
+    
+    // The machine is deterministic with finite state, so revisiting a
+    // state means it loops forever. Brent's algorithm finds the cycle
+    // length with one saved state and a compare per step; the cycle
+    // start is then found by replaying from the initial state.
+    int runDetectingCycles(int maxSteps) {
+        const MachineState initial = state;
+        MachineState saved = initial;
+        int power = 1;
+        int lambda = 0;
+        int steps = 0;
+        
+        while(state.running && steps < maxSteps) {
+            if(traceMode == TraceMode::Silent && !timeTravel) {
+                runPredecoded(1);
+            } else {
+                step();
+            }
+            steps++;
+            lambda++;
+            
+            MachineState current = state;
+            if(current == saved) {
+                cycle.detected = true;
+                cycle.length = lambda;
+                break;
+            }
+            if(lambda == power) {
+                saved = current;
+                power *= 2;
+                lambda = 0;
+            }
+        }
+        
+        if(cycle.detected) {
+            // Walk a tortoise from the start and a hare cycle.length ahead
+            // until they meet; OUT values from the replay are discarded.
+            const MachineState stopped = state;
+            const size_t outputs = outputLog.size();
+            MachineState tortoise = initial;
+            MachineState hare = initial;
+            for(int i = 0; i < cycle.length; i++) hare = nextState(hare);
+            while(tortoise != hare) {
+                tortoise = nextState(tortoise);
+                hare = nextState(hare);
+                cycle.start++;
+            }
+            state = stopped;
+            outputLog.resize(outputs);
+            
+            if(traceMode != TraceMode::Silent) {
+                traceStream() << "Infinite loop detected: cycle starts at step " << cycle.start
+                              << ", length " << cycle.length << std::endl;
+            }
+        } else if(steps >= maxSteps && traceMode != TraceMode::Silent) {
+            traceStream() << "Max steps reached!" << std::endl;
+        }
+        return steps;
+    }
+
+    // ---- Reverse execution ----
+    // Register or RAM byte an instruction overwrites, besides PC and flags
+    static uint8_t undoSlot(uint8_t instruction) {
+        uint8_t operand = instruction & 0x0F;
+        switch(instruction >> 4) {
+            case LDA: case ADD: case SUB: case LDM: case ALU: return 0;
+            case LDB: return 1;
+            case STA: case STB: return 4 + operand;
+            case MOV: case INC: case DEC: return operand & 0x03;
+            default: return NO_SLOT;  // NOP, JMP, JZ, OUT, HLT
+        }
+    }
+    
+    void discardHistory() {
+        checkpoints.clear();
+        checkpointOutputs.clear();
+        undoLog.clear();
+        historyStep = 0;
+        logBase = 0;
+    }
+    
+    void pushCheckpoint() {
+        checkpoints.push(state);
+        checkpointOutputs.push_back(outputLog.size());
+    }
+    
+    // Log what instruction is about to overwrite
+    void recordStep(uint8_t instruction) {
+        if(checkpoints.size() == 0) {
+            pushCheckpoint();
+        } else if(historyStep - logBase == historyInterval) {
+            // The undo log only spans one interval. After a rewind the
+            // checkpoint may already be there.
+            logBase = historyStep;
+            undoLog.clear();
+            if(checkpoints.size() == (size_t)(logBase / historyInterval)) pushCheckpoint();
+        }
+        UndoRecord r;
+        r.flags = state.pc | (state.zero << 4) | ((instruction >> 4) == OUT ? 0x20 : 0);
+        r.slot = undoSlot(instruction);
+        r.old = (r.slot == NO_SLOT) ? 0 : (r.slot < 4) ? state.reg[r.slot] : state.ram[r.slot - 4];
+        undoLog.push_back(r);
+        historyStep++;
+    }
+    
+    void undoStep() {
+        const UndoRecord r = undoLog.back();
+        undoLog.pop_back();
+        if(r.slot < 4) {
+            state.reg[r.slot] = r.old;
+        } else if(r.slot != NO_SLOT) {
+            state.ram[r.slot - 4] = r.old;
+        }
+        if(r.flags & 0x20) outputLog.pop_back();
+        state.pc = r.flags & 0x0F;
+        state.zero = (r.flags >> 4) & 1;
+        state.running = 1;  // Only a running CPU steps
+        historyStep--;
+    }
+    
+    // Run with the configured engine, bypassing the result cache.
+    // Tracing always goes through the reference step() loop.
+    int runUncached(int maxSteps) {
+        cycle = CycleInfo();
+        if(cycleDetection) {
+            return runDetectingCycles(maxSteps);
+        }
+        if(traceMode == TraceMode::Silent && !timeTravel) {
+            switch(engine) {
+                case Engine::Predecoded: return runPredecoded(maxSteps);
+                case Engine::Threaded: return runThreaded(maxSteps);
+                case Engine::BlockCache: return runBlocks(maxSteps);
+                case Engine::JIT: return runJit(maxSteps);
+                case Engine::CountedLoop: return runCountedLoops(maxSteps);
+                case Engine::JumpTable: return runJumpTable(maxSteps);
+                case Engine::Interpreter: break;
+            }
+        }
+        
+        int steps = 0;
+        while(state.running && steps < maxSteps) {
+            step();
+            steps++;
+        }
+        if(steps >= maxSteps && traceMode != TraceMode::Silent) {
+            traceStream() << "Max steps reached!" << std::endl;
+        }
+        return steps;
+    }
+
+    // run() without recording: through the result cache when it applies
+    int runMemoized(int maxSteps) {
+        if(!resultCache || !pristine || traceMode != TraceMode::Silent || timeTravel) {
+            pristine = false;
+            return runUncached(maxSteps);
+        }
+        
+        ResultCache::Key key;
+        std::memcpy(key.image, state.ram, 16);
+        key.maxSteps = maxSteps;
+        key.detectCycles = cycleDetection;
+        if(const ResultCache::Result* hit = resultCache->find(key)) {
+            state = hit->state;
+            outputLog = hit->output;
+            cycle = hit->cycle;
+            pristine = false;
+            return hit->steps;
+        }
+        
+        ResultCache::Result result;
+        result.steps = runUncached(maxSteps);
+        result.state = state;
+        result.output = outputLog;
+        result.cycle = cycle;
+        resultCache->insert(key, result);
+        pristine = false;
+        return result.steps;
+    }
+
+public:
+    // Instruction opcodes (4-bit)
+    enum Opcode {
+        NOP   = 0x0,  // No operation
+        LDA   = 0x1,  // Load immediate to A
+        LDB   = 0x2,  // Load immediate to B
+        STA   = 0x3,  // Store A to memory
+        STB   = 0x4,  // Store B to memory
+        ADD   = 0x5,  // Add B to A (result in A)
+        SUB   = 0x6,  // Subtract B from A (result in A)
+        JMP   = 0x7,  // Jump to address
+        JZ    = 0x8,  // Jump if zero flag set
+        MOV   = 0x9,  // Move between registers
+        LDM   = 0xA,  // Load from memory to A
+        OUT   = 0xB,  // Output register value
+        INC   = 0xC,  // Increment register
+        DEC   = 0xD,  // Decrement register
+        ALU   = 0xE,  // Extended ALU operations (uses operand for sub-opcode)
+        HLT   = 0xF   // Halt
+    };
+    
+    // ALU sub-opcodes (used when opcode = 0xE)
+    enum ALUOp {
+        AND_OP = 0x0,  // A & B -> A
+        OR_OP  = 0x1,  // A | B -> A
+        XOR_OP = 0x2,  // A ^ B -> A
+        NOT_OP = 0x3,  // ~A -> A
+        SHL_OP = 0x4,  // A << 1 -> A (shift left)
+        SHR_OP = 0x5,  // A >> 1 -> A (shift right)
+        ROL_OP = 0x6,  // Rotate A left
+        ROR_OP = 0x7   // Rotate A right
+    };
+    
+    CPU4Bit() {
+        reset();
+    }
+    
+    // Copies take the machine state, output and settings; engine caches
+    // are rebuilt on first use
+    CPU4Bit(const CPU4Bit& other) {
+        *this = other;
+    }
+    
+    CPU4Bit& operator=(const CPU4Bit& other) {
+        if(this == &other) return *this;
+        state = other.state;
+        outputLog = other.outputLog;
+        engine = other.engine;
+        cycleDetection = other.cycleDetection;
+        cycle = other.cycle;
+        resultCache = other.resultCache;
+        pristine = other.pristine;
+        recorder = nullptr;  // One log, one writer
+        recordedAny = false;
+        blockCache.reset();
+        fusion = other.fusion;
+        for(int k = 0; k < FUSION_KINDS; k++) fusionHits[k] = other.fusionHitCount(k);
+        jit.reset();
+        jumpTable.reset();
+        jumpTableLimit = other.jumpTableLimit;
+        timeTravel = other.timeTravel;
+        historyInterval = other.historyInterval;
+        historyStep = other.historyStep;
+        logBase = other.logBase;
+        checkpoints = other.checkpoints;
+        checkpointOutputs = other.checkpointOutputs;
+        undoLog = other.undoLog;
+        traceMode = other.traceMode;
+        clearTrace();
+        traceBuffer << other.traceBuffer.str();
+        return *this;
+    }
+    
+    void reset() {
+        // Clear registers, flags and RAM
+        state = MachineState();
+        state.running = 1;
+        
+        outputLog.clear();
+        discardHistory();
+        pristine = true;
+    }
+    
+    // Load program into RAM
+    void loadProgram(const std::vector<uint8_t>& program) {
+        loadProgram(program.data(), program.size());
+    }
+    
+    // Load from raw bytes, e.g. an image inside a mapped corpus
+    void loadProgram(const uint8_t* image, size_t size = 16) {
+        std::memcpy(state.ram, image, std::min<size_t>(size, 16));
+        discardHistory();
+    }
+    
+    // Execute one instruction
+    void step() {
+        if(!state.running) return;
+        
+        pristine = false;
+        
+        // Fetch instruction
+        uint8_t instruction = state.ram[state.pc];
+        if(timeTravel) recordStep(instruction);
+        
+#ifndef CPU4BIT_DISABLE_TRACE
+        if(traceMode != TraceMode::Silent) {
+            uint8_t fetchPC = state.pc;
+            execute(instruction);
+            traceInstruction(fetchPC, instruction);
+            return;
+        }
+#endif
+        execute(instruction);
+    }
+    
+    // Run until halt, returns the number of instructions executed
+    int run(int maxSteps = 100) {
+        if(!recorder) return runMemoized(maxSteps);
+        
+        if(!recordedAny || state != recordedState) recorder->appendState(state);
+        const size_t mark = outputLog.size();
+        int steps = runMemoized(maxSteps);
+        recorder->appendRun(cycleDetection, steps, outputLog.data() + mark, outputLog.size() - mark, state);
+        recordedState = state;
+        recordedAny = true;
+        return steps;
+    }
+    
+    // Record every run() into log (nullptr to stop). Runs are appended to
+    // whatever the log already holds. The log is not owned by the CPU.
+    void setRecorder(ExecutionLog* log) {
+        recorder = log;
+        recordedAny = false;
+    }
+    ExecutionLog* getRecorder() const { return recorder; }
+    
+    // Replay a log on this CPU with its current engine, untraced and
+    // unrecorded, checking each run's step count, OUT values and final
+    // state. Stops at the first run that differs. Runs recorded with cycle
+    // detection step on the predecoded engine whatever the CPU's engine is;
+    // they are counted in predecodedRuns.
+    ReplayReport replay(const ExecutionLog& log) {
+        ReplayReport report;
+        if(!log.validHeader()) {
+            report.ok = false;
+            report.malformed = true;
+            return report;
+        }
+        
+        ExecutionLog* const savedRecorder = recorder;
+        const TraceMode savedTrace = traceMode;
+        const bool savedTimeTravel = timeTravel;
+        const bool savedDetection = cycleDetection;
+        recorder = nullptr;
+        traceMode = TraceMode::Silent;
+        timeTravel = false;
+        // Replayed steps are not recorded, so the old history no longer fits
+        discardHistory();
+        
+        ExecutionLog::Record record;
+        size_t offset = ExecutionLog::HEADER_SIZE;
+        while(offset < log.data().size()) {
+            if(!log.next(offset, record) || record.steps > (uint32_t)INT32_MAX) {
+                report.ok = false;
+                report.malformed = true;
+                break;
+            }
+            if(record.type == ExecutionLog::SET_STATE) {
+                restore(record.state);
+                outputLog.clear();
+                continue;
+            }
+            cycleDetection = record.detectCycles;
+            const size_t mark = outputLog.size();
+            int steps = runUncached(record.steps);
+            pristine = false;
+            report.steps += steps;
+            if((uint32_t)steps != record.steps || state != record.state ||
+               outputLog.size() - mark != record.outCount ||
+               !std::equal(record.out, record.out + record.outCount, outputLog.begin() + mark)) {
+                report.ok = false;
+                report.mismatchRun = report.runs;
+                break;
+            }
+            if(record.detectCycles) report.predecodedRuns++;
+            report.runs++;
+        }
+        
+        recorder = savedRecorder;
+        traceMode = savedTrace;
+        timeTravel = savedTimeTravel;
+        cycleDetection = savedDetection;
+        return report;
+    }
+    
+    // Memoize runs that start from reset() + loadProgram() in cache
+    // (nullptr to turn off). The cache is not owned by the CPU.
+    void setResultCache(ResultCache* cache) { resultCache = cache; }
+    ResultCache* getResultCache() const { return resultCache; }
+    
+    // Addresses that can execute starting from pc, assuming the code does
+    // not change. Jump targets are immediates, so this is a static walk.
+    static uint16_t reachableCode(const uint8_t* ram, uint8_t pc) {
+        uint16_t reach = 0;
+        uint8_t pending[16];
+        int count = 0;
+        pending[count++] = pc & 0x0F;
+        reach |= 1 << (pc & 0x0F);
+        while(count > 0) {
+            uint8_t addr = pending[--count];
+            uint8_t opcode = ram[addr] >> 4;
+            uint8_t operand = ram[addr] & 0x0F;
+            uint8_t successors[2];
+            int n = 0;
+            if(opcode == JMP) {
+                successors[n++] = operand;
+            } else if(opcode == JZ) {
+                successors[n++] = operand;
+                successors[n++] = (addr + 1) & 0x0F;
+            } else if(opcode != HLT) {
+                successors[n++] = (addr + 1) & 0x0F;
+            }
+            for(int i = 0; i < n; i++) {
+                if(!(reach & (1 << successors[i]))) {
+                    reach |= 1 << successors[i];
+                    pending[count++] = successors[i];
+                }
+            }
+        }
+        return reach;
+    }
+    
+    // Engine configuration
+    void setEngine(Engine e) { engine = e; }
+    Engine getEngine() const { return engine; }
+    
+    // Stop run() early when the machine revisits a state. lastCycle()
+    // describes the loop found by the most recent run().
+    void setCycleDetection(bool enabled) { cycleDetection = enabled; }
+    bool getCycleDetection() const { return cycleDetection; }
+    const CycleInfo& lastCycle() const { return cycle; }
+    
+    // Memory for Engine::JumpTable's tables, including the 8 MB state
+    // index; images that need more run on the Threaded engine
+    void setJumpTableLimit(size_t bytes) {
+        jumpTableLimit = bytes;
+        jumpTable.reset();
+    }
+    size_t getJumpTableLimit() const { return jumpTableLimit; }
+    
+    // Superinstruction fusion (Engine::BlockCache)
+    void setFusion(bool enabled) {
+        fusion = enabled;
+        foldFusionHits();
+        blockCache.reset();  // Blocks were built with the old setting
+    }
+    bool getFusion() const { return fusion; }
+    void clearFusionStats() {
+        for(uint64_t& hits : fusionHits) hits = 0;
+        if(blockCache) {
+            for(Block& block : blockCache->blocks) block.runs = 0;
+        }
+    }
+    
+    void printFusionReport(std::ostream& out = std::cout) const {
+        static const char* const names[FUSION_KINDS] = {
+            "LDA #n; LDB #m; ADD", "INC r; JZ addr", "DEC r; JZ addr", "LDA #n; ALU op"
+        };
+        out << "\n=== Fusion Report ===" << std::endl;
+        for(int i = 0; i < FUSION_KINDS; i++) {
+            out << std::left << std::setw(22) << names[i] << std::right << fusionHitCount(i) << std::endl;
+        }
+    }
+    
+    // State access
+    uint8_t getRegisterValue(uint8_t regNum) const {
+        return const_cast<CPU4Bit*>(this)->getRegister(regNum);
+    }
+    void setRegisterValue(uint8_t regNum, uint8_t value) {
+        getRegister(regNum) = value;
+        discardHistory();
+        pristine = false;
+    }
+    uint8_t getPC() const { return state.pc; }
+    void setPC(uint8_t value) {
+        state.pc = mask4bit(value);
+        discardHistory();
+        pristine = false;
+    }
+    bool getZeroFlag() const { return state.zero; }
+    void setZeroFlag(bool value) {
+        state.zero = value;
+        discardHistory();
+        pristine = false;
+    }
+    bool isRunning() const { return state.running; }
+    uint8_t readMemory(uint8_t addr) const { return state.ram[addr & 0x0F]; }
+    void writeMemory(uint8_t addr, uint8_t value) {
+        state.ram[addr & 0x0F] = value;
+        discardHistory();
+    }
+    
+    // run() on a bare state: reference semantics, untraced. OUT values go
+    // to out.push_back(). Returns the number of instructions executed.
+    template<typename Output>
+    static int runState(MachineState& s, int maxSteps, Output& out) {
+        int steps = 0;
+        while(s.running && steps < maxSteps) {
+            execute(s, s.ram[s.pc], out);
+            steps++;
+        }
+        return steps;
+    }
+    
+    // One step of the reference semantics on a bare state; a halted state
+    // maps to itself. *out gets the OUT value, or -1.
+    static MachineState successor(const MachineState& s, int* out = nullptr) {
+        struct LastOut {
+            int value = -1;
+            void push_back(uint8_t v) { value = v; }
+        } sink;
+        MachineState next = s;
+        if(next.running) execute(next, next.ram[next.pc], sink);
+        if(out) *out = sink.value;
+        return next;
+    }
+    
+    // Snapshots: the full machine state by value, no heap allocation.
+    // OUT values are not part of a snapshot; restore() leaves them alone.
+    MachineState snapshot() const { return state; }
+    void restore(const MachineState& s) {
+        state = s;
+        discardHistory();
+        pristine = false;
+    }
+    
+    // Make child a copy of this CPU (state, OUT values and settings) that
+    // can then run its own branch. Reuses the child's buffers and engine
+    // caches, so a warmed-up child forks without allocating.
+    void fork(CPU4Bit& child) const {
+        if(&child == this) return;
+        child.state = state;
+        child.outputLog.assign(outputLog.begin(), outputLog.end());
+        child.engine = engine;
+        child.cycleDetection = cycleDetection;
+        child.cycle = cycle;
+        child.resultCache = resultCache;
+        child.pristine = pristine;
+        if(child.fusion != fusion) {
+            child.foldFusionHits();
+            child.blockCache.reset();
+        }
+        child.fusion = fusion;
+        if(child.jumpTableLimit != jumpTableLimit) {
+            child.jumpTableLimit = jumpTableLimit;
+            child.jumpTable.reset();
+        }
+        child.timeTravel = timeTravel;
+        child.historyInterval = historyInterval;
+        child.discardHistory();  // The child's history starts at the fork
+        child.traceMode = traceMode;
+    }
+    
+    // Time travel: while on, every step is recorded so it can be undone.
+    // Memory is one 23-byte checkpoint per checkpointInterval steps plus
+    // at most checkpointInterval 3-byte undo records; stepping back across
+    // a checkpoint replays at most one interval. Engines are bypassed while
+    // recording. Changing registers, PC, flags or RAM from outside starts
+    // a new history.
+    void setTimeTravel(bool enabled, int checkpointInterval = 64) {
+        timeTravel = enabled;
+        historyInterval = std::max(1, checkpointInterval);
+        discardHistory();
+    }
+    bool getTimeTravel() const { return timeTravel; }
+    
+    // Steps recorded so far, i.e. the current position in the history
+    int historyPosition() const { return historyStep; }
+    
+    // Move to the state after n recorded steps. Going back undoes steps,
+    // going forward executes them (untraced). False if the CPU halts
+    // before reaching step n.
+    bool seekStep(int n) {
+        if(!timeTravel || n < 0) return false;
+        pristine = false;
+        if(n < logBase) {
+            // Rebuild the undo log from the checkpoint at or before n
+            int c = n / historyInterval;
+            state = checkpoints[c];
+            outputLog.resize(checkpointOutputs[c]);
+            historyStep = logBase = c * historyInterval;
+            undoLog.clear();
+        }
+        while(historyStep > n) undoStep();
+        while(historyStep < n && state.running) {
+            uint8_t instruction = state.ram[state.pc];
+            recordStep(instruction);
+            execute(instruction);
+        }
+        return historyStep == n;
+    }
+    
+    // Undo the last step; false at the start of the history
+    bool stepBack() {
+        return historyStep > 0 && seekStep(historyStep - 1);
+    }
+    
+    // Step back until the next instruction is the one at pc; false (at the
+    // start of the history) if no earlier step was there
+    bool runBackTo(uint8_t pc) {
+        while(stepBack()) {
+            if(state.pc == mask4bit(pc)) return true;
+        }
+        return false;
+    }
+    
+    // Architectural comparison (registers, PC, flags, RAM and OUT values)
+    bool sameState(const CPU4Bit& other) const {
+        return state == other.state && outputLog == other.outputLog;
+    }
+    
+    // Trace configuration
+    void setTraceMode(TraceMode mode) { traceMode = mode; }
+    TraceMode getTraceMode() const { return traceMode; }
+    
+    // Text collected in Buffered mode
+    std::string traceText() const { return traceBuffer.str(); }
+    void clearTrace() { traceBuffer.str(""); traceBuffer.clear(); }
+    
+    // Values written by OUT since the last reset()
+    const std::vector<uint8_t>& output() const { return outputLog; }
+    
+    void printState() {
+        std::cout << "\n=== CPU State ===" << std::endl;
+        std::cout << "A=" << (int)state.reg[0] << " B=" << (int)state.reg[1] 
+                  << " C=" << (int)state.reg[2] << " D=" << (int)state.reg[3] << std::endl;
+        std::cout << "PC=" << (int)state.pc << " Zero=" << (int)state.zero 
+                  << " Running=" << (int)state.running << std::endl;
+        
+        std::cout << "\n=== RAM ===" << std::endl;
+        for(int i = 0; i < 16; i++) {
+            std::cout << std::hex << std::setw(1) << i << ":0x" 
+                     << std::setw(2) << std::setfill('0') << (int)state.ram[i] << " ";
+            if((i + 1) % 8 == 0) std::cout << std::endl;
+        }
+        std::cout << std::dec << std::setfill(' ') << std::endl;
+    }
+};
+
+#if defined(__GNUC__)
+// Runs one program from many initial states at once. Lanes are grouped
+// in chunks of one vector register (32 lanes with AVX2, 16 with SSE2);
+// inside a chunk every register, the PC, the flags and each RAM byte are
+// byte columns, so one vector instruction updates all lanes. Lanes at the
+// same PC after the same number of steps form a group, which runs under
+// its mask with a scalar PC and fetch; lanes only part ways at a JZ (or on
+// code that differs between them), and groups merge again when one catches
+// up with another at the same PC.
+class BatchCPU4Bit {
+public:
+#ifdef __AVX2__
+    static const size_t CHUNK_LANES = 32;
+#else
+    static const size_t CHUNK_LANES = 16;
+#endif
+    typedef uint8_t Vec __attribute__((vector_size(CHUNK_LANES)));
+    
+    explicit BatchCPU4Bit(size_t lanes)
+        : lanes(lanes), chunks((lanes + CHUNK_LANES - 1) / CHUNK_LANES),
+          haltStep(lanes, 0), outputs(lanes) {
+        reset();
+    }
+    
+    size_t size() const { return lanes; }
+    
+    // Same as CPU4Bit::reset() on every lane
+    void reset() {
+        for(size_t c = 0; c < chunks.size(); c++) {
+            Chunk& chunk = chunks[c];
+            std::memset(&chunk, 0, sizeof(Chunk));
+            for(size_t i = 0; i < CHUNK_LANES; i++) {
+                chunk.running[i] = (c * CHUNK_LANES + i < lanes) ? 0xFF : 0;
+            }
+        }
+        for(auto& out : outputs) out.clear();
+        totalSteps = 0;
+    }
+    
+    // Load the same program into every lane
+    void loadProgram(const std::vector<uint8_t>& program) {
+        for(size_t i = 0; i < program.size() && i < 16; i++) {
+            for(Chunk& chunk : chunks) chunk.ram[i] = splat(program[i]);
+        }
+    }
+    
+    // Per-lane setup, e.g. input values in the upper RAM bytes
+    void writeMemory(size_t lane, uint8_t addr, uint8_t value) {
+        chunkOf(lane).ram[addr & 0x0F][lane % CHUNK_LANES] = value;
+    }
+    void setRegisterValue(size_t lane, uint8_t regNum, uint8_t value) {
+        chunkOf(lane).reg[regNum & 0x03][lane % CHUNK_LANES] = value;
+    }
+    void setPC(size_t lane, uint8_t value) {
+        chunkOf(lane).pc[lane % CHUNK_LANES] = value & 0x0F;
+    }
+    void setZeroFlag(size_t lane, bool value) {
+        chunkOf(lane).zero[lane % CHUNK_LANES] = value ? 0xFF : 0;
+    }
+    
+    // Run every lane until it halts or maxSteps steps have passed.
+    // Returns the most steps any lane took.
+    int run(int maxSteps) {
+        int longest = 0;
+        for(size_t c = 0; c < chunks.size(); c++) {
+            int step = runChunk(chunks[c], c * CHUNK_LANES, maxSteps);
+            if(step > longest) longest = step;
+        }
+        // Lanes still running took every step of the budget
+        if(maxSteps > 0) totalSteps += maxSteps;
+        return longest;
+    }
+    
+    // Per-lane results
+    MachineState state(size_t lane) const {
+        const Chunk& chunk = chunks[lane / CHUNK_LANES];
+        size_t i = lane % CHUNK_LANES;
+        MachineState s;
+        for(int r = 0; r < 4; r++) s.reg[r] = chunk.reg[r][i];
+        s.pc = chunk.pc[i];
+        s.zero = chunk.zero[i] ? 1 : 0;
+        s.running = chunk.running[i] ? 1 : 0;
+        for(int a = 0; a < 16; a++) s.ram[a] = chunk.ram[a][i];
+        return s;
+    }
+    const std::vector<uint8_t>& output(size_t lane) const { return outputs[lane]; }
+    
+    // Instructions lane executed: up to its HLT, or every step if still running
+    int steps(size_t lane) const {
+        return chunks[lane / CHUNK_LANES].running[lane % CHUNK_LANES] ? totalSteps : haltStep[lane];
+    }
+    
+private:
+    struct Chunk {
+        Vec reg[4];
+        Vec pc;
+        Vec zero;     // 0xFF or 0
+        Vec running;  // 0xFF or 0
+        Vec ram[16];
+    };
+    
+    // One OUT in a chunk: value for every lane in mask
+    struct OutEvent {
+        Vec value;
+        Vec mask;
+    };
+    
+    // Lanes of a chunk at one PC after the same number of steps
+    struct Group {
+        Vec mask;
+        uint8_t pc;
+        int step;
+        bool split;  // Split off on differing code: must not merge back before its next step
+    };
+    
+    size_t lanes;
+    std::vector<Chunk> chunks;
+    std::vector<int> haltStep;
+    std::vector<std::vector<uint8_t>> outputs;
+    std::vector<OutEvent> outEvents;  // OUTs of the chunk being run, in order
+    Group groups[CHUNK_LANES];        // Waiting groups of that chunk (disjoint)
+    size_t groupCount = 0;
+    uint16_t code = 0;                // Bit a set if RAM[a] is the same in all its running lanes
+    int totalSteps = 0;
+    
+    Chunk& chunkOf(size_t lane) { return chunks[lane / CHUNK_LANES]; }
+    
+    static Vec splat(uint8_t x) { return Vec{} + x; }
+    static Vec select(Vec mask, Vec a, Vec b) { return (mask & a) | (~mask & b); }
+    static Vec equal(Vec a, Vec b) { return (Vec)(a == b); }
+    static bool any(Vec v) {
+        uint64_t w[CHUNK_LANES / 8];
+        std::memcpy(w, &v, sizeof(w));
+        uint64_t bits = 0;
+        for(uint64_t x : w) bits |= x;
+        return bits != 0;
+    }
+    // Bit i set if lane i of a 0xFF/0 mask is set
+    static uint32_t laneBits(Vec mask) {
+        uint64_t w[CHUNK_LANES / 8];
+        std::memcpy(w, &mask, sizeof(w));
+        uint32_t bits = 0;
+        for(size_t k = 0; k < CHUNK_LANES / 8; k++) {
+            // Gathers the top bit of each byte into one byte
+            bits |= uint32_t(((w[k] & 0x8080808080808080ULL) * 0x0002040810204081ULL) >> 56) << (8 * k);
+        }
+        return bits;
+    }
+    static size_t firstSet(Vec mask) { return __builtin_ctz(laneBits(mask)); }
+    
+    // True if v holds the same byte in every lane of mask (lane is one of them)
+    static bool sameIn(Vec v, Vec mask, size_t lane) {
+        return !any(mask & ~equal(v, splat(v[lane])));
+    }
+    // Bit a set if RAM[a] is the same in every lane of mask
+    static uint16_t sameColumns(const Chunk& c, Vec mask, size_t lane) {
+        uint16_t columns = 0;
+        for(int a = 0; a < 16; a++) {
+            if(sameIn(c.ram[a], mask, lane)) columns |= 1 << a;
+        }
+        return columns;
+    }
+    
+    void setA(Chunk& c, Vec mask, Vec value) {
+        c.reg[0] = select(mask, value, c.reg[0]);
+        c.zero = select(mask, equal(value, splat(0)), c.zero);
+    }
+    
+    void halt(Chunk& c, Vec mask, size_t firstLane, int stepIndex) {
+        c.running &= ~mask;
+        for(uint32_t bits = laneBits(mask); bits; bits &= bits - 1) {
+            haltStep[firstLane + __builtin_ctz(bits)] = stepIndex + 1;
+        }
+    }
+    
+    int runChunk(Chunk& c, size_t firstLane, int maxSteps) {
+        outEvents.clear();
+        groupCount = 0;
+        if(maxSteps <= 0) return 0;
+        
+        // Start with one group per PC
+        Vec rest = c.running;
+        while(any(rest)) {
+            const uint8_t pc = c.pc[firstSet(rest)];
+            const Vec mask = rest & equal(c.pc, splat(pc));
+            groups[groupCount++] = { mask, pc, 0, false };
+            rest &= ~mask;
+        }
+        if(groupCount > 0) code = sameColumns(c, c.running, firstSet(c.running));
+        
+        int longest = 0;
+        while(groupCount > 0) {
+            // Furthest-behind group first, so groups that meet again merge
+            size_t next = 0;
+            for(size_t g = 1; g < groupCount; g++) {
+                if(groups[g].step < groups[next].step) next = g;
+            }
+            Group group = groups[next];
+            groups[next] = groups[--groupCount];
+            if(!group.split) mergeInto(group);
+            
+            int step = runGroup(c, group, firstLane, maxSteps);
+            if(step > longest) longest = step;
+        }
+        
+        // Hand out the OUT values, oldest first
+        for(const OutEvent& e : outEvents) {
+            for(uint32_t bits = laneBits(e.mask); bits; bits &= bits - 1) {
+                const size_t i = __builtin_ctz(bits);
+                outputs[firstLane + i].push_back(e.value[i]);
+            }
+        }
+        return longest;
+    }
+    
+    // Take over every waiting group at the same PC and step
+    void mergeInto(Group& group) {
+        for(size_t g = 0; g < groupCount; ) {
+            if(groups[g].pc == group.pc && groups[g].step == group.step && !groups[g].split) {
+                group.mask |= groups[g].mask;
+                groups[g] = groups[--groupCount];
+            } else {
+                g++;
+            }
+        }
+    }
+    
+    int earliestWaiting() const {
+        int step = INT_MAX;
+        for(size_t g = 0; g < groupCount; g++) step = std::min(step, groups[g].step);
+        return step;
+    }
+    
+    // Run a group with a scalar PC: the operand indexes columns directly.
+    // It stops when it halts or uses up the budget, splits at a JZ or on
+    // code that differs between its lanes (the parts wait as new groups),
+    // or gets ahead of a waiting group (it waits too). Returns the step it
+    // stopped at.
+    int runGroup(Chunk& c, Group group, size_t firstLane, int maxSteps) {
+        Vec mask = group.mask;
+        size_t leader = firstSet(mask);
+        uint8_t pc = group.pc;
+        int step = group.step;
+        int waiting = earliestWaiting();
+        bool mayMerge = !group.split;
+        const Vec fifteen = splat(0x0F);
+        
+        while(step < maxSteps) {
+            // Caught up with a waiting group at this PC: go on together
+            if(step == waiting && mayMerge) {
+                group = { mask, pc, step, false };
+                mergeInto(group);
+                mask = group.mask;
+                waiting = earliestWaiting();
+            }
+            mayMerge = true;
+            
+            const Vec column = c.ram[pc];
+            if(!(code & (1 << pc)) && !sameIn(column, mask, leader)) {
+                // One group per instruction byte, all still at this step
+                Vec rest = mask;
+                while(any(rest)) {
+                    const Vec part = rest & equal(column, splat(column[firstSet(rest)]));
+                    groups[groupCount++] = { part, pc, step, true };
+                    rest &= ~part;
+                }
+                return step;
+            }
+            
+            const uint8_t instruction = column[leader];
+            const uint8_t opcode = instruction >> 4;
+            const uint8_t operand = instruction & 0x0F;
+            pc = (pc + 1) & 0x0F;
+            step++;
+            
+            switch(opcode) {
+                case CPU4Bit::LDA:
+                    c.reg[0] = select(mask, splat(operand), c.reg[0]);
+                    break;
+                case CPU4Bit::LDB:
+                    c.reg[1] = select(mask, splat(operand), c.reg[1]);
+                    break;
+                case CPU4Bit::STA:
+                case CPU4Bit::STB:
+                    c.ram[operand] = select(mask, c.reg[opcode == CPU4Bit::STA ? 0 : 1], c.ram[operand]);
+                    code &= ~(1 << operand);
+                    if(sameIn(c.ram[operand], c.running, leader)) code |= 1 << operand;
+                    break;
+                case CPU4Bit::ADD:
+                    setA(c, mask, (c.reg[0] + c.reg[1]) & fifteen);
+                    break;
+                case CPU4Bit::SUB:
+                    setA(c, mask, (c.reg[0] - c.reg[1]) & fifteen);
+                    break;
+                case CPU4Bit::MOV:
+                    c.reg[operand & 0x03] = select(mask, c.reg[(operand >> 2) & 0x03], c.reg[operand & 0x03]);
+                    break;
+                case CPU4Bit::LDM:
+                    c.reg[0] = select(mask, c.ram[operand], c.reg[0]);
+                    break;
+                case CPU4Bit::OUT:
+                    outEvents.push_back({ c.reg[operand & 0x03], mask });
+                    break;
+                case CPU4Bit::INC:
+                case CPU4Bit::DEC: {
+                    Vec& r = c.reg[operand & 0x03];
+                    Vec value = (r + splat(opcode == CPU4Bit::INC ? 1 : 0xFF)) & fifteen;
+                    r = select(mask, value, r);
+                    c.zero = select(mask, equal(value, splat(0)), c.zero);
+                    break;
+                }
+                case CPU4Bit::ALU: {
+                    const Vec a = c.reg[0], b = c.reg[1];
+                    switch(operand) {
+                        case CPU4Bit::AND_OP: setA(c, mask, (a & b) & fifteen); break;
+                        case CPU4Bit::OR_OP:  setA(c, mask, (a | b) & fifteen); break;
+                        case CPU4Bit::XOR_OP: setA(c, mask, (a ^ b) & fifteen); break;
+                        case CPU4Bit::NOT_OP: setA(c, mask, ~a & fifteen); break;
+                        case CPU4Bit::SHL_OP: setA(c, mask, (a << 1) & fifteen); break;
+                        case CPU4Bit::SHR_OP: setA(c, mask, (a >> 1) & fifteen); break;
+                        case CPU4Bit::ROL_OP: setA(c, mask, ((a << 1) | ((a & 0x08) >> 3)) & fifteen); break;
+                        case CPU4Bit::ROR_OP: setA(c, mask, ((a >> 1) | ((a & 0x01) << 3)) & fifteen); break;
+                        default: break;  // 8-15 are no-ops
+                    }
+                    break;
+                }
+                case CPU4Bit::JMP:
+                case CPU4Bit::JZ:
+                    if(opcode == CPU4Bit::JMP) {
+                        pc = operand;
+                    } else {
+                        const Vec taken = mask & c.zero;
+                        const Vec notTaken = mask & ~c.zero;
+                        if(any(taken) && any(notTaken)) {
+                            // Go on with the smaller side (often a loop exit), the other waits
+                            if(__builtin_popcount(laneBits(taken)) <= __builtin_popcount(laneBits(notTaken))) {
+                                groups[groupCount++] = { notTaken, pc, step, false };
+                                mask = taken;
+                                pc = operand;
+                            } else {
+                                groups[groupCount++] = { taken, operand, step, false };
+                                mask = notTaken;
+                            }
+                            leader = firstSet(mask);
+                            waiting = std::min(waiting, step);
+                        } else if(any(taken)) {
+                            pc = operand;
+                        }
+                    }
+                    // End of a block: let groups that are behind catch up
+                    if(step > waiting) {
+                        groups[groupCount++] = { mask, pc, step, false };
+                        return step;
+                    }
+                    break;
+                case CPU4Bit::HLT:
+                    c.pc = select(mask, splat(pc), c.pc);
+                    halt(c, mask, firstLane, totalSteps + step - 1);
+                    return step;
+                default:
+                    break;
+            }
+        }
+        c.pc = select(mask, splat(pc), c.pc);
+        return step;
+    }
+};
+#endif
+
+// ===== Bit-sliced engine =====
+// Bit b of every lane lives in one Word (bit plane), so each instruction is a
+// small Boolean circuit evaluated for sizeof(Word) * 8 CPUs at once. Meant for
+// exhaustive-input sweeps: one program, every combination of inputs in RAM.
+template<typename Word>
+class BitSlicedCPU4Bit {
+public:
+    static const size_t WORD_LANES = sizeof(Word) * 8;
+    
+    explicit BitSlicedCPU4Bit(size_t lanes)
+        : lanes(lanes), slices((lanes + WORD_LANES - 1) / WORD_LANES),
+          haltStep(lanes, 0), outputs(lanes) {
+        reset();
+    }
+    
+    size_t size() const { return lanes; }
+    
+    // Same as CPU4Bit::reset() on every lane
+    void reset() {
+        for(size_t s = 0; s < slices.size(); s++) {
+            Slice& slice = slices[s];
+            std::memset(&slice, 0, sizeof(Slice));
+            for(size_t i = 0; i < WORD_LANES && s * WORD_LANES + i < lanes; i++) {
+                setBit(slice.running, i, true);
+            }
+        }
+        for(auto& out : outputs) out.clear();
+        totalSteps = 0;
+    }
+    
+    // Load the same program into every lane
+    void loadProgram(const std::vector<uint8_t>& program) {
+        for(size_t i = 0; i < program.size() && i < 16; i++) {
+            for(Slice& slice : slices) {
+                for(int b = 0; b < 8; b++) slice.ram[i][b] = ((program[i] >> b) & 1) ? ONES : Word{};
+            }
+        }
+    }
+    
+    // Per-lane setup
+    void writeMemory(size_t lane, uint8_t addr, uint8_t value) {
+        setByte(sliceOf(lane).ram[addr & 0x0F], lane % WORD_LANES, value);
+    }
+    void setRegisterValue(size_t lane, uint8_t regNum, uint8_t value) {
+        setByte(sliceOf(lane).reg[regNum & 0x03], lane % WORD_LANES, value);
+    }
+    void setPC(size_t lane, uint8_t value) {
+        for(int b = 0; b < 4; b++) setBit(sliceOf(lane).pc[b], lane % WORD_LANES, (value >> b) & 1);
+    }
+    void setZeroFlag(size_t lane, bool value) {
+        setBit(sliceOf(lane).zero, lane % WORD_LANES, value);
+    }
+    
+    // One step on every lane, like CPU4Bit::step()
+    void step() {
+        for(size_t s = 0; s < slices.size(); s++) {
+            if(any(slices[s].running)) stepSlice(slices[s], s * WORD_LANES, totalSteps);
+        }
+        totalSteps++;
+    }
+    
+    // Run every lane until it halts or maxSteps steps have passed.
+    // Returns the number of lockstep steps taken.
+    int run(int maxSteps) {
+        int longest = 0;
+        for(size_t s = 0; s < slices.size(); s++) {
+            Slice& slice = slices[s];
+            int step = 0;
+            while(step < maxSteps && any(slice.running)) {
+                stepSlice(slice, s * WORD_LANES, totalSteps + step);
+                step++;
+            }
+            if(step > longest) longest = step;
+        }
+        // Lanes still running took every step of the budget
+        if(maxSteps > 0) totalSteps += maxSteps;
+        return longest;
+    }
+    
+    // Per-lane results
+    MachineState state(size_t lane) const {
+        const Slice& slice = slices[lane / WORD_LANES];
+        size_t i = lane % WORD_LANES;
+        MachineState s;
+        for(int r = 0; r < 4; r++) s.reg[r] = getByte(slice.reg[r], i);
+        s.pc = 0;
+        for(int b = 0; b < 4; b++) s.pc |= getBit(slice.pc[b], i) << b;
+        s.zero = getBit(slice.zero, i);
+        s.running = getBit(slice.running, i);
+        for(int a = 0; a < 16; a++) s.ram[a] = getByte(slice.ram[a], i);
+        return s;
+    }
+    const std::vector<uint8_t>& output(size_t lane) const { return outputs[lane]; }
+    
+    // Instructions lane executed: up to its HLT, or every step if still running
+    int steps(size_t lane) const {
+        return getBit(slices[lane / WORD_LANES].running, lane % WORD_LANES) ? totalSteps : haltStep[lane];
+    }
+    
+private:
+    struct Slice {
+        Word reg[4][8];   // [register][bit]
+        Word pc[4];
+        Word zero;
+        Word running;
+        Word ram[16][8];  // [address][bit]
+    };
+    
+    static constexpr Word ONES = ~Word{};
+    
+    size_t lanes;
+    std::vector<Slice> slices;
+    std::vector<int> haltStep;
+    std::vector<std::vector<uint8_t>> outputs;
+    int totalSteps = 0;
+    
+    Slice& sliceOf(size_t lane) { return slices[lane / WORD_LANES]; }
+    
+    // Word viewed as 64-bit limbs, lane i is bit i % 64 of limb i / 64
+    static bool getBit(const Word& w, size_t i) {
+        uint64_t limb;
+        std::memcpy(&limb, reinterpret_cast<const char*>(&w) + (i / 64) * 8, 8);
+        return (limb >> (i % 64)) & 1;
+    }
+    static void setBit(Word& w, size_t i, bool value) {
+        uint64_t limb;
+        char* p = reinterpret_cast<char*>(&w) + (i / 64) * 8;
+        std::memcpy(&limb, p, 8);
+        limb = value ? (limb | (1ULL << (i % 64))) : (limb & ~(1ULL << (i % 64)));
+        std::memcpy(p, &limb, 8);
+    }
+    static uint8_t getByte(const Word* planes, size_t i) {
+        uint8_t value = 0;
+        for(int b = 0; b < 8; b++) value |= getBit(planes[b], i) << b;
+        return value;
+    }
+    static void setByte(Word* planes, size_t i, uint8_t value) {
+        for(int b = 0; b < 8; b++) setBit(planes[b], i, (value >> b) & 1);
+    }
+    static bool any(const Word& w) {
+        uint64_t limbs[sizeof(Word) / 8];
+        std::memcpy(limbs, &w, sizeof(Word));
+        uint64_t bits = 0;
+        for(uint64_t x : limbs) bits |= x;
+        return bits != 0;
+    }
+    
+    template<typename F>
+    static void forEachLane(const Word& mask, F f) {
+        uint64_t limbs[sizeof(Word) / 8];
+        std::memcpy(limbs, &mask, sizeof(Word));
+        for(size_t l = 0; l < sizeof(Word) / 8; l++) {
+            for(uint64_t bits = limbs[l]; bits; bits &= bits - 1) f(l * 64 + __builtin_ctzll(bits));
+        }
+    }
+    
+    static void blend(Word& dst, const Word& mask, const Word& value) {
+        dst ^= (dst ^ value) & mask;
+    }
+    
+    // sel[v] = lanes whose 4-bit value (bit planes b[0..3]) equals v
+    static void decode16(const Word* b, Word* sel) {
+        Word lo[4], hi[4];
+        decode4(b, lo);
+        decode4(b + 2, hi);
+        for(int v = 0; v < 16; v++) sel[v] = hi[v >> 2] & lo[v & 3];
+    }
+    static void decode4(const Word* b, Word* sel) {
+        sel[0] = ~b[1] & ~b[0];
+        sel[1] = ~b[1] & b[0];
+        sel[2] = b[1] & ~b[0];
+        sel[3] = b[1] & b[0];
+    }
+    
+    // Byte-wide mux: out = column[v] for the v selected in each lane
+    static void mux(const Word (*column)[8], const Word* sel, int count, Word* out) {
+        for(int b = 0; b < 8; b++) out[b] = Word{};
+        for(int v = 0; v < count; v++) {
+            for(int b = 0; b < 8; b++) out[b] |= sel[v] & column[v][b];
+        }
+    }
+    
+    // Register gets a 4-bit value (upper bits cleared), optionally setting the zero flag
+    static void writeNibble(Slice& s, Word* reg, const Word& m, const Word* value, bool setsZero) {
+        for(int b = 0; b < 4; b++) blend(reg[b], m, value[b]);
+        for(int b = 4; b < 8; b++) reg[b] &= ~m;
+        if(setsZero) blend(s.zero, m, ~(value[0] | value[1] | value[2] | value[3]));
+    }
+    
+    // 4-bit ripple-carry a + b + carry
+    static void add4(const Word* a, const Word* b, Word carry, Word* out) {
+        for(int i = 0; i < 4; i++) {
+            Word x = a[i] ^ b[i];
+            out[i] = x ^ carry;
+            carry = (a[i] & b[i]) | (carry & x);
+        }
+    }
+    
+    void stepSlice(Slice& s, size_t firstLane, int stepIndex) {
+        const Word active = s.running;
+        
+        // Fetch: a plain column copy when every active lane is at the same PC
+        Word instruction[8];
+        int commonPC = 0;
+        for(int b = 0; b < 4 && commonPC >= 0; b++) {
+            const Word bit = s.pc[b] & active;
+            if(!any(bit)) continue;
+            commonPC = any(bit ^ active) ? -1 : (commonPC | (1 << b));
+        }
+        if(commonPC >= 0) {
+            for(int b = 0; b < 8; b++) instruction[b] = s.ram[commonPC][b];
+        } else {
+            Word at[16];
+            decode16(s.pc, at);
+            mux(s.ram, at, 16, instruction);
+        }
+        const Word* operand = instruction;
+        
+        // PC + 1 on active lanes
+        Word carry = ONES;
+        for(int b = 0; b < 4; b++) {
+            Word next = s.pc[b] ^ carry;
+            carry &= s.pc[b];
+            blend(s.pc[b], active, next);
+        }
+        
+        Word opcode[16], arg[16];
+        decode16(instruction + 4, opcode);
+        decode16(operand, arg);
+        
+        for(int op = 0; op < 16; op++) {
+            const Word m = active & opcode[op];
+            if(!any(m)) continue;
+            
+            switch(op) {
+                case CPU4Bit::NOP:
+                    break;
+                case CPU4Bit::LDA:
+                case CPU4Bit::LDB:
+                    writeNibble(s, s.reg[op == CPU4Bit::LDA ? 0 : 1], m, operand, false);
+                    break;
+                case CPU4Bit::STA:
+                case CPU4Bit::STB: {
+                    const Word* value = s.reg[op == CPU4Bit::STA ? 0 : 1];
+                    for(int a = 0; a < 16; a++) {
+                        const Word ma = m & arg[a];
+                        if(!any(ma)) continue;
+                        for(int b = 0; b < 8; b++) blend(s.ram[a][b], ma, value[b]);
+                    }
+                    break;
+                }
+                case CPU4Bit::ADD:
+                case CPU4Bit::SUB: {
+                    // a - b = a + ~b + 1
+                    Word b[4], sum[4];
+                    for(int i = 0; i < 4; i++) b[i] = (op == CPU4Bit::SUB) ? ~s.reg[1][i] : s.reg[1][i];
+                    add4(s.reg[0], b, (op == CPU4Bit::SUB) ? ONES : Word{}, sum);
+                    writeNibble(s, s.reg[0], m, sum, true);
+                    break;
+                }
+                case CPU4Bit::JMP:
+                    for(int b = 0; b < 4; b++) blend(s.pc[b], m, operand[b]);
+                    break;
+                case CPU4Bit::JZ: {
+                    const Word taken = m & s.zero;
+                    for(int b = 0; b < 4; b++) blend(s.pc[b], taken, operand[b]);
+                    break;
+                }
+                case CPU4Bit::MOV: {
+                    Word src[4], dst[4], value[8];
+                    decode4(operand + 2, src);
+                    decode4(operand, dst);
+                    mux(s.reg, src, 4, value);
+                    for(int r = 0; r < 4; r++) {
+                        const Word mr = m & dst[r];
+                        for(int b = 0; b < 8; b++) blend(s.reg[r][b], mr, value[b]);
+                    }
+                    break;
+                }
+                case CPU4Bit::LDM: {
+                    Word value[8];
+                    mux(s.ram, arg, 16, value);
+                    for(int b = 0; b < 8; b++) blend(s.reg[0][b], m, value[b]);
+                    break;
+                }
+                case CPU4Bit::OUT: {
+                    Word sel[4], value[8];
+                    decode4(operand, sel);
+                    mux(s.reg, sel, 4, value);
+                    forEachLane(m, [&](size_t i) { outputs[firstLane + i].push_back(getByte(value, i)); });
+                    break;
+                }
+                case CPU4Bit::INC:
+                case CPU4Bit::DEC: {
+                    Word sel[4];
+                    decode4(operand, sel);
+                    for(int r = 0; r < 4; r++) {
+                        const Word mr = m & sel[r];
+                        if(!any(mr)) continue;
+                        // +1 carries through ones, -1 borrows through zeros
+                        Word value[4], chain = ONES;
+                        for(int b = 0; b < 4; b++) {
+                            value[b] = s.reg[r][b] ^ chain;
+                            chain &= (op == CPU4Bit::INC) ? s.reg[r][b] : ~s.reg[r][b];
+                        }
+                        writeNibble(s, s.reg[r], mr, value, true);
+                    }
+                    break;
+                }
+                case CPU4Bit::ALU: {
+                    const Word* a = s.reg[0];
+                    const Word* b = s.reg[1];
+                    for(int sub = 0; sub < 8; sub++) {
+                        const Word ms = m & arg[sub];
+                        if(!any(ms)) continue;
+                        // Only bits 0-3 survive the mask, but SHR/ROR pull in bit 4
+                        Word r[4];
+                        switch(sub) {
+                            case CPU4Bit::AND_OP: for(int i = 0; i < 4; i++) r[i] = a[i] & b[i]; break;
+                            case CPU4Bit::OR_OP:  for(int i = 0; i < 4; i++) r[i] = a[i] | b[i]; break;
+                            case CPU4Bit::XOR_OP: for(int i = 0; i < 4; i++) r[i] = a[i] ^ b[i]; break;
+                            case CPU4Bit::NOT_OP: for(int i = 0; i < 4; i++) r[i] = ~a[i]; break;
+                            case CPU4Bit::SHL_OP: r[0] = Word{}; r[1] = a[0]; r[2] = a[1]; r[3] = a[2]; break;
+                            case CPU4Bit::SHR_OP: r[0] = a[1]; r[1] = a[2]; r[2] = a[3]; r[3] = a[4]; break;
+                            case CPU4Bit::ROL_OP: r[0] = a[3]; r[1] = a[0]; r[2] = a[1]; r[3] = a[2]; break;
+                            default:              r[0] = a[1]; r[1] = a[2]; r[2] = a[3]; r[3] = a[4] | a[0]; break;  // ROR_OP
+                        }
+                        writeNibble(s, s.reg[0], ms, r, true);
+                    }
+                    break;
+                }
+                case CPU4Bit::HLT:
+                    s.running &= ~m;
+                    forEachLane(m, [&](size_t i) { haltStep[firstLane + i] = stepIndex + 1; });
+                    break;
+            }
+        }
+    }
+};
+
+typedef BitSlicedCPU4Bit<uint64_t> BitSliced64;
+#if defined(__GNUC__)
+// Widest vector the target has: 512, 256 or 128 lanes per word
+#if defined(__AVX512F__)
+typedef uint64_t BitSliceVector __attribute__((vector_size(64)));
+#elif defined(__AVX2__)
+typedef uint64_t BitSliceVector __attribute__((vector_size(32)));
+#else
+typedef uint64_t BitSliceVector __attribute__((vector_size(16)));
+#endif
+typedef BitSlicedCPU4Bit<BitSliceVector> BitSlicedWide;
+#endif
+
+// ===== Model checker =====
+// Explores every state reachable from a set of initial states, checking
+// invariants on the way. States are deduplicated in a fixed-size lock-free
+// hash set; workers each own a deque of states to expand and steal from
+// the others when theirs runs dry.
+class ModelChecker {
+public:
+    enum class Order { DFS, BFS };  // Per worker: newest or oldest state first
+    
+    struct Report {
+        bool complete = true;        // False if the state table filled up
+        bool violated = false;
+        std::string violation;       // What went wrong, for the first violation
+        std::vector<MachineState> trace;  // Initial state .. violating state
+        size_t initialStates = 0;
+        size_t states = 0;           // Distinct reachable states
+        size_t haltedStates = 0;
+        uint64_t transitions = 0;
+        double seconds = 0;
+        double statesPerSecond = 0;
+        std::vector<uint64_t> expandedPerWorker;
+        std::vector<uint64_t> stealsPerWorker;
+    };
+    
+    explicit ModelChecker(size_t maxStates = 1 << 20) {
+        capacity = 1;
+        while(capacity < maxStates * 2) capacity <<= 1;
+        this->maxStates = maxStates;
+    }
+    
+    // Initial states
+    void addInitial(const MachineState& s) { initial.push_back(s); }
+    // Every combination of values 0..values-1 in the RAM cells of cellMask
+    void addInputSweep(const MachineState& base, uint16_t cellMask, int values = 256) {
+        std::vector<int> cells;
+        for(int i = 0; i < 16; i++) {
+            if(cellMask & (1 << i)) cells.push_back(i);
+        }
+        std::vector<int> digit(cells.size(), 0);
+        while(true) {
+            MachineState s = base;
+            for(size_t c = 0; c < cells.size(); c++) s.ram[cells[c]] = digit[c];
+            initial.push_back(s);
+            size_t c = 0;
+            while(c < cells.size() && ++digit[c] == values) digit[c++] = 0;
+            if(c == cells.size()) break;
+        }
+    }
+    void clearInitial() { initial.clear(); }
+    
+    // Invariants
+    void protectRam(uint16_t mask) { protectedRam = mask; }      // No STA/STB to these cells
+    void requireHalt(bool enabled) { mustHalt = enabled; }       // No reachable infinite loop
+    void setInvariant(std::function<bool(const MachineState&)> predicate) { invariant = predicate; }
+    
+    void setThreads(int count) { threads = count; }  // 0: one per core
+    void setOrder(Order o) { order = o; }
+    
+    Report run() {
+        Report report;
+        auto start = std::chrono::steady_clock::now();
+        
+        slots.reset(new Slot[capacity]);
+        for(size_t i = 0; i < capacity; i++) slots[i].flag.store(EMPTY, std::memory_order_relaxed);
+        count.store(0);
+        halted.store(0);
+        full.store(false);
+        stop.store(false);
+        violationSlot = NO_PARENT;
+        violationText.clear();
+        
+        int workerCount = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workers.clear();
+        for(int w = 0; w < workerCount; w++) workers.emplace_back(new Worker());
+        
+        // Deal the initial states round-robin
+        pending.store(0);
+        for(size_t i = 0; i < initial.size(); i++) {
+            uint32_t index;
+            if(insert(initial[i], NO_PARENT, index)) {
+                report.initialStates++;
+                pending.fetch_add(1);
+                workers[i % workerCount]->queue.push_back(index);
+                checkState(index);
+            }
+        }
+        
+        std::vector<std::thread> pool;
+        for(int w = 1; w < workerCount; w++) pool.emplace_back(&ModelChecker::work, this, w);
+        work(0);
+        for(std::thread& t : pool) t.join();
+        
+        report.complete = !full.load();
+        if(mustHalt && report.complete && violationSlot == NO_PARENT) findCycle();
+        
+        report.states = count.load();
+        report.haltedStates = halted.load();
+        for(auto& w : workers) {
+            report.transitions += w->expanded;
+            report.expandedPerWorker.push_back(w->expanded);
+            report.stealsPerWorker.push_back(w->steals);
+        }
+        if(violationSlot != NO_PARENT) {
+            report.violated = true;
+            report.violation = violationText;
+            for(uint32_t i = violationSlot; i != NO_PARENT; i = slots[i].parent) {
+                report.trace.push_back(slots[i].state);
+            }
+            std::reverse(report.trace.begin(), report.trace.end());
+        }
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        report.statesPerSecond = report.seconds > 0 ? report.states / report.seconds : 0;
+        slots.reset();
+        return report;
+    }
+    
+private:
+    static const uint32_t NO_PARENT = 0xFFFFFFFF;
+    enum : uint8_t { EMPTY, WRITING, READY };
+    
+    struct Slot {
+        std::atomic<uint8_t> flag;
+        MachineState state;
+        uint32_t parent;  // Slot of the state this one was first reached from
+        uint32_t next;    // Slot of the successor, once expanded
+        std::atomic<uint32_t> inDegree;
+    };
+    
+    struct Worker {
+        std::mutex lock;
+        std::deque<uint32_t> queue;
+        uint64_t expanded = 0;
+        uint64_t steals = 0;
+    };
+    
+    size_t capacity;
+    size_t maxStates;
+    std::vector<MachineState> initial;
+    uint16_t protectedRam = 0;
+    bool mustHalt = false;
+    std::function<bool(const MachineState&)> invariant;
+    int threads = 0;
+    Order order = Order::DFS;
+    
+    std::unique_ptr<Slot[]> slots;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> count;
+    std::atomic<size_t> halted;
+    std::atomic<int64_t> pending;  // Queued or being expanded
+    std::atomic<bool> full;
+    std::atomic<bool> stop;
+    std::mutex violationLock;
+    uint32_t violationSlot;
+    std::string violationText;
+    
+    // Insert s; false if it was already there (or the table is full).
+    // index is the slot of s either way, when present.
+    bool insert(const MachineState& s, uint32_t parent, uint32_t& index) {
+        size_t mask = capacity - 1;
+        for(size_t i = s.hash() & mask; ; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            uint8_t flag = slot.flag.load(std::memory_order_acquire);
+            if(flag == EMPTY) {
+                if(count.load(std::memory_order_relaxed) >= maxStates) {
+                    full.store(true);
+                    return false;
+                }
+                if(slot.flag.compare_exchange_strong(flag, WRITING, std::memory_order_acquire)) {
+                    slot.state = s;
+                    slot.parent = parent;
+                    slot.next = NO_PARENT;
+                    slot.inDegree.store(0, std::memory_order_relaxed);
+                    slot.flag.store(READY, std::memory_order_release);
+                    count.fetch_add(1, std::memory_order_relaxed);
+                    if(!s.running) halted.fetch_add(1, std::memory_order_relaxed);
+                    index = i;
+                    return true;
+                }
+            }
+            while(flag == WRITING) flag = slot.flag.load(std::memory_order_acquire);
+            if(slot.state == s) {
+                index = i;
+                return false;
+            }
+        }
+    }
+    
+    uint32_t find(const MachineState& s) const {
+        size_t mask = capacity - 1;
+        for(size_t i = s.hash() & mask; ; i = (i + 1) & mask) {
+            if(slots[i].flag.load(std::memory_order_relaxed) != READY) return NO_PARENT;
+            if(slots[i].state == s) return i;
+        }
+    }
+    
+    void reportViolation(uint32_t index, const std::string& text) {
+        std::lock_guard<std::mutex> guard(violationLock);
+        if(violationSlot == NO_PARENT) {
+            violationSlot = index;
+            violationText = text;
+        }
+        stop.store(true);
+    }
+    
+    void checkState(uint32_t index) {
+        if(invariant && !invariant(slots[index].state)) reportViolation(index, "invariant does not hold");
+    }
+    
+    bool take(int self, uint32_t& index) {
+        Worker& mine = *workers[self];
+        {
+            std::lock_guard<std::mutex> guard(mine.lock);
+            if(!mine.queue.empty()) {
+                if(order == Order::DFS) {
+                    index = mine.queue.back();
+                    mine.queue.pop_back();
+                } else {
+                    index = mine.queue.front();
+                    mine.queue.pop_front();
+                }
+                return true;
+            }
+        }
+        // Steal the oldest state of another worker
+        for(size_t k = 1; k < workers.size(); k++) {
+            Worker& victim = *workers[(self + k) % workers.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if(!victim.queue.empty()) {
+                index = victim.queue.front();
+                victim.queue.pop_front();
+                mine.steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void work(int self) {
+        Worker& mine = *workers[self];
+        uint32_t index;
+        while(pending.load() > 0 && !stop.load(std::memory_order_relaxed)) {
+            if(!take(self, index)) {
+                std::this_thread::yield();
+                continue;
+            }
+            const MachineState s = slots[index].state;
+            if(s.running) {
+                mine.expanded++;
+                const uint8_t instruction = s.ram[s.pc];
+                const uint8_t opcode = instruction >> 4;
+                if((opcode == CPU4Bit::STA || opcode == CPU4Bit::STB) &&
+                   (protectedRam & (1 << (instruction & 0x0F)))) {
+                    reportViolation(index, "writes protected RAM[" + std::to_string(instruction & 0x0F) + "]");
+                }
+                uint32_t next = NO_PARENT;
+                bool added = insert(CPU4Bit::successor(s), index, next);
+                if(next != NO_PARENT) {
+                    slots[index].next = next;
+                    slots[next].inDegree.fetch_add(1, std::memory_order_relaxed);
+                }
+                if(added) {
+                    checkState(next);
+                    pending.fetch_add(1);
+                    std::lock_guard<std::mutex> guard(mine.lock);
+                    mine.queue.push_back(next);
+                }
+            }
+            pending.fetch_sub(1);
+        }
+    }
+    
+    // Every running state has exactly one successor, so the reachable
+    // states form a functional graph. Peeling states nobody points at
+    // leaves exactly the states on cycles - runs that never halt.
+    void findCycle() {
+        std::vector<uint32_t> peel;
+        for(size_t i = 0; i < capacity; i++) {
+            if(slots[i].flag.load(std::memory_order_relaxed) == READY &&
+               slots[i].inDegree.load(std::memory_order_relaxed) == 0) {
+                peel.push_back(i);
+            }
+        }
+        while(!peel.empty()) {
+            uint32_t next = slots[peel.back()].next;
+            peel.pop_back();
+            if(next != NO_PARENT && slots[next].inDegree.fetch_sub(1, std::memory_order_relaxed) == 1) {
+                peel.push_back(next);
+            }
+        }
+        for(size_t i = 0; i < capacity; i++) {
+            if(slots[i].flag.load(std::memory_order_relaxed) == READY &&
+               slots[i].inDegree.load(std::memory_order_relaxed) > 0) {
+                reportViolation(i, "does not always halt: state repeats");
+                return;
+            }
+        }
+    }
+};
+
+// ===== CPU pool =====
+// Machine states for very many CPUs, stored back to back in pages of
+// PAGE_SIZE. A CPU is a 32-bit handle (page << PAGE_SHIFT | slot);
+// released handles are recycled through a free list. Freshly allocated
+// and reset states equal CPU4Bit after reset().
+class CPUPool {
+public:
+    typedef uint32_t Handle;
+    static const int PAGE_SHIFT = 12;
+    static const size_t PAGE_SIZE = size_t(1) << PAGE_SHIFT;
+    
+    Handle allocate() {
+        Handle h;
+        if(!freeList.empty()) {
+            h = freeList.back();
+            freeList.pop_back();
+            resetState((*this)[h]);
+        } else {
+            if(used == pages.size() * PAGE_SIZE) addPage();
+            h = used++;
+        }
+        pages[h >> PAGE_SHIFT]->live[(h & (PAGE_SIZE - 1)) / 64] |= 1ULL << (h % 64);
+        live++;
+        return h;
+    }
+    
+    void release(Handle h) {
+        if(!isLive(h)) return;
+        pages[h >> PAGE_SHIFT]->live[(h & (PAGE_SIZE - 1)) / 64] &= ~(1ULL << (h % 64));
+        freeList.push_back(h);
+        live--;
+    }
+    
+    bool isLive(Handle h) const {
+        return h < used && (pages[h >> PAGE_SHIFT]->live[(h & (PAGE_SIZE - 1)) / 64] >> (h % 64)) & 1;
+    }
+    
+    MachineState& operator[](Handle h) { return pages[h >> PAGE_SHIFT]->states[h & (PAGE_SIZE - 1)]; }
+    const MachineState& operator[](Handle h) const { return pages[h >> PAGE_SHIFT]->states[h & (PAGE_SIZE - 1)]; }
+    
+    // States of one page, for loops over every CPU in it
+    MachineState* page(size_t index) { return pages[index]->states; }
+    size_t pageCount() const { return pages.size(); }
+    
+    size_t size() const { return live; }
+    size_t capacity() const { return pages.size() * PAGE_SIZE; }
+    
+    void reset(Handle h) { resetState((*this)[h]); }
+    
+    // Reset every state of a page: one memset over the page, then the
+    // running flags
+    void resetPage(size_t index) {
+        MachineState* states = pages[index]->states;
+        std::memset(states, 0, sizeof(MachineState) * PAGE_SIZE);
+        for(size_t i = 0; i < PAGE_SIZE; i++) states[i].running = 1;
+    }
+    void resetAll() {
+        for(size_t i = 0; i < pages.size(); i++) resetPage(i);
+    }
+    
+    void loadProgram(Handle h, const std::vector<uint8_t>& program) {
+        loadProgram(h, program.data(), program.size());
+    }
+    void loadProgram(Handle h, const uint8_t* image, size_t size = 16) {
+        std::memcpy((*this)[h].ram, image, std::min<size_t>(size, 16));
+    }
+    
+    // Run one CPU with the reference semantics; OUT values are appended
+    // to out when given
+    int run(Handle h, int maxSteps, std::vector<uint8_t>* out = nullptr) {
+        struct Discard { void push_back(uint8_t) {} } discard;
+        return out ? CPU4Bit::runState((*this)[h], maxSteps, *out)
+                   : CPU4Bit::runState((*this)[h], maxSteps, discard);
+    }
+    
+private:
+    struct Page {
+        MachineState states[PAGE_SIZE];
+        uint64_t live[PAGE_SIZE / 64];
+    };
+    
+    std::vector<std::unique_ptr<Page>> pages;
+    std::vector<Handle> freeList;
+    size_t used = 0;  // Handles below this have been handed out at least once
+    size_t live = 0;
+    
+    static void resetState(MachineState& s) {
+        s = MachineState();
+        s.running = 1;
+    }
+    
+    void addPage() {
+        pages.emplace_back(new Page);
+        std::memset(pages.back()->live, 0, sizeof(pages.back()->live));
+        resetPage(pages.size() - 1);
+    }
+};
+
+// ===== Program corpus =====
+// Binary file of 16-byte program images, read through a read-only
+// mapping without copying. Layout (integers little endian):
+//
+//   offset  size  header
+//        0     4  magic "C4PC"
+//        4     2  version (1)
+//        6     2  flags: bit 0 = records carry maxSteps, bit 1 = records carry inputs
+//        8     8  number of records
+//       16     4  record stride in bytes
+//       20     4  default maxSteps, for records without their own
+//       24     2  input cell mask: RAM cells filled from each record's inputs
+//       26     6  reserved, zero
+//
+//   records from offset 32, stride bytes apart:
+//        0    16  program image (RAM[0..15])
+//       16     4  maxSteps                          if flags bit 0
+//        .     n  input values, lowest cell first   if flags bit 1
+//                 (n = number of bits in the input cell mask)
+//
+// The stride may be larger than the fields need, for alignment.
+class ProgramCorpus {
+public:
+    static const size_t HEADER_SIZE = 32;
+    static const uint16_t VERSION = 1;
+    enum Flags : uint16_t { HAS_MAX_STEPS = 1, HAS_INPUTS = 2 };
+    
+    struct Entry {
+        const uint8_t* image;   // 16 bytes, inside the mapping
+        int maxSteps;
+        const uint8_t* inputs;  // One byte per input cell, or nullptr
+    };
+    
+    ProgramCorpus() {}
+    ~ProgramCorpus() { close(); }
+    ProgramCorpus(const ProgramCorpus&) = delete;
+    ProgramCorpus& operator=(const ProgramCorpus&) = delete;
+    
+    // Map a corpus file; false (with a reason in error) if it cannot be
+    // read or is not a valid corpus
+    bool open(const std::string& path, std::string* error = nullptr) {
+        close();
+#ifdef CPU4BIT_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return fail(error, "cannot open " + path);
+        struct stat info;
+        if(fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return fail(error, "cannot map " + path);
+        }
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(mapped == MAP_FAILED) return fail(error, "cannot map " + path);
+        mapping = mapped;
+        mappingSize = info.st_size;
+        return attach(static_cast<const uint8_t*>(mapped), info.st_size, error);
+#else
+        std::ifstream in(path, std::ios::binary);
+        if(!in) return fail(error, "cannot open " + path);
+        owned.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return attach(owned.data(), owned.size(), error);
+#endif
+    }
+    
+    // Use a corpus already in memory; the bytes must outlive this object
+    bool view(const uint8_t* bytes, size_t size, std::string* error = nullptr) {
+        close();
+        return attach(bytes, size, error);
+    }
+    
+    void close() {
+#ifdef CPU4BIT_HAS_MMAP
+        if(mapping) munmap(mapping, mappingSize);
+#endif
+        mapping = nullptr;
+        mappingSize = 0;
+        owned.clear();
+        base = nullptr;
+        count = 0;
+    }
+    
+    size_t size() const { return count; }
+    uint16_t inputMask() const { return cellMask; }
+    
+    const uint8_t* image(size_t index) const { return base + HEADER_SIZE + index * stride; }
+    int maxSteps(size_t index) const {
+        return (flags & HAS_MAX_STEPS) ? (int)readU32(image(index) + 16) : defaultMaxSteps;
+    }
+    const uint8_t* inputs(size_t index) const {
+        return (flags & HAS_INPUTS) ? image(index) + inputOffset : nullptr;
+    }
+    Entry entry(size_t index) const { return Entry{ image(index), maxSteps(index), inputs(index) }; }
+    
+    // Image plus inputs into a CPU, ready to run(maxSteps(index))
+    void load(size_t index, CPU4Bit& cpu) const {
+        cpu.loadProgram(image(index));
+        if(const uint8_t* in = inputs(index)) {
+            for(int cell = 0; cell < 16; cell++) {
+                if(cellMask & (1 << cell)) cpu.writeMemory(cell, *in++);
+            }
+        }
+    }
+    
+    // Zero-copy iteration: for(ProgramCorpus::Entry e : corpus)
+    class Iterator {
+    public:
+        Iterator(const ProgramCorpus* corpus, size_t index) : corpus(corpus), index(index) {}
+        Entry operator*() const { return corpus->entry(index); }
+        Iterator& operator++() { index++; return *this; }
+        bool operator!=(const Iterator& other) const { return index != other.index; }
+    private:
+        const ProgramCorpus* corpus;
+        size_t index;
+    };
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, count); }
+    
+    static uint32_t readU32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+    
+private:
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+    std::vector<uint8_t> owned;
+    const uint8_t* base = nullptr;
+    size_t count = 0;
+    size_t stride = 16;
+    uint16_t flags = 0;
+    int defaultMaxSteps = 100;
+    uint16_t cellMask = 0;
+    size_t inputOffset = 16;
+    
+    static bool fail(std::string* error, const std::string& reason) {
+        if(error) *error = reason;
+        return false;
+    }
+    
+    bool attach(const uint8_t* bytes, size_t size, std::string* error) {
+        if(size < HEADER_SIZE || std::memcmp(bytes, "C4PC", 4) != 0) return fail(error, "not a program corpus");
+        if((bytes[4] | (bytes[5] << 8)) != VERSION) return fail(error, "unsupported corpus version");
+        flags = bytes[6] | (bytes[7] << 8);
+        uint64_t records = readU32(bytes + 8) | ((uint64_t)readU32(bytes + 12) << 32);
+        stride = readU32(bytes + 16);
+        defaultMaxSteps = (int)readU32(bytes + 20);
+        cellMask = (flags & HAS_INPUTS) ? (bytes[24] | (bytes[25] << 8)) : 0;
+        inputOffset = (flags & HAS_MAX_STEPS) ? 20 : 16;
+        
+        size_t needed = inputOffset + ((flags & HAS_INPUTS) ? std::bitset<16>(cellMask).count() : 0);
+        if(stride < needed) return fail(error, "record stride too small");
+        if(records > (size - HEADER_SIZE) / stride) return fail(error, "corpus is truncated");
+        base = bytes;
+        count = records;
+        return true;
+    }
+};
+
+// Writes the corpus format above, one record at a time
+class CorpusWriter {
+public:
+    // Fields every record carries; stride 0 means as small as possible
+    CorpusWriter(std::ostream& out, uint16_t flags = 0, uint16_t inputMask = 0,
+                 int defaultMaxSteps = 100, uint32_t stride = 0)
+        : out(out), flags(flags), cellMask((flags & ProgramCorpus::HAS_INPUTS) ? inputMask : 0),
+          defaultMaxSteps(defaultMaxSteps) {
+        size_t needed = 16 + ((flags & ProgramCorpus::HAS_MAX_STEPS) ? 4 : 0) +
+                        std::bitset<16>(cellMask).count();
+        this->stride = std::max<size_t>(stride, needed);
+        record.assign(this->stride, 0);
+        writeHeader();
+    }
+    
+    // inputs: one byte per input cell, lowest cell first
+    void add(const uint8_t* image, int maxSteps = 0, const uint8_t* inputs = nullptr) {
+        std::fill(record.begin(), record.end(), 0);
+        std::memcpy(record.data(), image, 16);
+        size_t at = 16;
+        if(flags & ProgramCorpus::HAS_MAX_STEPS) {
+            for(int i = 0; i < 4; i++) record[at++] = ((uint32_t)maxSteps >> (8 * i)) & 0xFF;
+        }
+        if(inputs) std::memcpy(record.data() + at, inputs, std::bitset<16>(cellMask).count());
+        out.write(reinterpret_cast<const char*>(record.data()), record.size());
+        count++;
+    }
+    
+    // Rewrite the header with the final record count
+    void finish() {
+        std::streampos end = out.tellp();
+        out.seekp(start);
+        writeHeader();
+        out.seekp(end);
+        out.flush();
+    }
+    
+    uint64_t size() const { return count; }
+    
+private:
+    std::ostream& out;
+    std::streampos start = 0;
+    uint16_t flags;
+    uint16_t cellMask;
+    int defaultMaxSteps;
+    size_t stride;
+    uint64_t count = 0;
+    std::vector<uint8_t> record;
+    
+    void writeHeader() {
+        uint8_t header[ProgramCorpus::HEADER_SIZE] = { 'C', '4', 'P', 'C' };
+        auto put = [&](int at, uint64_t value, int bytes) {
+            for(int i = 0; i < bytes; i++) header[at + i] = (value >> (8 * i)) & 0xFF;
+        };
+        put(4, ProgramCorpus::VERSION, 2);
+        put(6, flags, 2);
+        put(8, count, 8);
+        put(16, stride, 4);
+        put(20, (uint32_t)defaultMaxSteps, 4);
+        put(24, cellMask, 2);
+        if(count == 0) start = out.tellp();
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    }
+};
+
+// Why a run stopped, as stored in result files
+enum class HaltReason : uint8_t {
+    Halted,     // Executed HLT
+    StepLimit,  // Still running after maxSteps
+    Cycle       // Stopped by cycle detection
+};
+
+// Why cpu's last run() stopped
+static HaltReason haltReasonOf(const CPU4Bit& cpu) {
+    if(!cpu.isRunning()) return HaltReason::Halted;
+    return cpu.lastCycle().detected ? HaltReason::Cycle : HaltReason::StepLimit;
+}
+
+// Streaming columnar writer for the results of many runs. Rows are
+// collected per column and written a block at a time, each block with a
+// single vectored write. Layout (integers little endian):
+//
+//   header   "C4RS", u16 version (1), u16 reserved
+//   blocks   u32 rows (n), u32 OUT bytes (m), then the columns:
+//              A[n] B[n] C[n] D[n] PC[n] zero[n] halt reason[n]
+//              zero padding to a multiple of 4 bytes
+//              steps u32[n]
+//              OUT offsets u32[n + 1], from 0 to m
+//              OUT values [m]
+//
+// Row i of a block emitted values[offsets[i] .. offsets[i + 1]).
+class ResultWriter {
+public:
+    static const size_t HEADER_SIZE = 8;
+    static const uint16_t VERSION = 1;
+    static const size_t DEFAULT_BLOCK_ROWS = 65536;
+    
+    explicit ResultWriter(std::ostream& out, size_t blockRows = DEFAULT_BLOCK_ROWS) : stream(&out) {
+        start(blockRows);
+    }
+    
+    explicit ResultWriter(const std::string& path, size_t blockRows = DEFAULT_BLOCK_ROWS) {
+#ifdef CPU4BIT_HAS_WRITEV
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        failed = fd < 0;
+#else
+        file.reset(new std::ofstream(path, std::ios::binary));
+        stream = file.get();
+        failed = !*file;
+#endif
+        start(blockRows);
+    }
+    
+    ~ResultWriter() { finish(); }
+    ResultWriter(const ResultWriter&) = delete;
+    ResultWriter& operator=(const ResultWriter&) = delete;
+    
+    void add(const MachineState& s, uint32_t steps, HaltReason reason,
+             const uint8_t* out, size_t outCount) {
+        for(int r = 0; r < 4; r++) columns[r][rows] = s.reg[r];
+        columns[4][rows] = s.pc;
+        columns[5][rows] = s.zero;
+        columns[6][rows] = (uint8_t)reason;
+        putU32(&stepColumn[4 * rows], steps);
+        values.insert(values.end(), out, out + outCount);
+        rows++;
+        putU32(&offsets[4 * rows], values.size());
+        if(rows == blockRows) flushBlock();
+    }
+    
+    // The run that just finished on cpu
+    void add(const CPU4Bit& cpu, int steps) {
+        add(cpu.snapshot(), steps, haltReasonOf(cpu), cpu.output().data(), cpu.output().size());
+    }
+    
+    // Every lane of BatchCPU4Bit or BitSlicedCPU4Bit after run()
+    template<typename Batch>
+    void addBatch(const Batch& batch) {
+        for(size_t lane = 0; lane < batch.size(); lane++) {
+            MachineState s = batch.state(lane);
+            const std::vector<uint8_t>& out = batch.output(lane);
+            add(s, batch.steps(lane), s.running ? HaltReason::StepLimit : HaltReason::Halted,
+                out.data(), out.size());
+        }
+    }
+    
+    // Write buffered rows and close a file opened by path. False if any
+    // write failed.
+    bool finish() {
+        if(rows > 0) flushBlock();
+#ifdef CPU4BIT_HAS_WRITEV
+        if(fd >= 0) {
+            failed |= ::close(fd) != 0;
+            fd = -1;
+        }
+#endif
+        if(stream) stream->flush();
+        file.reset();
+        stream = nullptr;
+        return !failed;
+    }
+    
+    bool good() const { return !failed; }
+    uint64_t size() const { return written + rows; }
+    
+private:
+    std::ostream* stream = nullptr;
+    std::unique_ptr<std::ofstream> file;
+    int fd = -1;
+    bool failed = false;
+    size_t blockRows = 0;
+    size_t rows = 0;
+    uint64_t written = 0;
+    std::vector<uint8_t> columns[7];
+    std::vector<uint8_t> stepColumn;
+    std::vector<uint8_t> offsets;
+    std::vector<uint8_t> values;
+    
+    struct Part {
+        const void* data;
+        size_t size;
+    };
+    
+    static void putU32(uint8_t* p, uint32_t v) {
+        for(int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xFF;
+    }
+    
+    void start(size_t rowsPerBlock) {
+        blockRows = std::max<size_t>(rowsPerBlock, 1);
+        for(std::vector<uint8_t>& column : columns) column.resize(blockRows);
+        stepColumn.resize(4 * blockRows);
+        offsets.assign(4 * (blockRows + 1), 0);
+        uint8_t header[HEADER_SIZE] = { 'C', '4', 'R', 'S', VERSION, 0, 0, 0 };
+        Part part = { header, sizeof(header) };
+        write(&part, 1);
+    }
+    
+    void flushBlock() {
+        static const uint8_t padding[4] = {};
+        uint8_t header[8];
+        putU32(header, rows);
+        putU32(header + 4, values.size());
+        Part parts[12];
+        size_t n = 0;
+        parts[n++] = { header, sizeof(header) };
+        for(const std::vector<uint8_t>& column : columns) parts[n++] = { column.data(), rows };
+        parts[n++] = { padding, (4 - (7 * rows) % 4) % 4 };
+        parts[n++] = { stepColumn.data(), 4 * rows };
+        parts[n++] = { offsets.data(), 4 * (rows + 1) };
+        parts[n++] = { values.data(), values.size() };
+        write(parts, n);
+        written += rows;
+        rows = 0;
+        values.clear();
+    }
+    
+    void write(Part* parts, size_t n) {
+        if(failed) return;
+#ifdef CPU4BIT_HAS_WRITEV
+        if(fd >= 0) {
+            struct iovec iov[12];
+            for(size_t i = 0; i < n; i++) {
+                iov[i].iov_base = const_cast<void*>(parts[i].data);
+                iov[i].iov_len = parts[i].size;
+            }
+            // writev may stop part way; resume after the bytes it took
+            size_t first = 0;
+            while(first < n) {
+                ssize_t done = ::writev(fd, iov + first, n - first);
+                if(done < 0) {
+                    if(errno == EINTR) continue;
+                    failed = true;
+                    return;
+                }
+                while(first < n && (size_t)done >= iov[first].iov_len) {
+                    done -= iov[first].iov_len;
+                    first++;
+                }
+                if(first < n) {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+                    iov[first].iov_len -= done;
+                }
+            }
+            return;
+        }
+#endif
+        if(!stream) return;
+        for(size_t i = 0; i < n; i++) {
+            stream->write(static_cast<const char*>(parts[i].data), parts[i].size);
+        }
+        failed = !*stream;
+    }
+};
+
+// Reads result files written by ResultWriter without copying
+class ResultReader {
+public:
+    // One block's columns, pointing into the file
+    struct Block {
+        size_t rows;
+        const uint8_t* reg[4];
+        const uint8_t* pc;
+        const uint8_t* zero;
+        const uint8_t* reason;
+        const uint8_t* stepColumn;
+        const uint8_t* offsets;
+        const uint8_t* values;
+        
+        uint32_t steps(size_t row) const { return ProgramCorpus::readU32(stepColumn + 4 * row); }
+        HaltReason haltReason(size_t row) const { return (HaltReason)reason[row]; }
+        const uint8_t* outBegin(size_t row) const { return values + ProgramCorpus::readU32(offsets + 4 * row); }
+        const uint8_t* outEnd(size_t row) const { return values + ProgramCorpus::readU32(offsets + 4 * row + 4); }
+    };
+    
+    ResultReader(const uint8_t* data, size_t size) : bytes(data), length(size) {}
+    
+    bool validHeader() const {
+        return length >= ResultWriter::HEADER_SIZE && std::memcmp(bytes, "C4RS", 4) == 0 &&
+               (bytes[4] | (bytes[5] << 8)) == ResultWriter::VERSION;
+    }
+    
+    // Block at offset (start at HEADER_SIZE), advancing offset past it.
+    // False at the end of the file or on a truncated block.
+    bool next(size_t& offset, Block& block) const {
+        if(offset + 8 > length) return false;
+        const uint64_t rows = ProgramCorpus::readU32(bytes + offset);
+        const uint64_t outBytes = ProgramCorpus::readU32(bytes + offset + 4);
+        const uint64_t padded = (7 * rows + 3) & ~(uint64_t)3;
+        const uint64_t total = 8 + padded + 4 * rows + 4 * (rows + 1) + outBytes;
+        if(total > length - offset) return false;
+        
+        const uint8_t* at = bytes + offset + 8;
+        block.rows = rows;
+        for(int r = 0; r < 4; r++) block.reg[r] = at + r * rows;
+        block.pc = at + 4 * rows;
+        block.zero = at + 5 * rows;
+        block.reason = at + 6 * rows;
+        block.stepColumn = at + padded;
+        block.offsets = block.stepColumn + 4 * rows;
+        block.values = block.offsets + 4 * (rows + 1);
+        uint32_t previous = 0;
+        for(size_t i = 0; i <= rows; i++) {
+            uint32_t end = ProgramCorpus::readU32(block.offsets + 4 * i);
+            if(end < previous || end > outBytes || (i == 0 && end != 0)) return false;
+            previous = end;
+        }
+        if(previous != outBytes) return false;
+        offset += total;
+        return true;
+    }
+    
+private:
+    const uint8_t* bytes;
+    size_t length;
+};
+
+// ===== Batch runner =====
+// Runs many independent programs on all cores. Each worker owns a CPU4Bit
+// with the chosen engine and a range of job indices it takes chunks from;
+// a worker whose range runs dry steals the back half of another's. Ranges
+// are (begin, end) pairs packed into one atomic word, so taking and
+// stealing are single compare-exchanges. Result i goes to results[i].
+class BatchRunner {
+public:
+    struct Job {
+        const uint8_t* image;  // 16 bytes, e.g. ProgramCorpus::image(i)
+        int maxSteps;
+    };
+    
+    struct Result {
+        MachineState state;   // After the run
+        int steps;
+        HaltReason reason;
+        uint32_t outCount;
+        uint64_t outHash;     // FNV-1a of the OUT values
+    };
+    
+    struct Report {
+        size_t programs = 0;
+        uint64_t steps = 0;
+        double seconds = 0;
+        double programsPerSecond = 0;
+        double stepsPerSecond = 0;
+        std::vector<uint64_t> programsPerWorker;
+        std::vector<uint64_t> stepsPerWorker;
+        std::vector<uint64_t> stealsPerWorker;
+        std::vector<double> secondsPerWorker;  // Until the worker found no work
+    };
+    
+    void setThreads(int count) { threads = count; }  // 0: one per core
+    void setEngine(Engine e) { engine = e; }
+    void setChunk(size_t jobs) { chunk = std::max<size_t>(jobs, 1); }  // Jobs taken at a time
+    void setCycleDetection(bool enabled) { detectCycles = enabled; }
+    
+    // results must have room for count entries; at most 2^32 - 1 jobs
+    Report run(const Job* jobs, size_t count, Result* results) {
+        return runAll(count, results, [jobs](size_t i, CPU4Bit& cpu) {
+            cpu.loadProgram(jobs[i].image);
+            return jobs[i].maxSteps;
+        });
+    }
+    
+    // Every image of a corpus, with its maxSteps and inputs
+    Report run(const ProgramCorpus& corpus, Result* results) {
+        return runAll(corpus.size(), results, [&corpus](size_t i, CPU4Bit& cpu) {
+            corpus.load(i, cpu);
+            return corpus.maxSteps(i);
+        });
+    }
+    
+    static uint64_t hashOutput(const uint8_t* out, size_t count) {
+        uint64_t h = 1469598103934665603ull;
+        for(size_t i = 0; i < count; i++) {
+            h ^= out[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+    
+private:
+    struct alignas(64) Worker {
+        std::atomic<uint64_t> range;  // begin << 32 | end
+        uint64_t programs = 0;
+        uint64_t steps = 0;
+        uint64_t steals = 0;
+        double seconds = 0;
+    };
+    
+    int threads = 0;
+    Engine engine = Engine::Threaded;
+    size_t chunk = 256;
+    bool detectCycles = false;
+    std::unique_ptr<Worker[]> workers;
+    size_t workerCount = 0;
+    
+    static uint64_t pack(uint64_t begin, uint64_t end) { return begin << 32 | end; }
+    
+    // Next chunk of this worker's own range
+    bool take(Worker& mine, size_t& begin, size_t& end) {
+        uint64_t range = mine.range.load(std::memory_order_relaxed);
+        while(true) {
+            begin = range >> 32;
+            end = range & 0xFFFFFFFF;
+            if(begin >= end) return false;
+            size_t taken = std::min(begin + chunk, end);
+            if(mine.range.compare_exchange_weak(range, pack(taken, end), std::memory_order_relaxed)) {
+                end = taken;
+                return true;
+            }
+        }
+    }
+    
+    // Move the back half of some other worker's range into this one's
+    bool steal(size_t self) {
+        for(size_t k = 1; k < workerCount; k++) {
+            Worker& victim = workers[(self + k) % workerCount];
+            uint64_t range = victim.range.load(std::memory_order_relaxed);
+            while(true) {
+                uint64_t begin = range >> 32, end = range & 0xFFFFFFFF;
+                if(begin >= end) break;
+                uint64_t middle = end - (end - begin + 1) / 2;
+                if(victim.range.compare_exchange_weak(range, pack(begin, middle), std::memory_order_relaxed)) {
+                    workers[self].range.store(pack(middle, end), std::memory_order_relaxed);
+                    workers[self].steals++;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    template<typename Load>
+    void work(size_t self, Result* results, const Load& load) {
+        Worker& mine = workers[self];
+        auto start = std::chrono::steady_clock::now();
+        CPU4Bit cpu;
+        cpu.setTraceMode(TraceMode::Silent);
+        cpu.setEngine(engine);
+        cpu.setCycleDetection(detectCycles);
+        size_t begin, end;
+        while(true) {
+            if(!take(mine, begin, end)) {
+                if(steal(self)) continue;
+                break;  // Every range is empty: the rest is already being run
+            }
+            for(size_t i = begin; i < end; i++) {
+                cpu.reset();
+                const int maxSteps = load(i, cpu);
+                Result& r = results[i];
+                r.steps = cpu.run(maxSteps);
+                r.state = cpu.snapshot();
+                r.reason = haltReasonOf(cpu);
+                r.outCount = cpu.output().size();
+                r.outHash = hashOutput(cpu.output().data(), cpu.output().size());
+                mine.steps += r.steps;
+            }
+            mine.programs += end - begin;
+        }
+        mine.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    template<typename Load>
+    Report runAll(size_t count, Result* results, const Load& load) {
+        Report report;
+        auto start = std::chrono::steady_clock::now();
+        workerCount = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workerCount = std::max<size_t>(1, std::min(workerCount, count));
+        workers.reset(new Worker[workerCount]);
+        
+        // Contiguous equal shares to start with
+        for(size_t w = 0; w < workerCount; w++) {
+            workers[w].range.store(pack(count * w / workerCount, count * (w + 1) / workerCount));
+        }
+        std::vector<std::thread> pool;
+        for(size_t w = 1; w < workerCount; w++) {
+            pool.emplace_back([this, w, results, &load] { work(w, results, load); });
+        }
+        work(0, results, load);
+        for(std::thread& t : pool) t.join();
+        
+        for(size_t w = 0; w < workerCount; w++) {
+            report.programs += workers[w].programs;
+            report.steps += workers[w].steps;
+            report.programsPerWorker.push_back(workers[w].programs);
+            report.stepsPerWorker.push_back(workers[w].steps);
+            report.stealsPerWorker.push_back(workers[w].steals);
+            report.secondsPerWorker.push_back(workers[w].seconds);
+        }
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(report.seconds > 0) {
+            report.programsPerSecond = report.programs / report.seconds;
+            report.stepsPerSecond = report.steps / report.seconds;
+        }
+        workers.reset();
+        return report;
+    }
+};
+
+// ===== Differential runner =====
+// Runs the same programs on the reference semantics and on each engine and
+// reports where they part. Fast mode compares final state, step count and
+// OUT values once per run; lockstep mode advances each engine with run(1)
+// and compares after every step. A difference found at the end of a run is
+// narrowed down to its first diverging step by one lockstep pass, or - if
+// stepping does not reproduce it - a binary search over runs of k steps
+// from the start. Workers take chunks of programs from an atomic counter
+// and own one CPU4Bit per engine plus OUT buffers sized for maxSteps, so
+// once warmed up comparing a program allocates nothing.
+class DifferentialRunner {
+public:
+    enum class Mode { AtHalt, Lockstep };
+    
+    struct Divergence {
+        size_t program;         // Index of the program in the run
+        Engine engine;
+        int step;               // 1-based: the first step after which they differ
+        MachineState before;    // Reference state before that step
+        MachineState expected;  // Reference state after it
+        MachineState actual;    // Engine state after it
+        uint32_t expectedOut;   // OUT values so far
+        uint32_t actualOut;
+    };
+    
+    struct Report {
+        uint64_t programs = 0;
+        uint64_t comparisons = 0;  // Runs (AtHalt) or steps (Lockstep) compared, per engine
+        uint64_t divergences = 0;
+        std::vector<uint64_t> divergencesPerEngine;  // Indexed by Engine
+        std::vector<Divergence> first;               // Lowest program indices, at most maxReported
+        double seconds = 0;
+        double comparisonsPerSecond = 0;
+    };
+    
+    DifferentialRunner() {
+        engines = { Engine::Interpreter, Engine::Predecoded, Engine::Threaded, Engine::BlockCache,
+                    Engine::JIT, Engine::CountedLoop, Engine::JumpTable };
+    }
+    
+    void setEngines(const std::vector<Engine>& list) { engines = list; }
+    void setMode(Mode m) { mode = m; }
+    void setThreads(int count) { threads = count; }  // 0: one per core
+    void setChunk(size_t programs) { chunk = std::max<size_t>(programs, 1); }
+    void setMaxReported(size_t count) { maxReported = count; }
+    
+    Report run(const BatchRunner::Job* jobs, size_t count) {
+        return runAll(count, [jobs](size_t i, CPU4Bit&, MachineState& initial) {
+            initial = MachineState();
+            initial.running = 1;
+            std::memcpy(initial.ram, jobs[i].image, 16);
+            return jobs[i].maxSteps;
+        });
+    }
+    
+    // Every image of a corpus, with its maxSteps and inputs
+    Report run(const ProgramCorpus& corpus) {
+        return runAll(corpus.size(), [&corpus](size_t i, CPU4Bit& scratch, MachineState& initial) {
+            scratch.reset();
+            corpus.load(i, scratch);
+            initial = scratch.snapshot();
+            return corpus.maxSteps(i);
+        });
+    }
+    
+    // count random images; image i depends only on seed and i
+    Report runRandom(size_t count, uint64_t seed, int maxSteps) {
+        return runAll(count, [seed, maxSteps](size_t i, CPU4Bit&, MachineState& initial) {
+            initial = MachineState();
+            initial.running = 1;
+            uint64_t x = seed + i * 0x9E3779B97F4A7C15ull;
+            for(int half = 0; half < 2; half++) {
+                // splitmix64
+                uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                z ^= z >> 31;
+                std::memcpy(initial.ram + half * 8, &z, 8);
+            }
+            return maxSteps;
+        });
+    }
+    
+private:
+    std::vector<Engine> engines;
+    Mode mode = Mode::AtHalt;
+    int threads = 0;
+    size_t chunk = 256;
+    size_t maxReported = 16;
+    
+    std::atomic<size_t> next;
+    std::mutex reportLock;
+    
+    struct Worker {
+        std::vector<std::unique_ptr<CPU4Bit>> cpus;  // One per engine
+        CPU4Bit scratch;
+        std::vector<uint8_t> refOut;
+        std::vector<uint8_t> locateOut;
+        uint64_t programs = 0;
+        uint64_t comparisons = 0;
+        std::vector<uint64_t> divergences;
+    };
+    
+    static bool sameOutput(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+    
+    // k steps of the engine from the start against k reference steps; ref
+    // and refOut are left at the reference's state after them
+    static bool differsAfter(CPU4Bit& cpu, const MachineState& initial, int k,
+                             MachineState& ref, std::vector<uint8_t>& refOut) {
+        ref = initial;
+        refOut.clear();
+        const int refSteps = CPU4Bit::runState(ref, k, refOut);
+        cpu.reset();
+        cpu.restore(initial);
+        const int ran = cpu.run(k);
+        return ran != refSteps || cpu.snapshot() != ref || !sameOutput(cpu.output(), refOut);
+    }
+    
+    // The first step after which the engine differs from the reference.
+    // Stepping with run(1) finds it in one pass; an engine that only goes
+    // wrong over longer runs is binary-searched for a k where run(k - 1)
+    // matches and run(k) does not, O(maxSteps log maxSteps) steps in all.
+    static Divergence locate(CPU4Bit& cpu, const MachineState& initial, int maxSteps, std::vector<uint8_t>& refOut) {
+        Divergence d = Divergence();
+        MachineState ref = initial;
+        refOut.clear();
+        cpu.reset();
+        cpu.restore(initial);
+        int hi = 0;
+        for(int k = 1; k <= maxSteps && ref.running; k++) {
+            d.before = ref;
+            const int refRan = CPU4Bit::runState(ref, 1, refOut);
+            const int ran = cpu.run(1);
+            const std::vector<uint8_t>& out = cpu.output();
+            if(ran != refRan || cpu.snapshot() != ref || out.size() != refOut.size() ||
+               (!out.empty() && out.back() != refOut.back())) {
+                hi = k;
+                break;
+            }
+        }
+        if(hi == 0) {
+            int lo = 0;
+            hi = maxSteps;
+            while(hi - lo > 1) {
+                const int middle = lo + (hi - lo) / 2;
+                if(differsAfter(cpu, initial, middle, ref, refOut)) hi = middle;
+                else lo = middle;
+            }
+            ref = initial;
+            refOut.clear();
+            CPU4Bit::runState(ref, lo, refOut);
+            d.before = ref;
+            differsAfter(cpu, initial, hi, ref, refOut);
+        }
+        d.step = hi;
+        d.expected = ref;
+        d.actual = cpu.snapshot();
+        d.expectedOut = refOut.size();
+        d.actualOut = cpu.output().size();
+        return d;
+    }
+    
+    void record(Worker& w, size_t e, Divergence d, std::vector<Divergence>& first) {
+        w.divergences[e]++;
+        std::lock_guard<std::mutex> guard(reportLock);
+        if(first.size() < maxReported) {
+            first.push_back(d);
+            return;
+        }
+        // Keep the lowest program indices, so the report is the same for any thread count
+        auto last = std::max_element(first.begin(), first.end(), [](const Divergence& a, const Divergence& b) {
+            return a.program < b.program;
+        });
+        if(last != first.end() && d.program < last->program) *last = d;
+    }
+    
+    void compareAtHalt(Worker& w, size_t program, const MachineState& initial, int maxSteps,
+                       std::vector<Divergence>& first) {
+        MachineState ref = initial;
+        w.refOut.clear();
+        const int refSteps = CPU4Bit::runState(ref, maxSteps, w.refOut);
+        for(size_t e = 0; e < engines.size(); e++) {
+            CPU4Bit& cpu = *w.cpus[e];
+            cpu.reset();
+            cpu.restore(initial);
+            const int ran = cpu.run(maxSteps);
+            w.comparisons++;
+            if(ran == refSteps && cpu.snapshot() == ref && sameOutput(cpu.output(), w.refOut)) continue;
+            Divergence d = locate(cpu, initial, maxSteps, w.locateOut);
+            d.program = program;
+            d.engine = engines[e];
+            record(w, e, d, first);
+        }
+    }
+    
+    void compareLockstep(Worker& w, size_t program, const MachineState& initial, int maxSteps,
+                         std::vector<Divergence>& first) {
+        for(size_t e = 0; e < engines.size(); e++) {
+            CPU4Bit& cpu = *w.cpus[e];
+            cpu.reset();
+            cpu.restore(initial);
+            MachineState ref = initial;
+            w.refOut.clear();
+            for(int k = 1; k <= maxSteps && ref.running; k++) {
+                const MachineState before = ref;
+                const int refRan = CPU4Bit::runState(ref, 1, w.refOut);
+                const int ran = cpu.run(1);
+                w.comparisons++;
+                const std::vector<uint8_t>& out = cpu.output();
+                if(ran == refRan && cpu.snapshot() == ref && out.size() == w.refOut.size() &&
+                   (out.empty() || out.back() == w.refOut.back())) continue;
+                Divergence d = { program, engines[e], k, before, ref, cpu.snapshot(),
+                                 (uint32_t)w.refOut.size(), (uint32_t)out.size() };
+                record(w, e, d, first);
+                break;
+            }
+        }
+    }
+    
+    template<typename Load>
+    void work(Worker& w, size_t count, std::vector<Divergence>& first, const Load& load) {
+        MachineState initial;
+        while(true) {
+            const size_t begin = next.fetch_add(chunk, std::memory_order_relaxed);
+            if(begin >= count) break;
+            const size_t end = std::min(begin + chunk, count);
+            for(size_t i = begin; i < end; i++) {
+                const int maxSteps = load(i, w.scratch, initial);
+                if((int)w.refOut.capacity() < maxSteps) {
+                    w.refOut.reserve(maxSteps);
+                    w.locateOut.reserve(maxSteps);
+                }
+                if(mode == Mode::Lockstep) compareLockstep(w, i, initial, maxSteps, first);
+                else compareAtHalt(w, i, initial, maxSteps, first);
+            }
+            w.programs += end - begin;
+        }
+    }
+    
+    template<typename Load>
+    Report runAll(size_t count, const Load& load) {
+        Report report;
+        auto start = std::chrono::steady_clock::now();
+        size_t workerCount = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workerCount = std::max<size_t>(1, std::min(workerCount, count));
+        std::vector<Worker> workers(workerCount);
+        for(Worker& w : workers) {
+            for(Engine e : engines) {
+                w.cpus.emplace_back(new CPU4Bit());
+                w.cpus.back()->setTraceMode(TraceMode::Silent);
+                w.cpus.back()->setEngine(e);
+            }
+            w.scratch.setTraceMode(TraceMode::Silent);
+            w.divergences.assign(engines.size(), 0);
+        }
+        std::vector<Divergence> first;
+        first.reserve(maxReported);
+        next.store(0);
+        
+        std::vector<std::thread> pool;
+        for(size_t t = 1; t < workerCount; t++) {
+            pool.emplace_back([this, &workers, t, count, &first, &load] { work(workers[t], count, first, load); });
+        }
+        work(workers[0], count, first, load);
+        for(std::thread& t : pool) t.join();
+        
+        report.divergencesPerEngine.assign(ENGINE_COUNT, 0);
+        for(const Worker& w : workers) {
+            report.programs += w.programs;
+            report.comparisons += w.comparisons;
+            for(size_t e = 0; e < engines.size(); e++) {
+                report.divergences += w.divergences[e];
+                report.divergencesPerEngine[(size_t)engines[e]] += w.divergences[e];
+            }
+        }
+        std::sort(first.begin(), first.end(), [](const Divergence& a, const Divergence& b) {
+            return a.program != b.program ? a.program < b.program : a.engine < b.engine;
+        });
+        report.first = first;
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(report.seconds > 0) report.comparisonsPerSecond = report.comparisons / report.seconds;
+        return report;
+    }
+};
+
+// ===== Superoptimizer =====
+// Exhaustive search for the shortest program - fewest bytes, or fewest
+// executed steps - that, run from the base state, emits exactly the target
+// OUT values and/or ends with the target registers. The program occupies
+// RAM[0..length-1]; the base image supplies the rest (inputs, data).
+//
+// Programs are built one byte at a time, and each prefix runs until it
+// reaches a byte not chosen yet. That part of the run is the same for
+// every completion, so a wrong OUT value or a failed run prunes the whole
+// subtree, and a prefix whose run ends early is a shorter program that
+// was already tried. As instructions, the 256 byte values fall into 148
+// equivalence classes (operands that are ignored, MOV r->r, ALU 8-15 and
+// NOP, ...), and only one byte per class is tried. This is exact as long
+// as the program does not read its own code with LDM; setCodeAsData(true)
+// allows that and tries all 256 values. Subtrees are shared out to
+// worker threads through an atomic counter.
+class Superoptimizer {
+public:
+    enum class Cost { Length, Steps };
+    
+    struct Solution {
+        std::vector<uint8_t> program;
+        int steps;
+    };
+    
+    struct Report {
+        std::vector<Solution> solutions;  // Best first, at most maxSolutions
+        int length = 0;                   // Of the best solution, 0 if none
+        uint64_t nodes = 0;               // Prefixes tried
+        std::vector<uint64_t> nodesPerWorker;
+        double seconds = 0;
+    };
+    
+    Superoptimizer() {
+        base = MachineState();
+        base.running = 1;
+    }
+    
+    void setTargetOutput(const std::vector<uint8_t>& out) {
+        target = out;
+        checkOutput = true;
+    }
+    void setTargetRegister(int r, uint8_t value) {
+        regMask |= 1 << r;
+        regs[r] = value;
+    }
+    void setBase(const MachineState& s) { base = s; }  // Registers and RAM the program starts from
+    void requireHalt(bool enabled) { mustHalt = enabled; }
+    void setMaxSteps(int steps) { maxSteps = steps; }
+    void setMaxLength(int bytes) { maxLength = std::min(bytes, 16); }
+    void setCost(Cost c) { cost = c; }
+    void setCodeAsData(bool enabled) { codeAsData = enabled; }
+    void setThreads(int count) { threads = count; }  // 0: one per core
+    void setMaxSolutions(size_t count) { maxSolutions = count; }
+    
+    Report run() {
+        Report report;
+        auto start = std::chrono::steady_clock::now();
+        candidates.clear();
+        for(int b = 0; b < 256; b++) {
+            if(codeAsData || representative(b) == b) candidates.push_back(b);
+        }
+        bestSteps.store(INT32_MAX);
+        found.clear();
+        int workerCount = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        report.nodesPerWorker.assign(workerCount, 0);
+        
+        for(int length = 1; length <= maxLength; length++) {
+            searchLength(length, workerCount, report);
+            if(cost == Cost::Length && !found.empty()) break;
+        }
+        
+        std::sort(found.begin(), found.end(), [](const Solution& a, const Solution& b) {
+            if(a.steps != b.steps) return a.steps < b.steps;
+            if(a.program.size() != b.program.size()) return a.program.size() < b.program.size();
+            return a.program < b.program;
+        });
+        if(cost == Cost::Length) {
+            std::stable_sort(found.begin(), found.end(), [](const Solution& a, const Solution& b) {
+                return a.program.size() < b.program.size();
+            });
+        }
+        if(found.size() > maxSolutions) found.resize(maxSolutions);
+        report.solutions = found;
+        if(!found.empty()) report.length = found[0].program.size();
+        for(uint64_t n : report.nodesPerWorker) report.nodes += n;
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return report;
+    }
+    
+    // The byte standing for b's equivalence class, as an instruction
+    static uint8_t representative(uint8_t b) {
+        const uint8_t opcode = b >> 4, operand = b & 0x0F;
+        switch(opcode) {
+            case CPU4Bit::NOP: return 0x00;
+            case CPU4Bit::ADD: case CPU4Bit::SUB: case CPU4Bit::HLT: return opcode << 4;
+            case CPU4Bit::MOV: return ((operand >> 2) == (operand & 0x03)) ? 0x00 : b;
+            case CPU4Bit::OUT: case CPU4Bit::INC: case CPU4Bit::DEC: return b & 0xF3;
+            case CPU4Bit::ALU: return operand < 8 ? b : 0x00;
+            default: return b;
+        }
+    }
+    
+private:
+    enum Status { BLOCKED, DONE, REJECTED };
+    
+    // A prefix and its run so far
+    struct Node {
+        MachineState m;
+        uint8_t image[16];
+        uint16_t known;    // Cells chosen, stored to, or beyond the program
+        uint16_t written;  // Program cells stored to
+        uint32_t outCount;
+        int steps;
+    };
+    
+    std::vector<uint8_t> target;
+    bool checkOutput = false;
+    uint8_t regMask = 0;
+    uint8_t regs[4] = {};
+    MachineState base;
+    bool mustHalt = true;
+    int maxSteps = 64;
+    int maxLength = 4;
+    Cost cost = Cost::Length;
+    bool codeAsData = false;
+    int threads = 0;
+    size_t maxSolutions = 16;
+    
+    std::vector<uint8_t> candidates;
+    std::atomic<int> bestSteps;
+    std::mutex foundLock;
+    std::vector<Solution> found;
+    static const size_t FOUND_LIMIT = 1 << 16;
+    
+    // OUT sink that follows the run along the target sequence
+    struct OutputCheck {
+        const Superoptimizer* search;
+        Node* node;
+        bool diverged;
+        void push_back(uint8_t value) {
+            if(!search->checkOutput) return;
+            const std::vector<uint8_t>& target = search->target;
+            if(node->outCount >= target.size() || target[node->outCount] != value) diverged = true;
+            node->outCount++;
+        }
+    };
+    
+    // Continue n's run until it needs an unchosen cell, finishes or fails
+    Status advance(Node& n, int length) const {
+        const int stepLimit = cost == Cost::Steps ? std::min(maxSteps, bestSteps.load(std::memory_order_relaxed)) : maxSteps;
+        // A repeated state is a loop that never halts (Brent)
+        MachineState saved = n.m;
+        int power = 1, sinceSaved = 0;
+        while(n.m.running && n.steps < maxSteps) {
+            if(n.steps >= stepLimit) return REJECTED;
+            if(mustHalt) {
+                if(sinceSaved == power) {
+                    saved = n.m;
+                    power *= 2;
+                    sinceSaved = 0;
+                }
+                sinceSaved++;
+            }
+            const uint8_t pc = n.m.pc;
+            if(!(n.known & (1 << pc))) return BLOCKED;
+            const uint8_t instruction = n.m.ram[pc];
+            const uint8_t opcode = instruction >> 4, operand = instruction & 0x0F;
+            if(opcode == CPU4Bit::LDM) {
+                if(!(n.known & (1 << operand))) return BLOCKED;
+                if(!codeAsData && operand < length && !(n.written & (1 << operand))) return REJECTED;
+            }
+            if(opcode == CPU4Bit::STA || opcode == CPU4Bit::STB) {
+                n.known |= 1 << operand;
+                if(operand < length) n.written |= 1 << operand;
+            }
+            OutputCheck out = { this, &n, false };
+            CPU4Bit::runState(n.m, 1, out);
+            n.steps++;
+            if(out.diverged || (mustHalt && n.m == saved)) return REJECTED;
+        }
+        return DONE;
+    }
+    
+    bool accepts(const Node& n) const {
+        if(mustHalt && n.m.running) return false;
+        if(checkOutput && n.outCount != target.size()) return false;
+        for(int r = 0; r < 4; r++) {
+            if((regMask & (1 << r)) && n.m.reg[r] != regs[r]) return false;
+        }
+        return true;
+    }
+    
+    void record(const Node& n, int length) {
+        std::lock_guard<std::mutex> guard(foundLock);
+        if(cost == Cost::Steps) {
+            if(n.steps < bestSteps.load()) {
+                bestSteps.store(n.steps);
+                found.clear();
+            }
+            if(n.steps > bestSteps.load()) return;
+        }
+        if(found.size() < FOUND_LIMIT) {
+            found.push_back({ std::vector<uint8_t>(n.image, n.image + length), n.steps });
+        }
+    }
+    
+    // Children of n: one per candidate for cell depth, run as far as they go.
+    // Calls visit(child, status) for each child that is still alive.
+    template<typename Visit>
+    void expand(const Node& n, int depth, int length, uint64_t& nodes, const Visit& visit) const {
+        // A cell stored to before it was used never matters: byte 0 stands in
+        const bool fixed = n.known & (1 << depth);
+        const size_t count = fixed ? 1 : candidates.size();
+        for(size_t c = 0; c < count; c++) {
+            Node child = n;
+            child.image[depth] = fixed ? 0 : candidates[c];
+            if(!fixed) {
+                child.m.ram[depth] = candidates[c];
+                child.known |= 1 << depth;
+            }
+            nodes++;
+            const Status status = advance(child, length);
+            if(status == REJECTED) continue;
+            // Finished before every cell was chosen: same as a shorter program
+            if(status == DONE && depth + 1 < length) continue;
+            visit(child, status);
+        }
+    }
+    
+    void search(const Node& n, int depth, int length, uint64_t& nodes) {
+        if(depth == length) {
+            if(accepts(n)) record(n, length);
+            return;
+        }
+        expand(n, depth, length, nodes, [&](const Node& child, Status) {
+            search(child, depth + 1, length, nodes);
+        });
+    }
+    
+    void searchLength(int length, int workerCount, Report& report) {
+        Node root;
+        root.m = base;
+        root.m.pc = 0;
+        root.m.running = 1;
+        std::memset(root.image, 0, sizeof(root.image));
+        root.known = (uint16_t)(0xFFFF << length);
+        root.written = 0;
+        root.outCount = 0;
+        root.steps = 0;
+        if(advance(root, length) != BLOCKED) return;  // Cell 0 is always needed first
+        
+        // Subtrees below the first two cells are the units of work
+        uint64_t nodes = 0;
+        std::vector<Node> tasks;
+        std::vector<int> taskDepth;
+        expand(root, 0, length, nodes, [&](const Node& child, Status) {
+            if(length == 1) {
+                tasks.push_back(child);
+                taskDepth.push_back(1);
+                return;
+            }
+            expand(child, 1, length, nodes, [&](const Node& grandchild, Status) {
+                tasks.push_back(grandchild);
+                taskDepth.push_back(2);
+            });
+        });
+        report.nodesPerWorker[0] += nodes;
+        
+        std::atomic<size_t> next(0);
+        auto work = [&](int self) {
+            uint64_t mine = 0;
+            for(size_t t = next.fetch_add(1); t < tasks.size(); t = next.fetch_add(1)) {
+                search(tasks[t], taskDepth[t], length, mine);
+            }
+            report.nodesPerWorker[self] += mine;
+        };
+        std::vector<std::thread> pool;
+        for(int w = 1; w < workerCount; w++) pool.emplace_back(work, w);
+        work(0);
+        for(std::thread& t : pool) t.join();
+    }
+};
+
+// ===== Fuzzer =====
+// Coverage-guided fuzzing of CPU4Bit's engines with 16-byte program images.
+// Every input runs once on the reference semantics, which records coverage,
+// and once on a CPU4Bit with the engine under test; any difference in the
+// final state, step count or OUT values is a mismatch. A location is
+// (PC, opcode, JZ taken or not / ALU sub-op 0-15), so the ALU sub-ops 8-15
+// that take the default branch count as their own locations; an edge is a
+// pair of consecutive locations, hashed AFL-style into 64K hit counters.
+//
+// run() is a self-contained mutational loop. Built with
+// -DCPU4BIT_LIBFUZZER (clang++ -fsanitize=fuzzer), LLVMFuzzerTestOneInput()
+// feeds libFuzzer's inputs through execute() instead and exposes the edge
+// counters to it as extra counters.
+class Fuzzer {
+public:
+    static constexpr size_t MAP_SIZE = 1 << 16;
+    static constexpr size_t LOCATIONS = 16 * 16 * 16;  // PC, opcode, JZ/ALU detail
+    
+    struct Report {
+        uint64_t execs = 0;
+        size_t corpus = 0;     // Inputs kept for new coverage
+        size_t edges = 0;      // Hit counters ever non-zero
+        size_t locations = 0;  // Of LOCATIONS
+        uint64_t mismatches = 0;
+        std::vector<uint8_t> firstMismatch;  // Image, empty if none
+        double seconds = 0;
+        double execsPerSecond = 0;
+    };
+    
+    // counters: MAP_SIZE hit counters to fill, e.g. libFuzzer's extra
+    // counters; by default the fuzzer's own
+    explicit Fuzzer(uint8_t* counters = nullptr)
+        : map(counters ? counters : ownMap.data()), touched(maxSteps + 1) {
+        ref.reserve(maxSteps);
+        cpu.setTraceMode(TraceMode::Silent);
+    }
+    
+    Fuzzer(const Fuzzer&) = delete;
+    Fuzzer& operator=(const Fuzzer&) = delete;
+    
+    void setEngine(Engine e) { cpu.setEngine(e); }
+    void setMaxSteps(int steps) {
+        maxSteps = std::max(steps, 1);
+        touched.resize(maxSteps + 1);
+        ref.reserve(maxSteps);
+    }
+    void setSeed(uint64_t seed) { rng = seed | 1; }
+    void addSeed(const uint8_t* image) { addSeed(image, 16); }
+    void addSeed(const uint8_t* image, size_t size) {
+        Image seed = {};
+        std::memcpy(seed.data(), image, std::min<size_t>(size, 16));
+        corpus.push_back(seed);
+    }
+    
+    // One input: the first 16 bytes are the image (zero-padded). Hit counts
+    // are added to the counter map and locations marked. False on a
+    // mismatch between the engine and the reference.
+    bool execute(const uint8_t* data, size_t size) {
+        std::memset(image, 0, sizeof(image));
+        std::memcpy(image, data, std::min<size_t>(size, 16));
+        
+        MachineState s = MachineState();
+        s.running = 1;
+        std::memcpy(s.ram, image, 16);
+        ref.clear();
+        touchedCount = 0;
+        uint32_t prev = 0;
+        int steps = 0;
+        // A repeated state (Brent) loops until the step limit: coverage stops
+        // there and the rest of the run is filled in period by period
+        MachineState saved = s;
+        int savedStep = 0, power = 1;
+        size_t savedOut = 0;
+        while(s.running && steps < maxSteps) {
+            const uint8_t instruction = s.ram[s.pc];
+            const uint8_t opcode = instruction >> 4;
+            uint32_t detail = 0;
+            if(opcode == CPU4Bit::JZ) detail = s.zero;
+            else if(opcode == CPU4Bit::ALU) detail = instruction & 0x0F;
+            const uint32_t location = (uint32_t)s.pc << 8 | opcode << 4 | detail;
+            seenLocations[location >> 6] |= 1ull << (location & 63);
+            prev = hit(prev, location);
+            CPU4Bit::runState(s, 1, ref);
+            steps++;
+            if(s == saved) {
+                const int period = steps - savedStep;
+                const size_t loopEnd = ref.size();
+                const int periods = (maxSteps - steps) / period;
+                for(int p = 0; p < periods; p++) {
+                    for(size_t o = savedOut; o < loopEnd; o++) ref.push_back(ref[o]);
+                }
+                steps += periods * period;
+                steps += CPU4Bit::runState(s, maxSteps - steps, ref);
+                break;
+            }
+            if(steps - savedStep == power) {
+                saved = s;
+                savedStep = steps;
+                savedOut = ref.size();
+                power *= 2;
+            }
+        }
+        hit(prev, (uint32_t)LOCATIONS + (s.running ? 1 : 0));  // How the run ended
+        
+        cpu.reset();
+        cpu.loadProgram(image, 16);
+        const int ran = cpu.run(maxSteps);
+        return ran == steps && cpu.snapshot() == s && cpu.output() == ref;
+    }
+    
+    // Mutate corpus entries for execs executions, keeping every input
+    // that reaches a new edge or hit-count bucket
+    Report run(uint64_t execs) {
+        Report report;
+        auto start = std::chrono::steady_clock::now();
+        if(corpus.empty()) corpus.push_back(Image());
+        const size_t seeds = corpus.size();
+        for(const Image& seed : corpus) {
+            report.mismatches += check(seed.data(), report);
+            collect();
+        }
+        for(uint64_t i = 0; i < execs; i++) {
+            Image input = corpus[next() % corpus.size()];
+            const int mutations = 1 + next() % 4;
+            for(int m = 0; m < mutations; m++) mutate(input);
+            report.mismatches += check(input.data(), report);
+            if(collect()) corpus.push_back(input);
+        }
+        report.execs = seeds + execs;
+        report.corpus = corpus.size();
+        for(size_t e = 0; e < MAP_SIZE; e++) report.edges += seenBuckets[e] != 0;
+        report.locations = locationCount();
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(report.seconds > 0) report.execsPerSecond = report.execs / report.seconds;
+        return report;
+    }
+    
+    // Whether instruction has run at pc (for JZ: with the jump taken or not)
+    bool covered(uint8_t pc, uint8_t instruction, bool taken = false) const {
+        const uint8_t opcode = instruction >> 4;
+        uint32_t detail = 0;
+        if(opcode == CPU4Bit::JZ) detail = taken;
+        else if(opcode == CPU4Bit::ALU) detail = instruction & 0x0F;
+        const uint32_t location = (uint32_t)(pc & 0x0F) << 8 | opcode << 4 | detail;
+        return seenLocations[location >> 6] & (1ull << (location & 63));
+    }
+    
+    size_t locationCount() const {
+        size_t count = 0;
+        for(uint64_t word : seenLocations) count += std::bitset<64>(word).count();
+        return count;
+    }
+    
+    const std::vector<std::array<uint8_t, 16>>& inputs() const { return corpus; }
+    
+private:
+    typedef std::array<uint8_t, 16> Image;
+    
+    int maxSteps = 64;
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    std::array<uint8_t, MAP_SIZE> ownMap = {};
+    uint8_t* map;
+    std::array<uint8_t, MAP_SIZE> seenBuckets = {};  // Hit-count buckets per edge so far
+    std::array<uint64_t, LOCATIONS / 64> seenLocations = {};
+    std::vector<uint32_t> touched;                   // Counters made non-zero by this run
+    size_t touchedCount = 0;
+    std::vector<uint8_t> ref;                        // Reference OUT values
+    uint8_t image[16];
+    CPU4Bit cpu;
+    std::vector<Image> corpus;
+    
+    // Count the edge prev -> location; returns the new prev
+    uint32_t hit(uint32_t prev, uint32_t location) {
+        const uint32_t id = (location * 2654435761u) >> 16;
+        const uint32_t e = (prev ^ id) & (MAP_SIZE - 1);
+        uint8_t& counter = map[e];
+        if(counter == 0 && touchedCount < touched.size()) touched[touchedCount++] = e;
+        counter += counter != 255;
+        return id >> 1;
+    }
+    
+    // AFL hit-count classes: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+    static uint8_t bucket(uint8_t count) {
+        if(count <= 3) return 1 << (count - 1);
+        if(count < 8) return 8;
+        if(count < 16) return 16;
+        if(count < 32) return 32;
+        return count < 128 ? 64 : 128;
+    }
+    
+    // Fold this run's counters into the seen buckets and clear them.
+    // True if something new was reached.
+    bool collect() {
+        bool fresh = false;
+        for(size_t t = 0; t < touchedCount; t++) {
+            uint8_t& counter = map[touched[t]];
+            const uint8_t b = bucket(counter);
+            if(!(seenBuckets[touched[t]] & b)) {
+                seenBuckets[touched[t]] |= b;
+                fresh = true;
+            }
+            counter = 0;
+        }
+        touchedCount = 0;
+        return fresh;
+    }
+    
+    bool check(const uint8_t* input, Report& report) {
+        if(execute(input, 16)) return false;
+        if(report.firstMismatch.empty()) report.firstMismatch.assign(input, input + 16);
+        return true;
+    }
+    
+    uint64_t next() {  // xorshift64*
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return rng * 2685821657736338717ull;
+    }
+    
+    void mutate(Image& input) {
+        const uint64_t r = next();
+        const int cell = r & 0x0F;
+        const uint8_t value = r >> 8;
+        switch((r >> 4) % 10) {
+            case 0: input[cell] = value; break;
+            case 1: input[cell] ^= 1 << (value & 7); break;
+            case 2: input[cell] = (value & 0xF0) | (input[cell] & 0x0F); break;  // Opcode
+            case 3: input[cell] = (input[cell] & 0xF0) | (value & 0x0F); break;  // Operand
+            case 4: input[cell] = CPU4Bit::ALU << 4 | (value & 0x0F); break;     // Sub-ops 8-15 half the time
+            case 5: {
+                static const uint8_t control[] = { CPU4Bit::JMP, CPU4Bit::JZ, CPU4Bit::HLT, CPU4Bit::OUT };
+                input[cell] = control[value & 3] << 4 | ((value >> 4) & 0x0F);
+                break;
+            }
+            case 6: std::swap(input[cell], input[value & 0x0F]); break;
+            case 7: {  // Insert a byte, dropping the last
+                std::memmove(&input[cell + 1], &input[cell], 15 - cell);
+                input[cell] = value;
+                break;
+            }
+            case 8: {  // Delete a byte
+                std::memmove(&input[cell], &input[cell + 1], 15 - cell);
+                input[15] = 0;
+                break;
+            }
+            default: {  // Splice in a run of another input
+                const Image& other = corpus[(r >> 16) % corpus.size()];
+                const int length = 1 + ((r >> 48) % (16 - cell));
+                std::memcpy(&input[cell], &other[cell], length);
+                break;
+            }
+        }
+    }
+};
+
+// ===== Multi-core system =====
+// Several cores running against one RAM. Each core has its own registers,
+// PC, zero flag and OUT values; RAM cells in the shared mask (all of them
+// by default) are one memory seen by every core, code included, while the
+// other cells are private to each core. Interleaving is deterministic
+// round-robin (quantum steps per turn) or seeded random, one step at a
+// time. In Relaxed mode every core runs on its own host thread and only
+// touches the shared cells through atomics (sequentially consistent), so
+// cores synchronize at shared-memory accesses and nowhere else; the
+// interleaving is then whatever the host produces.
+class MultiCoreSystem {
+public:
+    enum class Schedule { RoundRobin, Seeded, Relaxed };
+    
+    explicit MultiCoreSystem(size_t coreCount) : coreList(std::max<size_t>(coreCount, 1)) {
+        for(std::atomic<uint8_t>& cell : shared) cell.store(0, std::memory_order_relaxed);
+        reset();
+    }
+    
+    MultiCoreSystem(const MultiCoreSystem&) = delete;
+    MultiCoreSystem& operator=(const MultiCoreSystem&) = delete;
+    
+    // Every core back at PC 0 with clear registers and OUT values; RAM
+    // (shared and private) is kept
+    void reset() {
+        for(Core& c : coreList) {
+            uint8_t ram[16];
+            std::memcpy(ram, c.state.ram, 16);
+            c.state = MachineState();
+            c.state.running = 1;
+            std::memcpy(c.state.ram, ram, 16);
+            c.out.clear();
+            c.steps = 0;
+        }
+    }
+    
+    // The image goes to the shared cells and to every core's private cells
+    void loadProgram(const uint8_t* image, size_t size = 16) {
+        uint8_t ram[16] = {};
+        std::memcpy(ram, image, std::min<size_t>(size, 16));
+        for(int a = 0; a < 16; a++) shared[a].store(ram[a], std::memory_order_relaxed);
+        for(Core& c : coreList) std::memcpy(c.state.ram, ram, 16);
+        reset();
+    }
+    void loadProgram(const std::vector<uint8_t>& program) { loadProgram(program.data(), program.size()); }
+    
+    void setSharedMask(uint16_t mask) { sharedMask = mask; }  // Bit a: RAM[a] is shared
+    uint16_t getSharedMask() const { return sharedMask; }
+    void setSchedule(Schedule s, uint64_t seed = 1) {
+        schedule = s;
+        rng = seed | 1;
+    }
+    void setQuantum(int steps) { quantum = std::max(steps, 1); }  // RoundRobin steps per turn
+    
+    size_t cores() const { return coreList.size(); }
+    // Registers, PC and flags of core i (set them before run()), and its
+    // private cells; shared cells in it are scratch
+    MachineState& core(size_t i) { return coreList[i].state; }
+    // Core i as it sees memory: private cells plus the shared ones
+    MachineState view(size_t i) const {
+        MachineState s = coreList[i].state;
+        for(int a = 0; a < 16; a++) {
+            if(sharedMask & (1 << a)) s.ram[a] = shared[a].load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+    uint8_t readShared(uint8_t addr) const { return shared[addr & 0x0F].load(std::memory_order_relaxed); }
+    void writeShared(uint8_t addr, uint8_t value) { shared[addr & 0x0F].store(value, std::memory_order_relaxed); }
+    const std::vector<uint8_t>& output(size_t i) const { return coreList[i].out; }
+    uint64_t steps(size_t i) const { return coreList[i].steps; }
+    bool isRunning() const {
+        for(const Core& c : coreList) {
+            if(c.state.running) return true;
+        }
+        return false;
+    }
+    
+    // Run until every core has halted or used maxSteps steps in this call.
+    // Returns the steps executed by all cores together.
+    uint64_t run(int maxSteps) {
+        const uint64_t before = totalSteps();
+        switch(schedule) {
+            case Schedule::RoundRobin: runRoundRobin(maxSteps); break;
+            case Schedule::Seeded:     runSeeded(maxSteps); break;
+            case Schedule::Relaxed:    runRelaxed(maxSteps); break;
+        }
+        return totalSteps() - before;
+    }
+    
+private:
+    struct alignas(64) Core {
+        MachineState state;
+        std::vector<uint8_t> out;
+        uint64_t steps = 0;
+    };
+    
+    std::vector<Core> coreList;
+    std::array<std::atomic<uint8_t>, 16> shared;
+    uint16_t sharedMask = 0xFFFF;
+    Schedule schedule = Schedule::RoundRobin;
+    int quantum = 1;
+    uint64_t rng = 1;
+    
+    uint64_t totalSteps() const {
+        uint64_t total = 0;
+        for(const Core& c : coreList) total += c.steps;
+        return total;
+    }
+    
+    // One instruction of core c. Fetches, LDM and stores go to the shared
+    // cells with the given memory order; everything else is the reference
+    // step on the core's own state, with the fetched byte in its scratch cell.
+    template<std::memory_order Load, std::memory_order Store>
+    void step(Core& c) {
+        MachineState& s = c.state;
+        const uint8_t pc = s.pc;
+        const uint8_t instruction = (sharedMask & (1 << pc)) ? shared[pc].load(Load) : s.ram[pc];
+        const uint8_t opcode = instruction >> 4, operand = instruction & 0x0F;
+        const bool sharedOperand = sharedMask & (1 << operand);
+        c.steps++;
+        switch(opcode) {
+            case CPU4Bit::STA:
+            case CPU4Bit::STB: {
+                const uint8_t value = s.reg[opcode == CPU4Bit::STA ? 0 : 1];
+                s.pc = (pc + 1) & 0x0F;
+                if(sharedOperand) shared[operand].store(value, Store);
+                else s.ram[operand] = value;
+                break;
+            }
+            case CPU4Bit::LDM:
+                s.pc = (pc + 1) & 0x0F;
+                s.reg[0] = sharedOperand ? shared[operand].load(Load) : s.ram[operand];
+                break;
+            default:
+                s.ram[pc] = instruction;
+                CPU4Bit::runState(s, 1, c.out);
+                break;
+        }
+    }
+    
+    void runRoundRobin(int maxSteps) {
+        std::vector<int> left(coreList.size(), maxSteps);
+        bool any = true;
+        while(any) {
+            any = false;
+            for(size_t i = 0; i < coreList.size(); i++) {
+                Core& c = coreList[i];
+                for(int q = 0; q < quantum && c.state.running && left[i] > 0; q++) {
+                    step<std::memory_order_relaxed, std::memory_order_relaxed>(c);
+                    left[i]--;
+                }
+                any |= c.state.running && left[i] > 0;
+            }
+        }
+    }
+    
+    uint64_t next() {  // xorshift64*
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return rng * 2685821657736338717ull;
+    }
+    
+    // Each step goes to a core drawn from those still running
+    void runSeeded(int maxSteps) {
+        std::vector<size_t> active;
+        std::vector<int> left(coreList.size(), maxSteps);
+        for(size_t i = 0; i < coreList.size(); i++) {
+            if(coreList[i].state.running && maxSteps > 0) active.push_back(i);
+        }
+        while(!active.empty()) {
+            const size_t k = next() % active.size();
+            const size_t i = active[k];
+            step<std::memory_order_relaxed, std::memory_order_relaxed>(coreList[i]);
+            if(!coreList[i].state.running || --left[i] == 0) {
+                active[k] = active.back();
+                active.pop_back();
+            }
+        }
+    }
+    
+    void runRelaxed(int maxSteps) {
+        auto work = [this, maxSteps](size_t i) {
+            Core& c = coreList[i];
+            for(int n = 0; n < maxSteps && c.state.running; n++) {
+                step<std::memory_order_seq_cst, std::memory_order_seq_cst>(c);
+            }
+        };
+        std::vector<std::thread> pool;
+        for(size_t i = 1; i < coreList.size(); i++) pool.emplace_back(work, i);
+        work(0);
+        for(std::thread& t : pool) t.join();
+    }
+};
+
+// ===== Example programs =====
+
+// Program: Add 5 + 3 and output result
+static const std::vector<uint8_t> program1 = {
+    0x15,  // LDA #5   - Load 5 into A
+    0x23,  // LDB #3   - Load 3 into B
+    0x50,  // ADD      - Add B to A
+    0xB0,  // OUT A    - Output A (should be 8)
+    0xF0   // HLT      - Halt
+};
+
+// Program: Count down from 5 to 0
+static const std::vector<uint8_t> program2 = {
+    0x15,  // 0: LDA #5    - Load 5 into A
+    0xB0,  // 1: OUT A     - Output A
+    0xD0,  // 2: DEC A     - Decrement A
+    0x81,  // 3: JZ 1      - Jump to address 1 (OUT) if zero
+    0x71,  // 4: JMP 1     - Jump back to OUT
+    0xF0   // 5: HLT       - Halt (unreachable in this program)
+};
+
+// Program: Store and load from memory
+static const std::vector<uint8_t> program3 = {
+    0x1A,  // 0: LDA #10   - Load 10 into A
+    0x3F,  // 1: STA [15]  - Store A to RAM[15]
+    0x10,  // 2: LDA #0    - Clear A
+    0xB0,  // 3: OUT A     - Output A (0)
+    0xAF,  // 4: LDM [15]  - Load from RAM[15] to A
+    0xB0,  // 5: OUT A     - Output A (10)
+    0xF0   // 6: HLT       - Halt
+};
+
+// Program: Demonstrate bitwise operations
+// A=1100 (12), B=1010 (10)
+static const std::vector<uint8_t> program4 = {
+    0x1C,  // 0: LDA #12   - Load 12 (0b1100) into A
+    0x2A,  // 1: LDB #10   - Load 10 (0b1010) into B
+    0xB0,  // 2: OUT A     - Output A=12
+    0xB1,  // 3: OUT B     - Output B=10
+    0xE0,  // 4: AND       - A & B = 0b1000 (8)
+    0xB0,  // 5: OUT A     - Output result
+    0x1C,  // 6: LDA #12   - Reload A
+    0xE1,  // 7: OR        - A | B = 0b1110 (14)
+    0xB0,  // 8: OUT A     - Output result
+    0x1C,  // 9: LDA #12   - Reload A
+    0xE2,  // A: XOR       - A ^ B = 0b0110 (6)
+    0xB0,  // B: OUT A     - Output result
+    0xF0   // C: HLT       - Halt
+};
+
+// Program: Demonstrate NOT operation
+static const std::vector<uint8_t> program5 = {
+    0x15,  // 0: LDA #5    - Load 5 (0b0101) into A
+    0xB0,  // 1: OUT A     - Output A=5
+    0xE3,  // 2: NOT       - ~A = 0b1010 (10)
+    0xB0,  // 3: OUT A     - Output A=10
+    0xE3,  // 4: NOT       - ~A = 0b0101 (5) - back to original
+    0xB0,  // 5: OUT A     - Output A=5
+    0xF0   // 6: HLT       - Halt
+};
+
+// Program: Demonstrate shift left and shift right
+static const std::vector<uint8_t> program6 = {
+    0x13,  // 0: LDA #3    - Load 3 (0b0011) into A
+    0xB0,  // 1: OUT A     - Output A=3
+    0xE4,  // 2: SHL       - A << 1 = 0b0110 (6)
+    0xB0,  // 3: OUT A     - Output A=6
+    0xE4,  // 4: SHL       - A << 1 = 0b1100 (12)
+    0xB0,  // 5: OUT A     - Output A=12
+    0xE5,  // 6: SHR       - A >> 1 = 0b0110 (6)
+    0xB0,  // 7: OUT A     - Output A=6
+    0xE5,  // 8: SHR       - A >> 1 = 0b0011 (3)
+    0xB0,  // 9: OUT A     - Output A=3
+    0xF0   // A: HLT       - Halt
+};
+
+// Program: Demonstrate rotate left and rotate right
+static const std::vector<uint8_t> program7 = {
+    0x19,  // 0: LDA #9    - Load 9 (0b1001) into A
+    0xB0,  // 1: OUT A     - Output A=9
+    0xE6,  // 2: ROL       - Rotate left = 0b0011 (3)
+    0xB0,  // 3: OUT A     - Output A=3
+    0xE6,  // 4: ROL       - Rotate left = 0b0110 (6)
+    0xB0,  // 5: OUT A     - Output A=6
+    0xE7,  // 6: ROR       - Rotate right = 0b0011 (3)
+    0xB0,  // 7: OUT A     - Output A=3
+    0xE7,  // 8: ROR       - Rotate right = 0b1001 (9) - back to start
+    0xB0,  // 9: OUT A     - Output A=9
+    0xF0   // A: HLT       - Halt
+};
+
+// Program: Extract lower 2 bits using AND
+static const std::vector<uint8_t> program8 = {
+    0x1F,  // 0: LDA #15   - Load 15 (0b1111) into A
+    0x23,  // 1: LDB #3    - Load 3 (0b0011) as mask into B
+    0xE0,  // 2: AND       - A & B = 0b0011 (3) - extract lower 2 bits
+    0xB0,  // 3: OUT A     - Output A=3
+    0xF0   // 4: HLT       - Halt
+};
+
+// Data-dependent loop used by the batch checks and benchmark:
+// inputs x in RAM[14] and y in RAM[15], repeats A = (A + y) << 1 x times
+static const std::vector<uint8_t> inputLoopProgram = {
+    0xAE,  // 0: LDM [14]  - A = x
+    0x91,  // 1: MOV A->B  - B = x (loop counter)
+    0xAF,  // 2: LDM [15]  - A = y
+    0x50,  // 3: ADD       - A = A + B
+    0xE4,  // 4: SHL       - A = A << 1
+    0xD1,  // 5: DEC B
+    0x88,  // 6: JZ 8      - Leave the loop when B reaches 0
+    0x73,  // 7: JMP 3
+    0xB0,  // 8: OUT A
+    0xF0   // 9: HLT
+};
+
+// Put a CPU into an arbitrary state for engine comparisons
+static void prepareCPU(CPU4Bit& cpu, const uint8_t* image, const uint8_t* regs, uint8_t pc, bool zero) {
+    cpu.reset();
+    for(int i = 0; i < 16; i++) {
+        cpu.writeMemory(i, image[i]);
+    }
+    for(int r = 0; r < 4; r++) {
+        cpu.setRegisterValue(r, regs[r]);
+    }
+    cpu.setPC(pc);
+    cpu.setZeroFlag(zero);
+}
+
+// Compare an engine with the reference interpreter, returns the number of mismatches
+static int checkEngine(Engine engine, const char* name) {
+    std::mt19937 rng(12345);
+    CPU4Bit ref, fast;
+    ref.setTraceMode(TraceMode::Silent);
+    fast.setTraceMode(TraceMode::Silent);
+    fast.setEngine(engine);
+    
+    uint8_t image[16], regs[4];
+    auto randomize = [&]() {
+        for(int i = 0; i < 16; i++) image[i] = rng() & 0xFF;
+        // Registers are usually 4-bit but LDM can load a full byte
+        for(int r = 0; r < 4; r++) regs[r] = (rng() % 4 == 0) ? (rng() & 0xFF) : (rng() & 0x0F);
+    };
+    
+    int failures = 0;
+    auto compare = [&](const char* what, int detail) {
+        if(!ref.sameState(fast)) {
+            if(failures == 0) {
+                std::cout << name << ": mismatch in " << what << " " << detail << std::endl;
+                ref.printState();
+                fast.printState();
+            }
+            failures++;
+        }
+    };
+    
+    // Every one of the 256 encodings, one step from random states
+    for(int instruction = 0; instruction < 256; instruction++) {
+        for(int trial = 0; trial < 64; trial++) {
+            randomize();
+            uint8_t pc = rng() & 0x0F;
+            bool zero = rng() & 1;
+            image[pc] = instruction;
+            prepareCPU(ref, image, regs, pc, zero);
+            prepareCPU(fast, image, regs, pc, zero);
+            ref.run(1);
+            fast.run(1);
+            compare("encoding", instruction);
+        }
+    }
+    
+    // Every encoding again, inside random programs run for a few steps
+    for(int instruction = 0; instruction < 256; instruction++) {
+        for(int trial = 0; trial < 16; trial++) {
+            randomize();
+            uint8_t pc = rng() & 0x0F;
+            image[pc] = instruction;
+            image[(pc + 1 + rng() % 15) & 0x0F] = instruction;
+            prepareCPU(ref, image, regs, pc, rng() & 1);
+            prepareCPU(fast, image, regs, pc, ref.getZeroFlag());
+            int maxSteps = 1 + rng() % 64;
+            if(ref.run(maxSteps) != fast.run(maxSteps)) failures++;
+            compare("encoding in program", instruction);
+        }
+    }
+    
+    // Random programs run for many steps
+    for(int trial = 0; trial < 2000; trial++) {
+        randomize();
+        uint8_t zeroRegs[4] = {0, 0, 0, 0};
+        prepareCPU(ref, image, zeroRegs, 0, false);
+        prepareCPU(fast, image, zeroRegs, 0, false);
+        int maxSteps = 1 + rng() % 300;
+        int rs = ref.run(maxSteps), fs = fast.run(maxSteps);
+        if(rs != fs) {
+            if(failures == 0) {
+                std::cout << name << ": step count " << rs << " vs " << fs << " program";
+                for(int i = 0; i < 16; i++) std::cout << " " << std::hex << (int)image[i] << std::dec;
+                std::cout << " maxSteps " << maxSteps << std::endl;
+            }
+            failures++;
+        }
+        compare("random program", trial);
+    }
+    
+    std::cout << name << ": " << (failures ? "FAILED" : "ok") 
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// State as seen through the public accessors
+static MachineState observeState(const CPU4Bit& cpu) {
+    MachineState s;
+    for(int r = 0; r < 4; r++) s.reg[r] = cpu.getRegisterValue(r);
+    s.pc = cpu.getPC();
+    s.zero = cpu.getZeroFlag();
+    s.running = cpu.isRunning();
+    for(int i = 0; i < 16; i++) s.ram[i] = cpu.readMemory(i);
+    return s;
+}
+
+// Resume from every checkpoint of a run with restore(), and from the middle
+// with fork(); both must end exactly where the original run did
+static int checkSnapshots() {
+    std::mt19937 rng(2024);
+    const int length = 64;
+    int failures = 0;
+    CPU4Bit cpu, replay, child;
+    cpu.setTraceMode(TraceMode::Silent);
+    replay.setTraceMode(TraceMode::Silent);
+    replay.setEngine(Engine::BlockCache);
+    SnapshotArena arena(length);
+    std::vector<size_t> outputsAt;
+    
+    for(int trial = 0; trial < 300; trial++) {
+        uint8_t image[16], regs[4];
+        for(uint8_t& b : image) b = rng() & 0xFF;
+        for(uint8_t& r : regs) r = rng() & 0x0F;
+        prepareCPU(cpu, image, regs, rng() & 0x0F, rng() & 1);
+        cpu.setEngine(Engine::Threaded);
+        
+        arena.clear();
+        outputsAt.clear();
+        for(int step = 0; step < length; step++) {
+            if(cpu.snapshot() != observeState(cpu)) failures++;
+            arena.push(cpu.snapshot());
+            outputsAt.push_back(cpu.output().size());
+            if(step == length / 2) cpu.fork(child);
+            cpu.step();
+        }
+        
+        for(size_t i = 0; i < arena.size(); i++) {
+            replay.reset();
+            replay.restore(arena[i]);
+            replay.run(length - i);
+            const std::vector<uint8_t>& out = cpu.output();
+            if(replay.snapshot() != cpu.snapshot() ||
+               replay.output() != std::vector<uint8_t>(out.begin() + outputsAt[i], out.end())) {
+                if(failures == 0) std::cout << "snapshots: trial " << trial << " checkpoint " << i << " differs" << std::endl;
+                failures++;
+            }
+        }
+        
+        child.run(length - length / 2);
+        if(!child.sameState(cpu)) {
+            if(failures == 0) std::cout << "snapshots: fork in trial " << trial << " differs" << std::endl;
+            failures++;
+        }
+    }
+    
+    // Settings travel with the fork
+    cpu.setJumpTableLimit(1 << 20);
+    cpu.fork(child);
+    if(child.getJumpTableLimit() != cpu.getJumpTableLimit()) failures++;
+    
+    std::cout << "snapshots: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Step back, seek and runBackTo() against the states of a plain forward run
+static int checkTimeTravel() {
+    std::mt19937 rng(1313);
+    int failures = 0;
+    CPU4Bit cpu, plain;
+    cpu.setTraceMode(TraceMode::Silent);
+    plain.setTraceMode(TraceMode::Silent);
+    std::vector<MachineState> states;
+    std::vector<size_t> outputs;
+    
+    auto matches = [&](int step) {
+        const std::vector<uint8_t>& out = plain.output();
+        return cpu.historyPosition() == step && cpu.snapshot() == states[step] &&
+               cpu.output() == std::vector<uint8_t>(out.begin(), out.begin() + outputs[step]);
+    };
+    
+    for(int trial = 0; trial < 300; trial++) {
+        uint8_t image[16], regs[4];
+        for(uint8_t& b : image) b = rng() & 0xFF;
+        for(uint8_t& r : regs) r = rng() & 0x0F;
+        uint8_t pc = rng() & 0x0F;
+        bool zero = rng() & 1;
+        prepareCPU(plain, image, regs, pc, zero);
+        prepareCPU(cpu, image, regs, pc, zero);
+        cpu.setTimeTravel(true, 1 + trial % 20);
+        
+        // Reference: every state of the forward run
+        states.assign(1, plain.snapshot());
+        outputs.assign(1, 0);
+        while(plain.isRunning() && states.size() < 150) {
+            plain.step();
+            states.push_back(plain.snapshot());
+            outputs.push_back(plain.output().size());
+        }
+        const int last = states.size() - 1;
+        
+        cpu.run(last);
+        int errors = matches(last) ? 0 : 1;
+        
+        // Random seeks both ways, then all the way back one step at a time
+        for(int i = 0; i < 20; i++) {
+            int target = rng() % (last + 1);
+            if(!cpu.seekStep(target) || !matches(target)) errors++;
+        }
+        cpu.seekStep(last);
+        for(int step = last; step > 0; step--) {
+            if(!cpu.stepBack() || !matches(step - 1)) errors++;
+        }
+        if(cpu.stepBack()) errors++;
+        
+        // From the end back to the most recent visit of some address
+        cpu.seekStep(last);
+        uint8_t target = rng() & 0x0F;
+        int expected = last - 1;
+        while(expected >= 0 && states[expected].pc != target) expected--;
+        if(cpu.runBackTo(target) != (expected >= 0) || !matches(expected >= 0 ? expected : 0)) errors++;
+        
+        if(errors && failures == 0) std::cout << "time travel: trial " << trial << " differs" << std::endl;
+        failures += errors;
+    }
+    
+    std::cout << "time travel: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Record random runs with the interpreter, replay them on every engine, and
+// make sure a damaged log is caught
+static int checkRecordReplay() {
+    std::mt19937 rng(5150);
+    const Engine engines[] = { Engine::Interpreter, Engine::Predecoded, Engine::Threaded,
+                               Engine::BlockCache, Engine::JIT, Engine::CountedLoop,
+                               Engine::JumpTable };
+    int failures = 0;
+    CPU4Bit recorder, player;
+    recorder.setTraceMode(TraceMode::Silent);
+    player.setTraceMode(TraceMode::Verbose);  // replay() must not trace
+    
+    for(int trial = 0; trial < 200; trial++) {
+        ExecutionLog log;
+        recorder.setRecorder(&log);
+        long long steps = 0;
+        size_t runs = 0, detecting = 0;
+        for(int program = 0; program < 3; program++) {
+            uint8_t image[16], regs[4];
+            for(uint8_t& b : image) b = rng() & 0xFF;
+            for(uint8_t& r : regs) r = rng() & 0x0F;
+            prepareCPU(recorder, image, regs, rng() & 0x0F, rng() & 1);
+            recorder.setCycleDetection(rng() & 1);
+            for(int run = 0; run < 3; run++) {
+                if(rng() % 4 == 0) recorder.writeMemory(rng() & 0x0F, rng() & 0xFF);
+                steps += recorder.run(rng() % 60);
+                runs++;
+                if(recorder.getCycleDetection()) detecting++;
+            }
+        }
+        recorder.setRecorder(nullptr);
+        
+        for(Engine engine : engines) {
+            player.setEngine(engine);
+            ReplayReport report = player.replay(log);
+            if(!report.ok || report.runs != runs || report.steps != steps || report.predecodedRuns != detecting) {
+                if(failures == 0) std::cout << "replay: trial " << trial << " fails" << std::endl;
+                failures++;
+            }
+        }
+        
+        // Time travel is off while replaying and back on afterwards
+        player.setTimeTravel(true);
+        if(!player.replay(log).ok || !player.getTimeTravel() || player.historyPosition() != 0) failures++;
+        player.setTimeTravel(false);
+        
+        // A changed OUT value or step count must not replay cleanly
+        std::vector<uint8_t> damaged = log.data();
+        size_t at = ExecutionLog::HEADER_SIZE;
+        ExecutionLog::Record record;
+        while(log.next(at, record)) {
+            if(record.type == ExecutionLog::RUN && record.outCount > 0) {
+                damaged[record.out - log.data().data()] ^= 1;
+                if(player.replay(ExecutionLog(damaged.data(), damaged.size())).ok) failures++;
+                break;
+            }
+        }
+        ExecutionLog truncated(log.data().data(), log.data().size() - 1);
+        if(!player.replay(truncated).malformed) failures++;
+    }
+    if(!player.traceText().empty()) failures++;
+    
+    std::cout << "record/replay: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Model checker against a brute-force walk of every trajectory
+static int checkModelChecker() {
+    std::mt19937 rng(8086);
+    int failures = 0;
+    
+    for(int trial = 0; trial < 200; trial++) {
+        MachineState base = MachineState();
+        base.running = 1;
+        for(uint8_t& b : base.ram) b = rng() & 0xFF;
+        const uint16_t inputs = (1 << 14) | (1 << 15);
+        const uint16_t protect = rng() & 0xFFFF;
+        
+        ModelChecker checker(1 << 18);
+        checker.addInputSweep(base, inputs, 16);
+        checker.protectRam(protect);
+        checker.requireHalt(trial % 2 == 0);
+        checker.setThreads(1 + trial % 4);
+        checker.setOrder(trial % 3 == 0 ? ModelChecker::Order::BFS : ModelChecker::Order::DFS);
+        ModelChecker::Report report = checker.run();
+        
+        // Brute force: follow each trajectory until it halts or repeats
+        std::unordered_map<MachineState, bool, MachineStateHash> seen;  // state -> halted
+        bool loops = false, writes = false;
+        for(int x = 0; x < 16; x++) {
+            for(int y = 0; y < 16; y++) {
+                MachineState s = base;
+                s.ram[14] = x;
+                s.ram[15] = y;
+                std::unordered_map<MachineState, bool, MachineStateHash> path;
+                while(true) {
+                    if(path.count(s)) {
+                        loops = true;
+                        break;
+                    }
+                    path[s] = true;
+                    seen[s] = !s.running;
+                    if(!s.running) break;
+                    uint8_t instruction = s.ram[s.pc];
+                    if(((instruction >> 4) == CPU4Bit::STA || (instruction >> 4) == CPU4Bit::STB) &&
+                       (protect & (1 << (instruction & 0x0F)))) {
+                        writes = true;
+                    }
+                    s = CPU4Bit::successor(s);
+                }
+            }
+        }
+        size_t halted = 0;
+        for(auto& entry : seen) halted += entry.second;
+        
+        bool expectViolation = writes || (trial % 2 == 0 && loops);
+        bool ok = report.complete && report.violated == expectViolation;
+        if(!expectViolation) {
+            ok = ok && report.states == seen.size() && report.haltedStates == halted;
+        } else {
+            // The trace must be a real run ending in the reported state
+            ok = ok && !report.trace.empty() && seen.count(report.trace[0]) &&
+                 report.trace[0].ram[14] < 16 && report.trace[0].ram[15] < 16;
+            for(size_t i = 1; ok && i < report.trace.size(); i++) {
+                ok = CPU4Bit::successor(report.trace[i - 1]) == report.trace[i];
+            }
+        }
+        if(!ok) {
+            if(failures == 0) std::cout << "model checker: trial " << trial << " differs" << std::endl;
+            failures++;
+        }
+    }
+    
+    std::cout << "model checker: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Pool handles, recycling and bulk reset against individual CPUs
+static int checkPool() {
+    std::mt19937 rng(31337);
+    int failures = 0;
+    CPUPool pool;
+    CPU4Bit ref;
+    ref.setTraceMode(TraceMode::Silent);
+    std::vector<CPUPool::Handle> handles;
+    
+    // Fresh handles look like CPU4Bit after reset()
+    for(int i = 0; i < 10000; i++) handles.push_back(pool.allocate());
+    ref.reset();
+    for(CPUPool::Handle h : handles) {
+        if(pool[h] != ref.snapshot()) failures++;
+    }
+    
+    // Dirty every CPU, release every third one, then recycle them
+    for(size_t i = 0; i < handles.size(); i++) {
+        for(uint8_t& b : pool[handles[i]].ram) b = rng() & 0xFF;
+        if(i % 3 == 0) pool.release(handles[i]);
+    }
+    const size_t capacity = pool.capacity();
+    for(size_t i = 0; i < handles.size(); i += 3) {
+        CPUPool::Handle h = pool.allocate();
+        if(pool.isLive(h) == false || pool[h] != ref.snapshot()) failures++;
+    }
+    if(pool.capacity() != capacity || pool.size() != handles.size()) failures++;
+    
+    // Runs match CPU4Bit::run()
+    std::vector<uint8_t> out;
+    for(int trial = 0; trial < 500; trial++) {
+        CPUPool::Handle h = handles[rng() % handles.size()];
+        pool.reset(h);
+        std::vector<uint8_t> program(16);
+        for(uint8_t& b : program) b = rng() & 0xFF;
+        pool.loadProgram(h, program);
+        ref.reset();
+        ref.loadProgram(program);
+        out.clear();
+        int steps = pool.run(h, 100, &out);
+        if(steps != ref.run(100) || pool[h] != ref.snapshot() || out != ref.output()) failures++;
+    }
+    
+    // Bulk reset
+    ref.reset();
+    pool.resetAll();
+    for(size_t p = 0; p < pool.pageCount(); p++) {
+        for(size_t i = 0; i < CPUPool::PAGE_SIZE; i++) {
+            if(pool.page(p)[i] != ref.snapshot()) failures++;
+        }
+    }
+    
+    std::cout << "pool: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Write corpora in memory and on disk, read them back and run every image
+static int checkCorpus() {
+    std::mt19937 rng(4242);
+    int failures = 0;
+    const uint16_t inputMask = (1 << 14) | (1 << 15);
+    std::vector<std::vector<uint8_t>> images(300, std::vector<uint8_t>(16));
+    std::vector<int> limits;
+    std::vector<std::array<uint8_t, 2>> inputs;
+    std::stringstream buffer;
+    {
+        CorpusWriter writer(buffer, ProgramCorpus::HAS_MAX_STEPS | ProgramCorpus::HAS_INPUTS,
+                            inputMask, 100, 32);
+        for(std::vector<uint8_t>& image : images) {
+            for(uint8_t& b : image) b = rng() & 0xFF;
+            limits.push_back(1 + rng() % 200);
+            inputs.push_back({ (uint8_t)(rng() & 0xFF), (uint8_t)(rng() & 0xFF) });
+            writer.add(image.data(), limits.back(), inputs.back().data());
+        }
+        writer.finish();
+    }
+    std::string bytes = buffer.str();
+    
+    auto verify = [&](const ProgramCorpus& corpus) {
+        if(corpus.size() != images.size()) {
+            failures++;
+            return;
+        }
+        CPU4Bit fromCorpus, ref;
+        fromCorpus.setTraceMode(TraceMode::Silent);
+        ref.setTraceMode(TraceMode::Silent);
+        size_t i = 0;
+        for(ProgramCorpus::Entry e : corpus) {
+            if(std::memcmp(e.image, images[i].data(), 16) != 0 || e.maxSteps != limits[i] ||
+               std::memcmp(e.inputs, inputs[i].data(), 2) != 0) failures++;
+            fromCorpus.reset();
+            corpus.load(i, fromCorpus);
+            ref.reset();
+            ref.loadProgram(images[i]);
+            ref.writeMemory(14, inputs[i][0]);
+            ref.writeMemory(15, inputs[i][1]);
+            if(fromCorpus.run(e.maxSteps) != ref.run(limits[i]) || !fromCorpus.sameState(ref) ||
+               fromCorpus.output() != ref.output()) failures++;
+            i++;
+        }
+    };
+    
+    ProgramCorpus corpus;
+    if(!corpus.view(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size())) failures++;
+    verify(corpus);
+    
+    const char* path = "cpu4bit-selftest.c4pc";
+    std::ofstream(path, std::ios::binary).write(bytes.data(), bytes.size());
+    if(!corpus.open(path)) failures++;
+    verify(corpus);
+    corpus.close();
+    std::remove(path);
+    
+    // Minimal records fall back to the header's maxSteps
+    std::stringstream plain;
+    CorpusWriter writer(plain, 0, 0, 77);
+    writer.add(images[0].data());
+    writer.finish();
+    std::string plainBytes = plain.str();
+    if(plainBytes.size() != ProgramCorpus::HEADER_SIZE + 16 ||
+       !corpus.view(reinterpret_cast<const uint8_t*>(plainBytes.data()), plainBytes.size()) ||
+       corpus.size() != 1 || corpus.maxSteps(0) != 77 || corpus.inputs(0) != nullptr) failures++;
+    
+    // Damaged files are rejected
+    std::string error;
+    std::string truncated = bytes.substr(0, bytes.size() - 1);
+    if(corpus.view(reinterpret_cast<const uint8_t*>(truncated.data()), truncated.size(), &error) ||
+       error.empty()) failures++;
+    std::string badMagic = bytes;
+    badMagic[0] = 'X';
+    if(corpus.view(reinterpret_cast<const uint8_t*>(badMagic.data()), badMagic.size())) failures++;
+    
+    std::cout << "corpus: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Write runs through ResultWriter and read every column back
+static int checkResults() {
+    std::mt19937 rng(5150);
+    int failures = 0;
+    struct Row {
+        MachineState state;
+        int steps;
+        HaltReason reason;
+        std::vector<uint8_t> out;
+    };
+    std::vector<Row> rows;
+    
+    CPU4Bit cpu;
+    cpu.setTraceMode(TraceMode::Silent);
+    std::stringstream buffer;
+    const char* path = "cpu4bit-selftest.c4rs";
+    {
+        ResultWriter inMemory(buffer, 97);
+        ResultWriter onDisk(path, 97);
+        for(int trial = 0; trial < 1000; trial++) {
+            std::vector<uint8_t> program(16);
+            for(uint8_t& b : program) b = rng() & 0xFF;
+            cpu.reset();
+            cpu.loadProgram(program);
+            cpu.setCycleDetection(trial % 2 == 0);
+            int steps = cpu.run(1 + rng() % 100);
+            inMemory.add(cpu, steps);
+            onDisk.add(cpu, steps);
+            rows.push_back({ cpu.snapshot(), steps, haltReasonOf(cpu), cpu.output() });
+        }
+#if defined(__GNUC__)
+        BatchCPU4Bit batch(64);
+        batch.loadProgram(inputLoopProgram);
+        for(size_t lane = 0; lane < batch.size(); lane++) batch.writeMemory(lane, 14, lane);
+        batch.run(60);
+        inMemory.addBatch(batch);
+        onDisk.addBatch(batch);
+        for(size_t lane = 0; lane < batch.size(); lane++) {
+            MachineState s = batch.state(lane);
+            rows.push_back({ s, batch.steps(lane), s.running ? HaltReason::StepLimit : HaltReason::Halted,
+                             batch.output(lane) });
+        }
+#endif
+        if(inMemory.size() != rows.size() || !inMemory.finish() || !onDisk.finish()) failures++;
+    }
+    std::ifstream in(path, std::ios::binary);
+    std::string fileBytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    std::remove(path);
+    if(fileBytes != buffer.str()) failures++;
+    
+    std::string bytes = buffer.str();
+    ResultReader reader(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+    if(!reader.validHeader()) failures++;
+    size_t offset = ResultWriter::HEADER_SIZE, row = 0;
+    ResultReader::Block block;
+    while(reader.next(offset, block)) {
+        for(size_t i = 0; i < block.rows && row < rows.size(); i++, row++) {
+            const Row& expected = rows[row];
+            std::vector<uint8_t> out(block.outBegin(i), block.outEnd(i));
+            bool same = block.pc[i] == expected.state.pc && block.zero[i] == expected.state.zero &&
+                        block.steps(i) == (uint32_t)expected.steps &&
+                        block.haltReason(i) == expected.reason && out == expected.out;
+            for(int r = 0; r < 4; r++) same = same && block.reg[r][i] == expected.state.reg[r];
+            if(!same) failures++;
+        }
+    }
+    if(row != rows.size() || offset != bytes.size()) failures++;
+    
+    // Truncated files stop at the last complete block
+    offset = ResultWriter::HEADER_SIZE;
+    ResultReader truncated(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size() - 1);
+    size_t blocks = 0;
+    while(truncated.next(offset, block)) blocks++;
+    if(blocks != (rows.size() + 96) / 97 - 1) failures++;
+    
+    std::cout << "results: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Loop-shaped random programs with large budgets, counted-loop engine
+// against the interpreter
+static int checkCountedLoops() {
+    std::mt19937 rng(8086);
+    CPU4Bit ref, fast;
+    ref.setTraceMode(TraceMode::Silent);
+    fast.setTraceMode(TraceMode::Silent);
+    fast.setEngine(Engine::CountedLoop);
+    int failures = 0;
+    
+    auto compare = [&](const std::vector<uint8_t>& program, const uint8_t* regs, int maxSteps) {
+        ref.reset();
+        fast.reset();
+        ref.loadProgram(program);
+        fast.loadProgram(program);
+        for(int r = 0; r < 4; r++) {
+            ref.setRegisterValue(r, regs[r]);
+            fast.setRegisterValue(r, regs[r]);
+        }
+        if(ref.run(maxSteps) != fast.run(maxSteps) || !ref.sameState(fast)) failures++;
+    };
+    
+    const uint8_t zeros[4] = {};
+    for(int maxSteps : { 1, 2, 3, 4, 5, 63, 64, 65, 1000, 99999, 100000 }) {
+        compare(program2, zeros, maxSteps);
+    }
+    
+    // A loop at head, from a menu of body instructions the engine can
+    // skip and some it cannot, then a jump back
+    static const uint8_t menu[] = {
+        0xB0, 0xB1, 0xB2, 0xB3, 0xC0, 0xC1, 0xC2, 0xC3, 0xD0, 0xD1, 0xD2, 0xD3,
+        0x00, 0x13, 0x24, 0x50, 0x60, 0x94, 0x9B, 0xE0, 0xE3, 0xE9, 0x3F, 0xA0
+    };
+    for(int trial = 0; trial < 20000; trial++) {
+        std::vector<uint8_t> program(16);
+        for(uint8_t& b : program) b = rng() & 0xFF;
+        const int head = rng() % 4;
+        const int end = head + 2 + rng() % 9;
+        for(int pc = head; pc < end; pc++) {
+            if(rng() % 5 == 0) {
+                // Exit forward or branch back to the head
+                program[pc] = 0x80 | (rng() % 2 ? head : (end + 1 + rng() % (15 - end)) & 0x0F);
+            } else {
+                program[pc] = menu[rng() % sizeof(menu)];
+            }
+        }
+        program[end] = (rng() % 4 ? 0x70 : 0x80) | head;
+        uint8_t regs[4];
+        for(uint8_t& r : regs) r = rng() % 8 == 0 ? rng() & 0xFF : rng() & 0x0F;
+        compare(program, regs, 1 + rng() % (trial % 10 == 0 ? 100000 : 2000));
+    }
+    
+    std::cout << "counted loops: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Store-free programs against the interpreter, including budgets too
+// large to step: those are checked against the program's own cycle
+static int checkJumpTable() {
+    std::mt19937 rng(1729);
+    CPU4Bit ref, fast;
+    ref.setTraceMode(TraceMode::Silent);
+    fast.setTraceMode(TraceMode::Silent);
+    fast.setEngine(Engine::JumpTable);
+    int failures = 0;
+    
+    // Random images with STA/STB (and optionally OUT) turned into other
+    // instructions and LDM sources kept to 4 bits
+    auto storeFreeProgram = [&](bool allowOut) {
+        std::vector<uint8_t> program(16);
+        for(uint8_t& b : program) {
+            b = rng() & 0xFF;
+            while((b >> 4) == 0x3 || (b >> 4) == 0x4 || (!allowOut && (b >> 4) == 0xB)) b = rng() & 0xFF;
+        }
+        for(uint8_t b : program) {
+            if((b >> 4) == 0xA) program[b & 0x0F] &= 0x0F;
+        }
+        for(uint8_t b : program) {
+            if((b >> 4) == 0xA && program[b & 0x0F] > 0x0F) return std::vector<uint8_t>();
+        }
+        return program;
+    };
+    auto prepare = [&](CPU4Bit& cpu, const std::vector<uint8_t>& program, const uint8_t* regs) {
+        cpu.reset();
+        cpu.loadProgram(program);
+        for(int r = 0; r < 4; r++) cpu.setRegisterValue(r, regs[r]);
+    };
+    
+    for(int trial = 0; trial < 3000; trial++) {
+        std::vector<uint8_t> program = storeFreeProgram(true);
+        if(program.empty()) continue;
+        uint8_t regs[4];
+        for(uint8_t& r : regs) r = rng() & 0x0F;
+        int maxSteps = 1 + rng() % (trial % 10 == 0 ? 100000 : 3000);
+        prepare(ref, program, regs);
+        prepare(fast, program, regs);
+        if(ref.run(maxSteps) != fast.run(maxSteps) || !ref.sameState(fast)) failures++;
+        
+        // Continue from where the run stopped, reusing the table
+        maxSteps = 1 + rng() % 500;
+        if(ref.run(maxSteps) != fast.run(maxSteps) || !ref.sameState(fast)) failures++;
+        
+        // New registers on the same image extend the table
+        for(uint8_t& r : regs) r = rng() & 0x0F;
+        prepare(ref, program, regs);
+        prepare(fast, program, regs);
+        if(ref.run(maxSteps) != fast.run(maxSteps) || !ref.sameState(fast)) failures++;
+    }
+    
+    // A budget of INT32_MAX steps: find where the run enters its cycle and
+    // step only the equivalent number of steps on the interpreter
+    int checked = 0;
+    while(checked < 200) {
+        std::vector<uint8_t> program = storeFreeProgram(false);
+        if(program.empty()) continue;
+        uint8_t regs[4];
+        for(uint8_t& r : regs) r = rng() & 0x0F;
+        prepare(ref, program, regs);
+        std::unordered_map<MachineState, int, MachineStateHash> seen;
+        int step = 0, equivalent = INT32_MAX;
+        while(ref.isRunning() && step < 1 << 22) {
+            auto found = seen.emplace(ref.snapshot(), step);
+            if(!found.second) {
+                int start = found.first->second, length = step - start;
+                equivalent = start + (int)((INT32_MAX - (long long)start) % length);
+                break;
+            }
+            ref.run(1);
+            step++;
+        }
+        if(ref.isRunning() && equivalent == INT32_MAX) continue;  // Too long to check
+        
+        prepare(ref, program, regs);
+        prepare(fast, program, regs);
+        int refSteps = ref.run(equivalent);
+        int fastSteps = fast.run(INT32_MAX);
+        bool halted = !ref.isRunning();
+        if((halted ? fastSteps != refSteps : fastSteps != INT32_MAX) || !ref.sameState(fast)) failures++;
+        checked++;
+    }
+    
+    // Over the memory limit the engine steps instead
+    fast.setJumpTableLimit(1 << 20);
+    for(int trial = 0; trial < 100; trial++) {
+        std::vector<uint8_t> program = storeFreeProgram(true);
+        if(program.empty()) continue;
+        const uint8_t regs[4] = { 1, 2, 3, 4 };
+        prepare(ref, program, regs);
+        prepare(fast, program, regs);
+        if(ref.run(5000) != fast.run(5000) || !ref.sameState(fast)) failures++;
+    }
+    
+    std::cout << "jump table: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Random jobs on several threads with small chunks, so that workers
+// steal, against one CPU4Bit run per job
+static int checkBatchRunner() {
+    std::mt19937 rng(6502);
+    int failures = 0;
+    const size_t count = 20000;
+    std::vector<uint8_t> images(count * 16);
+    for(uint8_t& b : images) b = rng() & 0xFF;
+    std::vector<BatchRunner::Job> jobs(count);
+    for(size_t i = 0; i < count; i++) jobs[i] = { &images[i * 16], 1 + (int)(rng() % 300) };
+    
+    CPU4Bit ref;
+    ref.setTraceMode(TraceMode::Silent);
+    
+    for(int variant = 0; variant < 3; variant++) {
+        BatchRunner runner;
+        runner.setThreads(variant == 0 ? 1 : 4);
+        runner.setChunk(variant == 2 ? 1 : 16);
+        runner.setEngine(variant == 1 ? Engine::JIT : Engine::Threaded);
+        runner.setCycleDetection(variant == 2);
+        ref.setCycleDetection(variant == 2);
+        std::vector<BatchRunner::Result> results(count);
+        BatchRunner::Report report = runner.run(jobs.data(), count, results.data());
+        
+        uint64_t steps = 0, programs = 0;
+        for(size_t i = 0; i < count; i++) {
+            ref.reset();
+            ref.loadProgram(jobs[i].image);
+            const BatchRunner::Result& r = results[i];
+            steps += r.steps;
+            if(ref.run(jobs[i].maxSteps) != r.steps || ref.snapshot() != r.state ||
+               haltReasonOf(ref) != r.reason || ref.output().size() != r.outCount ||
+               BatchRunner::hashOutput(ref.output().data(), ref.output().size()) != r.outHash) failures++;
+        }
+        for(uint64_t p : report.programsPerWorker) programs += p;
+        if(report.programs != count || programs != count || report.steps != steps) failures++;
+    }
+    
+    // A corpus applies inputs and per-image maxSteps
+    std::stringstream buffer;
+    CorpusWriter writer(buffer, ProgramCorpus::HAS_MAX_STEPS | ProgramCorpus::HAS_INPUTS, 1 << 15);
+    for(size_t i = 0; i < 1000; i++) {
+        uint8_t input = rng() & 0xFF;
+        writer.add(&images[i * 16], jobs[i].maxSteps, &input);
+    }
+    writer.finish();
+    std::string bytes = buffer.str();
+    ProgramCorpus corpus;
+    corpus.view(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+    std::vector<BatchRunner::Result> results(corpus.size());
+    BatchRunner runner;
+    runner.setThreads(3);
+    runner.setChunk(7);
+    runner.run(corpus, results.data());
+    ref.setCycleDetection(false);
+    for(size_t i = 0; i < corpus.size(); i++) {
+        ref.reset();
+        corpus.load(i, ref);
+        if(ref.run(corpus.maxSteps(i)) != results[i].steps || ref.snapshot() != results[i].state) failures++;
+    }
+    
+    std::cout << "batch runner: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Targets taken from random two-byte programs on random base images:
+// the search must find the same shortest length and step count as
+// brute force over every program of up to two bytes
+static int checkSuperoptimizer() {
+    std::mt19937 rng(2718);
+    int failures = 0;
+    const int maxSteps = 40;
+    
+    for(int trial = 0; trial < 12; trial++) {
+        MachineState base = MachineState();
+        base.running = 1;
+        for(uint8_t& r : base.reg) r = rng() & 0x0F;
+        for(int i = 2; i < 16; i++) base.ram[i] = rng() & 0xFF;
+        
+        // Run of a random program sets the target
+        CPU4Bit cpu;
+        cpu.setTraceMode(TraceMode::Silent);
+        auto runProgram = [&](const uint8_t* program, int length) {
+            cpu.reset();
+            cpu.restore(base);
+            for(int i = 0; i < length; i++) cpu.writeMemory(i, program[i]);
+            return cpu.run(maxSteps);
+        };
+        uint8_t seed[2] = { (uint8_t)(rng() & 0xFF), (uint8_t)(rng() & 0xFF) };
+        runProgram(seed, 2);
+        const bool mustHalt = !cpu.isRunning();
+        const std::vector<uint8_t> target = cpu.output();
+        const bool checkOut = trial % 3 != 2;
+        const uint8_t regMask = trial % 3 == 0 ? 0 : (rng() & 0x0F) | 1;
+        const MachineState wanted = cpu.snapshot();
+        
+        auto accepts = [&]() {
+            if(mustHalt && cpu.isRunning()) return false;
+            if(checkOut && cpu.output() != target) return false;
+            for(int r = 0; r < 4; r++) {
+                if((regMask & (1 << r)) && cpu.snapshot().reg[r] != wanted.reg[r]) return false;
+            }
+            return true;
+        };
+        
+        // Brute force over all programs of one and two bytes
+        int bestLength = 0, bestSteps = INT32_MAX;
+        for(int length = 1; length <= 2; length++) {
+            for(int code = 0; code < (1 << (8 * length)); code++) {
+                uint8_t program[2] = { (uint8_t)(code & 0xFF), (uint8_t)(code >> 8) };
+                int steps = runProgram(program, length);
+                if(!accepts()) continue;
+                if(bestLength == 0) bestLength = length;
+                bestSteps = std::min(bestSteps, steps);
+            }
+        }
+        
+        for(int variant = 0; variant < 3; variant++) {
+            Superoptimizer search;
+            search.setBase(base);
+            if(checkOut) search.setTargetOutput(target);
+            for(int r = 0; r < 4; r++) {
+                if(regMask & (1 << r)) search.setTargetRegister(r, wanted.reg[r]);
+            }
+            search.requireHalt(mustHalt);
+            search.setMaxSteps(maxSteps);
+            search.setMaxLength(2);
+            search.setThreads(variant + 1);
+            search.setCodeAsData(variant != 2);
+            search.setCost(variant == 1 ? Superoptimizer::Cost::Steps : Superoptimizer::Cost::Length);
+            Superoptimizer::Report report = search.run();
+            
+            // Every answer is a real solution
+            for(const Superoptimizer::Solution& s : report.solutions) {
+                int steps = runProgram(s.program.data(), s.program.size());
+                if(!accepts() || steps != s.steps) failures++;
+            }
+            if(variant == 0 && report.length != bestLength) failures++;
+            if(variant == 1 && (report.solutions.empty() || report.solutions[0].steps != bestSteps)) failures++;
+            // Without code read as data the space is smaller, never better
+            if(variant == 2 && report.length != 0 && report.length < bestLength) failures++;
+        }
+    }
+    
+    // Shortest way to print 5 and stop: LDA #5; OUT A; HLT (or via B)
+    Superoptimizer search;
+    search.setTargetOutput({ 5 });
+    search.setMaxLength(3);
+    Superoptimizer::Report report = search.run();
+    if(report.length != 3 || report.solutions.size() != 2 ||
+       report.solutions[0].program != std::vector<uint8_t>({ 0x15, 0xB0, 0xF0 })) failures++;
+    
+    std::cout << "superoptimizer: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Fuzz every engine against the reference semantics; the guided search
+// must reach each (PC, opcode, JZ taken / ALU sub-op) location
+static int checkFuzzer() {
+    int failures = 0;
+    const Engine engines[] = {
+        Engine::Interpreter, Engine::Predecoded, Engine::Threaded, Engine::BlockCache,
+        Engine::JIT, Engine::CountedLoop, Engine::JumpTable
+    };
+    for(Engine engine : engines) {
+        std::unique_ptr<Fuzzer> fuzzer(new Fuzzer());
+        fuzzer->setEngine(engine);
+        fuzzer->setSeed(1 + (int)engine);
+        fuzzer->setMaxSteps(engine == Engine::Threaded ? 64 : 300);
+        Fuzzer::Report report = fuzzer->run(engine == Engine::Threaded ? 100000 : 20000);
+        failures += report.mismatches;
+        if(report.corpus < 2 || report.edges == 0) failures++;
+        if(engine != Engine::Threaded) continue;
+        
+        // 16 PCs x (14 plain opcodes + JZ taken/not + 16 ALU sub-ops)
+        if(report.locations != 16 * 32) failures++;
+        for(int pc = 0; pc < 16; pc++) {
+            for(int sub = 0; sub < 16; sub++) failures += !fuzzer->covered(pc, 0xE0 | sub);
+            failures += !fuzzer->covered(pc, 0x80, true) + !fuzzer->covered(pc, 0x80, false);
+        }
+    }
+    
+    // Counters go to the caller's map, e.g. libFuzzer's: ALU 9; HLT is three edges
+    std::vector<uint8_t> counters(Fuzzer::MAP_SIZE);
+    std::unique_ptr<Fuzzer> fuzzer(new Fuzzer(counters.data()));
+    const uint8_t program[] = { 0xE9, 0xF0 };
+    if(!fuzzer->execute(program, sizeof(program))) failures++;
+    if(std::count(counters.begin(), counters.end(), 1) != 3) failures++;
+    if(!fuzzer->covered(0, 0xE9) || !fuzzer->covered(1, 0xF0) || fuzzer->covered(0, 0xE8) ||
+       fuzzer->locationCount() != 2) failures++;
+    
+    // Same seed, same corpus
+    Fuzzer a, b;
+    a.setSeed(99);
+    b.setSeed(99);
+    a.run(5000);
+    b.run(5000);
+    if(a.inputs() != b.inputs()) failures++;
+    
+    std::cout << "fuzzer: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Every engine against the reference, at halt and in lockstep: no
+// divergences, and the same counts for any thread count
+static int checkDifferential() {
+    int failures = 0;
+    
+    uint64_t lockstepComparisons[2] = {};
+    for(int variant = 0; variant < 2; variant++) {
+        DifferentialRunner runner;
+        runner.setThreads(variant == 0 ? 1 : 3);
+        runner.setChunk(variant == 0 ? 256 : 5);
+        DifferentialRunner::Report report = runner.runRandom(4000, 17, 300);
+        if(report.programs != 4000 || report.comparisons != 4000 * ENGINE_COUNT ||
+           report.divergences != 0 || !report.first.empty()) failures++;
+        
+        runner.setMode(DifferentialRunner::Mode::Lockstep);
+        report = runner.runRandom(500, 23, 100);
+        if(report.programs != 500 || report.divergences != 0) failures++;
+        lockstepComparisons[variant] = report.comparisons;
+    }
+    if(lockstepComparisons[0] != lockstepComparisons[1]) failures++;
+    
+    // Lockstep compares every reference step of every engine
+    std::mt19937 rng(4004);
+    const size_t count = 300;
+    std::vector<uint8_t> images(count * 16);
+    for(uint8_t& b : images) b = rng() & 0xFF;
+    std::vector<BatchRunner::Job> jobs(count);
+    uint64_t steps = 0;
+    for(size_t i = 0; i < count; i++) {
+        jobs[i] = { &images[i * 16], 1 + (int)(rng() % 200) };
+        MachineState s = MachineState();
+        s.running = 1;
+        std::memcpy(s.ram, jobs[i].image, 16);
+        std::vector<uint8_t> out;
+        steps += CPU4Bit::runState(s, jobs[i].maxSteps, out);
+    }
+    DifferentialRunner runner;
+    runner.setThreads(2);
+    runner.setMode(DifferentialRunner::Mode::Lockstep);
+    runner.setEngines({ Engine::Threaded, Engine::JIT });
+    DifferentialRunner::Report report = runner.run(jobs.data(), count);
+    if(report.comparisons != steps * 2 || report.divergences != 0) failures++;
+    
+    std::cout << "differential: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Multi-core runs against single-core references: one core on shared RAM,
+// cores on private RAM, a whole-program quantum (cores one after another),
+// a racy counter under each schedule and message passing between threads
+static int checkMultiCore() {
+    std::mt19937 rng(8008);
+    int failures = 0;
+    const MultiCoreSystem::Schedule schedules[] = {
+        MultiCoreSystem::Schedule::RoundRobin, MultiCoreSystem::Schedule::Seeded,
+        MultiCoreSystem::Schedule::Relaxed
+    };
+    CPU4Bit ref;
+    ref.setTraceMode(TraceMode::Silent);
+    
+    for(int trial = 0; trial < 300; trial++) {
+        uint8_t image[16];
+        for(uint8_t& b : image) b = rng() & 0xFF;
+        const int maxSteps = 1 + rng() % 200;
+        ref.reset();
+        ref.loadProgram(image);
+        const int refSteps = ref.run(maxSteps);
+        
+        for(MultiCoreSystem::Schedule schedule : schedules) {
+            // One core, everything shared: the reference
+            MultiCoreSystem single(1);
+            single.setSchedule(schedule, trial);
+            single.loadProgram(image);
+            if(single.run(maxSteps) != (uint64_t)refSteps || single.view(0) != ref.snapshot() ||
+               single.output(0) != ref.output()) failures++;
+            
+            // Private RAM: each core is an independent reference run
+            MultiCoreSystem cores(3);
+            cores.setSchedule(schedule, trial);
+            cores.setSharedMask(0);
+            cores.loadProgram(image);
+            cores.core(1).reg[3] = 5;
+            if(cores.run(maxSteps) == 0) failures++;
+            for(size_t i = 0; i < cores.cores(); i++) {
+                ref.reset();
+                ref.loadProgram(image);
+                if(i == 1) ref.setRegisterValue(3, 5);
+                ref.run(maxSteps);
+                if(cores.view(i) != ref.snapshot() || cores.output(i) != ref.output()) failures++;
+            }
+        }
+        
+        // A quantum as long as the budget runs the cores one after another
+        MultiCoreSystem sequential(2);
+        sequential.setQuantum(maxSteps);
+        sequential.loadProgram(image);
+        sequential.run(maxSteps);
+        ref.reset();
+        ref.loadProgram(image);
+        ref.run(maxSteps);
+        // Core 0's registers and flags; the RAM is core 1's to change next
+        MachineState first = sequential.view(0);
+        std::memcpy(first.ram, ref.snapshot().ram, 16);
+        if(first != ref.snapshot() || sequential.output(0) != ref.output()) failures++;
+        MachineState second = ref.snapshot();
+        std::memset(second.reg, 0, 4);
+        second.pc = second.zero = 0;
+        second.running = 1;
+        ref.reset();
+        ref.restore(second);
+        ref.run(maxSteps);
+        if(sequential.view(1) != ref.snapshot() || sequential.output(1) != ref.output()) failures++;
+    }
+    
+    // Two cores increment RAM[15]: LDM 15; INC A; STA 15; HLT
+    const uint8_t counter[] = { 0xAF, 0xC0, 0x3F, 0xF0 };
+    for(int quantum = 1; quantum <= 4; quantum += 3) {
+        MultiCoreSystem system(2);
+        system.setQuantum(quantum);
+        system.loadProgram(counter, sizeof(counter));
+        system.run(100);
+        if(system.readShared(15) != (quantum == 1 ? 1 : 2)) failures++;  // Lost update when interleaved
+    }
+    int outcomes[3] = {};
+    for(uint64_t seed = 1; seed <= 64; seed++) {
+        MultiCoreSystem system(2);
+        system.setSchedule(MultiCoreSystem::Schedule::Seeded, seed);
+        system.loadProgram(counter, sizeof(counter));
+        system.run(100);
+        outcomes[system.readShared(15)]++;
+        MultiCoreSystem again(2);  // Same seed, same interleaving
+        again.setSchedule(MultiCoreSystem::Schedule::Seeded, seed);
+        again.loadProgram(counter, sizeof(counter));
+        again.run(100);
+        if(again.readShared(15) != system.readShared(15) || again.steps(0) != system.steps(0)) failures++;
+    }
+    if(outcomes[0] != 0 || outcomes[1] == 0 || outcomes[2] == 0) failures++;
+    
+    // Message passing on host threads. Core 0 (PC 0): A=7 -> RAM[14], then
+    // flag RAM[15]=1. Core 1 (PC 5): wait for the flag, OUT RAM[14].
+    const uint8_t message[] = {
+        0x17, 0x3E, 0x11, 0x3F, 0xF0,        // LDA 7; STA 14; LDA 1; STA 15; HLT
+        0xAF, 0x20, 0x50, 0x85,              // LDM 15; LDB 0; ADD; JZ 5
+        0xAE, 0xB0, 0xF0                     // LDM 14; OUT A; HLT
+    };
+    for(int trial = 0; trial < 20; trial++) {
+        MultiCoreSystem system(2);
+        system.setSchedule(MultiCoreSystem::Schedule::Relaxed);
+        system.loadProgram(message, sizeof(message));
+        system.core(1).pc = 5;
+        system.run(INT32_MAX);
+        if(system.isRunning() || system.output(1) != std::vector<uint8_t>({ 7 })) failures++;
+    }
+    
+    std::cout << "multi-core: " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Compare cycle detection with a brute-force search over visited states
+static int checkCycleDetection() {
+    std::mt19937 rng(777);
+    CPU4Bit detector, plain;
+    detector.setTraceMode(TraceMode::Silent);
+    detector.setCycleDetection(true);
+    plain.setTraceMode(TraceMode::Silent);
+    
+    int failures = 0, loops = 0;
+    for(int trial = 0; trial < 2000; trial++) {
+        uint8_t image[16], regs[4] = {0, 0, 0, 0};
+        for(int i = 0; i < 16; i++) image[i] = rng() & 0xFF;
+        const int maxSteps = 400;
+        prepareCPU(detector, image, regs, 0, false);
+        prepareCPU(plain, image, regs, 0, false);
+        
+        std::vector<MachineState> seen(1, observeState(plain));
+        int expectedStart = -1, expectedLength = 0;
+        for(int step = 1; step <= maxSteps && plain.isRunning(); step++) {
+            plain.run(1);
+            MachineState s = observeState(plain);
+            auto it = std::find(seen.begin(), seen.end(), s);
+            if(it != seen.end()) {
+                expectedStart = (int)(it - seen.begin());
+                expectedLength = (int)seen.size() - expectedStart;
+                break;
+            }
+            seen.push_back(s);
+        }
+        
+        detector.run(maxSteps);
+        const CycleInfo& c = detector.lastCycle();
+        bool expected = expectedStart >= 0;
+        // Brent saves the state after steps 1, 3, 7, ...; it detects the loop
+        // lambda steps after the first save that is inside the cycle and
+        // starts a window of at least lambda steps
+        int detectAt = 1;
+        while(detectAt < expectedStart || detectAt + 1 < expectedLength) detectAt = 2 * detectAt + 1;
+        bool ok = c.detected ? (expected && c.start == expectedStart && c.length == expectedLength)
+                             : (!expected || detectAt + expectedLength > maxSteps);
+        if(!ok) {
+            if(failures == 0) {
+                std::cout << "cycle detection: trial " << trial << " expected " << expectedStart
+                          << "/" << expectedLength << " got " << c.start << "/" << c.length << std::endl;
+            }
+            failures++;
+        }
+        loops += c.detected;
+    }
+    
+    std::cout << "cycle detection: " << (failures ? "FAILED" : "ok") << " (" << loops 
+              << " loops found, " << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+// Cached runs must match uncached ones, and repeats must hit
+static int checkResultCache() {
+    std::mt19937 rng(4242);
+    ResultCache cache(1000, ResultCache::Eviction::LRU);
+    CPU4Bit cached, plain;
+    cached.setTraceMode(TraceMode::Silent);
+    plain.setTraceMode(TraceMode::Silent);
+    cached.setEngine(Engine::Predecoded);
+    cached.setResultCache(&cache);
+    
+    std::vector<std::vector<uint8_t>> programs(500, std::vector<uint8_t>(16));
+    for(auto& program : programs) {
+        for(uint8_t& b : program) b = rng() & 0xFF;
+    }
+    
+    int failures = 0;
+    for(int pass = 0; pass < 2; pass++) {
+        for(const auto& program : programs) {
+            cached.reset();
+            cached.loadProgram(program);
+            plain.reset();
+            plain.loadProgram(program);
+            if(cached.run(200) != plain.run(200) || !cached.sameState(plain)) failures++;
+        }
+    }
+    if(cache.getHits() != programs.size() || cache.getMisses() != programs.size()) failures++;
+    
+    // A CPU that was modified after reset() must not use the cache
+    cached.reset();
+    cached.loadProgram(programs[0]);
+    cached.setRegisterValue(1, 7);
+    uint64_t hits = cache.getHits();
+    cached.run(200);
+    if(cache.getHits() != hits) failures++;
+    
+    // Eviction order
+    ResultCache small(2, ResultCache::Eviction::LRU);
+    ResultCache::Key k[3] = {};
+    for(int i = 0; i < 3; i++) k[i].image[0] = i;
+    ResultCache::Result r = {};
+    small.insert(k[0], r);
+    small.insert(k[1], r);
+    small.find(k[0]);           // k[1] is now least recently used
+    small.insert(k[2], r);
+    if(!small.find(k[0]) || small.find(k[1]) || small.getEvictions() != 1) failures++;
+    
+    std::cout << "result cache: " << (failures ? "FAILED" : "ok") 
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+#if defined(__GNUC__)
+// Every batch lane must match a CPU4Bit run from the same state
+static int checkBatch() {
+    std::mt19937 rng(99);
+    int failures = 0;
+    
+    for(int variant = 0; variant < 2; variant++) {
+        // Variant 0: one program over all inputs x, y; variant 1: unrelated random states
+        const size_t lanes = (variant == 0) ? 256 : 300;
+        BatchCPU4Bit batch(lanes);
+        std::vector<CPU4Bit> refs(lanes);
+        batch.loadProgram(inputLoopProgram);
+        
+        for(size_t lane = 0; lane < lanes; lane++) {
+            CPU4Bit& ref = refs[lane];
+            ref.setTraceMode(TraceMode::Silent);
+            uint8_t image[16] = {}, regs[4] = {};
+            uint8_t pc = 0;
+            bool zero = false;
+            if(variant == 0) {
+                std::copy(inputLoopProgram.begin(), inputLoopProgram.end(), image);
+                image[14] = lane >> 4;
+                image[15] = lane & 0x0F;
+            } else {
+                for(uint8_t& b : image) b = rng() & 0xFF;
+                for(uint8_t& r : regs) r = rng() & 0x0F;
+                pc = rng() & 0x0F;
+                zero = rng() & 1;
+            }
+            prepareCPU(ref, image, regs, pc, zero);
+            for(int i = 0; i < 16; i++) batch.writeMemory(lane, i, image[i]);
+            for(int r = 0; r < 4; r++) batch.setRegisterValue(lane, r, regs[r]);
+            batch.setPC(lane, pc);
+            batch.setZeroFlag(lane, zero);
+        }
+        
+        // Two runs, to check that step counts carry over
+        std::vector<int> refSteps(lanes, 0);
+        for(int maxSteps : {120, 80}) {
+            batch.run(maxSteps);
+            for(size_t lane = 0; lane < lanes; lane++) refSteps[lane] += refs[lane].run(maxSteps);
+        }
+        
+        for(size_t lane = 0; lane < lanes; lane++) {
+            if(observeState(refs[lane]) != batch.state(lane) || 
+               refs[lane].output() != batch.output(lane) || refSteps[lane] != batch.steps(lane)) {
+                if(failures == 0) std::cout << "batch: lane " << lane << " differs" << std::endl;
+                failures++;
+            }
+        }
+    }
+    
+    std::cout << "batch: " << (failures ? "FAILED" : "ok") 
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+#endif
+
+// Bit-sliced engine against step(): every encoding from random states, then a
+// full input sweep of one program through run()
+template<typename Engine4>
+static int checkBitSliced(const char* name) {
+    std::mt19937 rng(4242);
+    int failures = 0;
+    
+    {
+        const size_t lanes = 256 * 8;
+        Engine4 sliced(lanes);
+        std::vector<CPU4Bit> refs(lanes);
+        for(size_t lane = 0; lane < lanes; lane++) {
+            uint8_t image[16], regs[4];
+            for(uint8_t& b : image) b = rng() & 0xFF;
+            for(uint8_t& r : regs) r = rng() & 0xFF;
+            uint8_t pc = rng() & 0x0F;
+            bool zero = rng() & 1;
+            image[pc] = lane & 0xFF;  // first step covers every encoding
+            prepareCPU(refs[lane], image, regs, pc, zero);
+            refs[lane].setTraceMode(TraceMode::Silent);
+            for(int i = 0; i < 16; i++) sliced.writeMemory(lane, i, image[i]);
+            for(int r = 0; r < 4; r++) sliced.setRegisterValue(lane, r, regs[r]);
+            sliced.setPC(lane, pc);
+            sliced.setZeroFlag(lane, zero);
+        }
+        
+        for(int step = 0; step < 48; step++) {
+            sliced.step();
+            for(size_t lane = 0; lane < lanes; lane++) {
+                CPU4Bit& ref = refs[lane];
+                ref.step();
+                if(observeState(ref) != sliced.state(lane) || ref.output() != sliced.output(lane)) {
+                    if(failures == 0) {
+                        std::cout << name << ": lane " << lane << " differs at step " << step + 1 << std::endl;
+                    }
+                    failures++;
+                }
+            }
+        }
+    }
+    
+    {
+        // Every x, y input of one program
+        const size_t lanes = 256;
+        Engine4 sliced(lanes);
+        sliced.loadProgram(inputLoopProgram);
+        std::vector<int> refSteps(lanes, 0);
+        std::vector<CPU4Bit> refs(lanes);
+        for(size_t lane = 0; lane < lanes; lane++) {
+            sliced.writeMemory(lane, 14, lane >> 4);
+            sliced.writeMemory(lane, 15, lane & 0x0F);
+            refs[lane].setTraceMode(TraceMode::Silent);
+            refs[lane].loadProgram(inputLoopProgram);
+            refs[lane].writeMemory(14, lane >> 4);
+            refs[lane].writeMemory(15, lane & 0x0F);
+        }
+        for(int maxSteps : {120, 80}) {
+            sliced.run(maxSteps);
+            for(size_t lane = 0; lane < lanes; lane++) refSteps[lane] += refs[lane].run(maxSteps);
+        }
+        for(size_t lane = 0; lane < lanes; lane++) {
+            if(observeState(refs[lane]) != sliced.state(lane) ||
+               refs[lane].output() != sliced.output(lane) || refSteps[lane] != sliced.steps(lane)) {
+                if(failures == 0) std::cout << name << ": input lane " << lane << " differs" << std::endl;
+                failures++;
+            }
+        }
+    }
+    
+    std::cout << name << ": " << (failures ? "FAILED" : "ok")
+              << " (" << failures << " mismatches)" << std::endl;
+    return failures;
+}
+
+static int selfTest() {
+    int failures = 0;
+    failures += checkEngine(Engine::Predecoded, "predecoded");
+    failures += checkEngine(Engine::Threaded, "threaded");
+    failures += checkEngine(Engine::BlockCache, "blockcache");
+    failures += checkEngine(Engine::JIT, "jit");
+    failures += checkEngine(Engine::CountedLoop, "countedloop");
+    failures += checkCountedLoops();
+    failures += checkEngine(Engine::JumpTable, "jumptable");
+    failures += checkJumpTable();
+    failures += checkCycleDetection();
+    failures += checkResultCache();
+    failures += checkSnapshots();
+    failures += checkTimeTravel();
+    failures += checkRecordReplay();
+    failures += checkModelChecker();
+    failures += checkPool();
+    failures += checkBatchRunner();
+    failures += checkSuperoptimizer();
+    failures += checkFuzzer();
+    failures += checkDifferential();
+    failures += checkMultiCore();
+    failures += checkCorpus();
+    failures += checkResults();
+#if defined(__GNUC__)
+    failures += checkBatch();
+#endif
+    failures += checkBitSliced<BitSliced64>("bitsliced x64");
+#if defined(__GNUC__)
+    failures += checkBitSliced<BitSlicedWide>("bitsliced wide");
+#endif
+    return failures ? 1 : 0;
+}
+
+// Measure instructions/sec for one engine on one program
+static double benchmarkProgram(Engine engine, const std::vector<uint8_t>& program, int maxSteps) {
+    CPU4Bit cpu;
+    cpu.setTraceMode(TraceMode::Silent);
+    cpu.setEngine(engine);
+    
+    auto start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    long long steps = 0;
+    do {
+        for(int i = 0; i < 1000; i++) {
+            cpu.reset();
+            cpu.loadProgram(program);
+            steps += cpu.run(maxSteps);
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while(seconds < 0.2);
+    return steps / seconds;
+}
+
+static void benchmark() {
+    // Tight loop with no OUT or stores
+    static const std::vector<uint8_t> tightLoop = {
+        0xC2,  // 0: INC C
+        0xD1,  // 1: DEC B
+        0x50,  // 2: ADD      - A = A + B
+        0x98,  // 3: MOV C->A
+        0x82,  // 4: JZ 2
+        0x70   // 5: JMP 0
+    };
+    struct Case { const char* name; const std::vector<uint8_t>* program; int maxSteps; };
+    const Case cases[] = {
+        { "tight loop", &tightLoop, 100000 },
+        { "Ex2 countdown", &program2, 100000 },
+        { "Ex4 bitwise", &program4, 100 },
+        { "Ex5 NOT", &program5, 100 },
+        { "Ex6 shift", &program6, 100 },
+        { "Ex7 rotate", &program7, 100 },
+        { "Ex8 masking", &program8, 100 }
+    };
+    const std::pair<Engine, const char*> engines[] = {
+        { Engine::Interpreter, "interpreter" },
+        { Engine::Predecoded, "predecoded" },
+        { Engine::Threaded, "threaded" },
+        { Engine::BlockCache, "blockcache" },
+        { Engine::JIT, "jit" },
+        { Engine::CountedLoop, "countedloop" },
+        { Engine::JumpTable, "jumptable" }
+    };
+    
+    std::cout << "Million instructions/sec" << std::endl;
+    std::cout << std::left << std::setw(16) << "program";
+    for(const auto& e : engines) std::cout << std::setw(14) << e.second;
+    std::cout << std::endl;
+    for(const Case& c : cases) {
+        std::cout << std::setw(16) << c.name;
+        for(const auto& e : engines) {
+            std::cout << std::setw(14) << std::fixed << std::setprecision(1)
+                      << benchmarkProgram(e.first, *c.program, c.maxSteps) / 1e6;
+        }
+        std::cout << std::endl;
+    }
+    
+    // Repeated reset()+loadProgram()+run() of one program, with and without the result cache
+    ResultCache cache;
+    for(int cached = 0; cached < 4; cached++) {
+        const bool longRun = cached >= 2;
+        CPU4Bit cpu;
+        cpu.setTraceMode(TraceMode::Silent);
+        cpu.setEngine(Engine::Threaded);
+        if(cached & 1) cpu.setResultCache(&cache);
+        
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0;
+        long long runs = 0;
+        do {
+            for(int i = 0; i < 1000; i++) {
+                cpu.reset();
+                cpu.loadProgram(longRun ? program2 : program4);
+                cpu.run(longRun ? 1000 : 100);
+            }
+            runs += 1000;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while(seconds < 0.2);
+        static const char* const names[4] = {
+            "Ex4", "Ex4 cached", "Ex2 x1000", "Ex2 x1000 cached"
+        };
+        std::cout << std::setw(18) << names[cached] << std::fixed << std::setprecision(2) 
+                  << runs / seconds / 1e6 << " million runs/sec" << std::endl;
+    }
+    
+    // Every reachable state of the input loop for x, y < 64
+    {
+        MachineState base = MachineState();
+        base.running = 1;
+        std::copy(inputLoopProgram.begin(), inputLoopProgram.end(), base.ram);
+        ModelChecker checker(1 << 19);
+        checker.addInputSweep(base, (1 << 14) | (1 << 15), 64);
+        checker.requireHalt(true);
+        ModelChecker::Report report = checker.run();
+        std::cout << std::setw(18) << "Model check" << std::fixed << std::setprecision(2)
+                  << report.statesPerSecond / 1e6 << " million states/sec (" << report.states
+                  << " states, " << report.expandedPerWorker.size() << " threads)" << std::endl;
+    }
+    
+    // A million CPUs: individually allocated objects vs pool handles and page resets
+    {
+        const size_t count = 1000000;
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::unique_ptr<CPU4Bit>> cpus;
+            cpus.reserve(count);
+            for(size_t i = 0; i < count; i++) cpus.emplace_back(new CPU4Bit());
+            for(auto& cpu : cpus) cpu->reset();
+        }
+        double objectSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        {
+            CPUPool pool;
+            for(size_t i = 0; i < count; i++) pool.allocate();
+            pool.resetAll();
+        }
+        double poolSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::setw(18) << "CPU objects x1M" << std::fixed << std::setprecision(1)
+                  << objectSeconds * 1000 << " ms (" << sizeof(CPU4Bit) << "+ bytes each)" << std::endl;
+        std::cout << std::setw(18) << "CPUPool x1M" << std::fixed << std::setprecision(1)
+                  << poolSeconds * 1000 << " ms (" << sizeof(MachineState) << " bytes each)" << std::endl;
+    }
+    
+    // One million checkpoints into an arena, then restore each one and step it
+    {
+        const size_t count = 1000000;
+        SnapshotArena arena(count);
+        CPU4Bit cpu;
+        cpu.setTraceMode(TraceMode::Silent);
+        cpu.loadProgram(tightLoop);
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < count; i++) {
+            arena.push(cpu.snapshot());
+            cpu.step();
+        }
+        double pushSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < count; i++) {
+            cpu.restore(arena[i]);
+            cpu.step();
+        }
+        double restoreSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::setw(18) << "Snapshot x1M" << std::fixed << std::setprecision(2)
+                  << count / pushSeconds / 1e6 << " million snapshot+step/sec, "
+                  << count / restoreSeconds / 1e6 << " million restore+step/sec" << std::endl;
+    }
+    
+    // A million random programs on every core
+    {
+        const size_t count = 1000000;
+        std::mt19937 rng(99);
+        std::vector<uint8_t> images(count * 16);
+        for(uint8_t& b : images) b = rng() & 0xFF;
+        std::vector<BatchRunner::Job> jobs(count);
+        for(size_t i = 0; i < count; i++) jobs[i] = { &images[i * 16], 100 };
+        std::vector<BatchRunner::Result> results(count);
+        BatchRunner runner;
+        BatchRunner::Report report = runner.run(jobs.data(), count, results.data());
+        std::cout << std::setw(18) << "Batch runner x1M" << std::fixed << std::setprecision(2)
+                  << report.programsPerSecond / 1e6 << " million programs/sec ("
+                  << report.programsPerWorker.size() << " threads, per thread:";
+        for(size_t w = 0; w < report.programsPerWorker.size(); w++) {
+            std::cout << " " << std::setprecision(2) << report.programsPerWorker[w] / report.secondsPerWorker[w] / 1e6;
+        }
+        std::cout << ")" << std::endl;
+    }
+    
+    // Four cores on the tight loop (no stores) in shared RAM, per schedule
+    {
+        const MultiCoreSystem::Schedule schedules[] = {
+            MultiCoreSystem::Schedule::RoundRobin, MultiCoreSystem::Schedule::Seeded,
+            MultiCoreSystem::Schedule::Relaxed
+        };
+        const char* const names[] = { "round-robin", "seeded", "relaxed" };
+        std::cout << std::setw(18) << "Multi-core x4";
+        for(int k = 0; k < 3; k++) {
+            MultiCoreSystem system(4);
+            system.setSchedule(schedules[k]);
+            system.loadProgram(tightLoop);
+            auto start = std::chrono::steady_clock::now();
+            uint64_t steps = system.run(2000000);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << (k ? ", " : "") << names[k] << " " << std::fixed << std::setprecision(1)
+                      << steps / seconds / 1e6;
+        }
+        std::cout << " million instructions/sec" << std::endl;
+    }
+    
+#ifdef CPU4BIT_HAS_WRITEV
+    // Columnar result rows for a million runs, discarded by /dev/null
+    {
+        const size_t count = 1000000;
+        CPU4Bit cpu;
+        cpu.setTraceMode(TraceMode::Silent);
+        cpu.loadProgram(program2);
+        int steps = cpu.run(20);
+        auto start = std::chrono::steady_clock::now();
+        {
+            ResultWriter results(std::string("/dev/null"));
+            for(size_t i = 0; i < count; i++) results.add(cpu, steps);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::setw(18) << "Result rows x1M" << std::fixed << std::setprecision(1)
+                  << count / seconds / 1e6 << " million rows/sec (" << cpu.output().size()
+                  << " OUT values each)" << std::endl;
+    }
+#endif
+    
+#if defined(__GNUC__)
+    // One data-dependent program over 4096 input pairs: a loop of CPUs vs lockstep lanes
+    const size_t lanes = 4096;
+    BatchCPU4Bit batch(lanes);
+    BitSlicedWide sliced(lanes);
+    const char* labels[] = {"CPU loop x4096", "Batch x4096", "Bit-sliced x4096"};
+    for(int variant = 0; variant < 3; variant++) {
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0;
+        long long steps = 0;
+        CPU4Bit cpu;
+        cpu.setTraceMode(TraceMode::Silent);
+        cpu.setEngine(Engine::Threaded);
+        do {
+            if(variant == 0) {
+                for(size_t lane = 0; lane < lanes; lane++) {
+                    cpu.reset();
+                    cpu.loadProgram(inputLoopProgram);
+                    cpu.writeMemory(14, lane & 0x0F);
+                    cpu.writeMemory(15, (lane >> 4) & 0x0F);
+                    steps += cpu.run(100);
+                }
+            } else if(variant == 1) {
+                batch.reset();
+                batch.loadProgram(inputLoopProgram);
+                for(size_t lane = 0; lane < lanes; lane++) {
+                    batch.writeMemory(lane, 14, lane & 0x0F);
+                    batch.writeMemory(lane, 15, (lane >> 4) & 0x0F);
+                }
+                batch.run(100);
+                for(size_t lane = 0; lane < lanes; lane++) steps += batch.steps(lane);
+            } else {
+                sliced.reset();
+                sliced.loadProgram(inputLoopProgram);
+                for(size_t lane = 0; lane < lanes; lane++) {
+                    sliced.writeMemory(lane, 14, lane & 0x0F);
+                    sliced.writeMemory(lane, 15, (lane >> 4) & 0x0F);
+                }
+                sliced.run(100);
+                for(size_t lane = 0; lane < lanes; lane++) steps += sliced.steps(lane);
+            }
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while(seconds < 0.2);
+        std::cout << std::setw(18) << labels[variant]
+                  << std::fixed << std::setprecision(1) << steps / seconds / 1e6 << " million instructions/sec";
+        if(variant == 1) std::cout << " (" << BatchCPU4Bit::CHUNK_LANES << " lanes per vector)";
+        if(variant == 2) std::cout << " (" << BitSlicedWide::WORD_LANES << " lanes per word)";
+        std::cout << std::endl;
+    }
+#endif
+    std::cout << std::right << std::defaultfloat;
+}
+
+static bool parseEngine(const std::string& name, Engine& engine) {
+    if(name == "interpreter") engine = Engine::Interpreter;
+    else if(name == "predecoded") engine = Engine::Predecoded;
+    else if(name == "threaded") engine = Engine::Threaded;
+    else if(name == "blockcache") engine = Engine::BlockCache;
+    else if(name == "jit") engine = Engine::JIT;
+    else if(name == "countedloop") engine = Engine::CountedLoop;
+    else if(name == "jumptable") engine = Engine::JumpTable;
+    else return false;
+    return true;
+}
+
+static const char* engineName(Engine engine) {
+    static const char* const names[] = {
+        "interpreter", "predecoded", "threaded", "blockcache", "jit", "countedloop", "jumptable"
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == ENGINE_COUNT, "one name per engine");
+    return names[(int)engine];
+}
+
+// Load a program, run it and print the results
+static void runExample(CPU4Bit& cpu, const std::vector<uint8_t>& program, int maxSteps = 100) {
+    cpu.loadProgram(program);
+    cpu.run(maxSteps);
+    
+    if(cpu.getTraceMode() == TraceMode::Buffered) {
+        std::cout << cpu.traceText();
+        cpu.clearTrace();
+    } else if(cpu.getTraceMode() == TraceMode::Silent) {
+        std::cout << "Output:";
+        for(uint8_t value : cpu.output()) {
+            std::cout << " " << (int)value;
+        }
+        std::cout << std::endl;
+        if(cpu.lastCycle().detected) {
+            std::cout << "Infinite loop detected: cycle starts at step " << cpu.lastCycle().start
+                      << ", length " << cpu.lastCycle().length << std::endl;
+        }
+    }
+    cpu.printState();
+}
+
+// Verify a recorded log with cpu's engine
+static int replayFile(CPU4Bit& cpu, const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if(!in && !in.eof()) {
+        std::cerr << "Cannot read " << path << std::endl;
+        return 1;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    ReplayReport report = cpu.replay(ExecutionLog(bytes.data(), bytes.size()));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    if(report.malformed) {
+        std::cout << "Replay: " << path << " is not a valid log" << std::endl;
+    } else if(!report.ok) {
+        std::cout << "Replay: run " << report.mismatchRun << " differs from the recording" << std::endl;
+    } else {
+        std::cout << "Replay: ok, " << report.runs << " runs, " << report.steps << " steps in "
+                  << std::fixed << std::setprecision(3) << seconds * 1000 << " ms" << std::endl;
+        if(report.predecodedRuns > 0) {
+            std::cout << "Replay: " << report.predecodedRuns
+                      << " runs used cycle detection and were checked on the predecoded engine" << std::endl;
+        }
+    }
+    return report.ok ? 0 : 1;
+}
+
+// Run every image of a corpus with cpu's engine and summarize, writing
+// one result row per image if resultsPath is set. threads >= 0 runs it on
+// a BatchRunner (0: one thread per core) and reports each worker.
+static int runCorpus(CPU4Bit& cpu, const std::string& path, const std::string& resultsPath, int threads) {
+    ProgramCorpus corpus;
+    std::string error;
+    if(!corpus.open(path, &error)) {
+        std::cerr << "Corpus: " << error << std::endl;
+        return 1;
+    }
+    
+    if(threads >= 0) {
+        BatchRunner runner;
+        runner.setThreads(threads);
+        runner.setEngine(cpu.getEngine());
+        runner.setCycleDetection(cpu.getCycleDetection());
+        std::vector<BatchRunner::Result> results(corpus.size());
+        BatchRunner::Report report = runner.run(corpus, results.data());
+        uint64_t halted = 0, outputs = 0;
+        for(const BatchRunner::Result& r : results) {
+            halted += r.reason == HaltReason::Halted;
+            outputs += r.outCount;
+        }
+        std::cout << "Corpus: " << corpus.size() << " programs, " << halted << " halted, "
+                  << report.steps << " steps, " << outputs << " OUT values in "
+                  << std::fixed << std::setprecision(3) << report.seconds * 1000 << " ms ("
+                  << std::setprecision(2) << report.programsPerSecond / 1e6 << " million programs/sec)"
+                  << std::endl;
+        for(size_t w = 0; w < report.programsPerWorker.size(); w++) {
+            std::cout << "  worker " << w << ": " << report.programsPerWorker[w] << " programs, "
+                      << report.stepsPerWorker[w] << " steps, " << report.stealsPerWorker[w]
+                      << " steals, " << std::setprecision(3) << report.secondsPerWorker[w] * 1000
+                      << " ms" << std::endl;
+        }
+        return 0;
+    }
+    
+    std::unique_ptr<ResultWriter> results;
+    if(!resultsPath.empty()) results.reset(new ResultWriter(resultsPath));
+    
+    cpu.setTraceMode(TraceMode::Silent);
+    uint64_t steps = 0, halted = 0, outputs = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < corpus.size(); i++) {
+        cpu.reset();
+        corpus.load(i, cpu);
+        int ran = cpu.run(corpus.maxSteps(i));
+        steps += ran;
+        halted += !cpu.isRunning();
+        outputs += cpu.output().size();
+        if(results) results->add(cpu, ran);
+    }
+    if(results && !results->finish()) {
+        std::cerr << "Corpus: cannot write " << resultsPath << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    std::cout << "Corpus: " << corpus.size() << " programs, " << halted << " halted, "
+              << steps << " steps, " << outputs << " OUT values in "
+              << std::fixed << std::setprecision(3) << seconds * 1000 << " ms" << std::endl;
+    return 0;
+}
+
+// One line per machine state: registers, PC, zero flag, running, RAM and,
+// unless outCount < 0, the number of OUT values
+static void printStateLine(std::ostream& out, const char* label, const MachineState& s, int64_t outCount) {
+    out << "    " << std::left << std::setw(9) << label << std::right << std::hex << std::setfill('0');
+    for(int r = 0; r < 4; r++) out << "ABCD"[r] << "=" << std::setw(2) << (int)s.reg[r] << " ";
+    out << "PC=" << (int)s.pc << " Z=" << (int)s.zero << " run=" << (int)s.running << " RAM";
+    for(uint8_t b : s.ram) out << " " << std::setw(2) << (int)b;
+    out << std::dec << std::setfill(' ');
+    if(outCount >= 0) out << " OUT x" << outCount;
+    out << std::endl;
+}
+
+// Compare every engine with the reference on a corpus, or on count random
+// images (steps each) if path is empty
+static int runDifferential(const std::string& path, size_t count, bool lockstep, int threads) {
+    DifferentialRunner runner;
+    runner.setThreads(std::max(threads, 0));
+    if(lockstep) runner.setMode(DifferentialRunner::Mode::Lockstep);
+    DifferentialRunner::Report report;
+    if(path.empty()) {
+        report = runner.runRandom(count, 1, 256);
+    } else {
+        ProgramCorpus corpus;
+        std::string error;
+        if(!corpus.open(path, &error)) {
+            std::cerr << "Corpus: " << error << std::endl;
+            return 1;
+        }
+        report = runner.run(corpus);
+    }
+    
+    std::cout << "Differential: " << report.programs << " programs, " << report.comparisons
+              << (lockstep ? " steps" : " runs") << " compared in " << std::fixed << std::setprecision(3)
+              << report.seconds << " s (" << std::setprecision(2) << report.comparisonsPerSecond / 1e6
+              << " million/sec), " << report.divergences << " divergences" << std::endl;
+    for(size_t e = 0; e < report.divergencesPerEngine.size(); e++) {
+        if(report.divergencesPerEngine[e] == 0) continue;
+        std::cout << "  " << engineName((Engine)e) << ": " << report.divergencesPerEngine[e] << std::endl;
+    }
+    for(const DifferentialRunner::Divergence& d : report.first) {
+        std::cout << "  program " << d.program << ", " << engineName(d.engine) << ", step " << d.step
+                  << " (" << std::hex << std::setw(2) << std::setfill('0') << (int)d.before.ram[d.before.pc]
+                  << std::dec << std::setfill(' ') << " at PC " << (int)d.before.pc << ")" << std::endl;
+        printStateLine(std::cout, "before", d.before, -1);
+        printStateLine(std::cout, "expected", d.expected, d.expectedOut);
+        printStateLine(std::cout, "actual", d.actual, d.actualOut);
+    }
+    return report.divergences ? 1 : 0;
+}
+
+// Fuzz cpu's engine against the reference semantics for execs inputs.
+// Fails with the first mismatching image.
+static int runFuzzer(const CPU4Bit& cpu, uint64_t execs) {
+    std::unique_ptr<Fuzzer> fuzzer(new Fuzzer());
+    fuzzer->setEngine(cpu.getEngine());
+    Fuzzer::Report report = fuzzer->run(execs);
+    std::cout << "Fuzz: " << report.execs << " execs in " << std::fixed << std::setprecision(3)
+              << report.seconds << " s (" << std::setprecision(2) << report.execsPerSecond / 1e6
+              << " million execs/sec), " << report.corpus << " inputs kept, " << report.edges
+              << " edges, " << report.locations << " locations, " << report.mismatches
+              << " mismatches" << std::endl;
+    if(report.mismatches == 0) return 0;
+    std::cout << "First mismatch:";
+    for(uint8_t b : report.firstMismatch) {
+        std::cout << " " << std::hex << std::setw(2) << std::setfill('0') << (int)b;
+    }
+    std::cout << std::dec << std::setfill(' ') << std::endl;
+    return 1;
+}
+
+#ifdef CPU4BIT_LIBFUZZER
+// libFuzzer target: clang++ -std=c++17 -O2 -fsanitize=fuzzer -DCPU4BIT_LIBFUZZER.
+// The engine comes from CPU4BIT_FUZZ_ENGINE (default threaded); a mismatch
+// aborts, so libFuzzer saves the input as a crash.
+#ifdef __linux__
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+static uint8_t fuzzCounters[Fuzzer::MAP_SIZE];
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static Fuzzer* fuzzer = [] {
+        Fuzzer* f = new Fuzzer(fuzzCounters);
+        Engine engine = Engine::Threaded;
+        const char* name = std::getenv("CPU4BIT_FUZZ_ENGINE");
+        if(name && !parseEngine(name, engine)) {
+            std::cerr << "Unknown engine: " << name << std::endl;
+            std::exit(1);
+        }
+        f->setEngine(engine);
+        return f;
+    }();
+    if(!fuzzer->execute(data, size)) std::abort();
+    return 0;
+}
+
+// libFuzzer supplies main(); the command line stays available as cpu4bitMain()
+int cpu4bitMain(int argc, char* argv[]) {
+#else
+int main(int argc, char* argv[]) {
+#endif
+    CPU4Bit cpu;
+    bool fusionReport = false;
+    std::string recordPath, replayPath, corpusPath, resultsPath;
+    int threads = -1;
+    uint64_t fuzzExecs = 0;
+    size_t diffCount = 0;
+    bool differential = false, lockstep = false;
+    
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--silent") {
+            cpu.setTraceMode(TraceMode::Silent);
+        } else if(arg == "--buffered") {
+            cpu.setTraceMode(TraceMode::Buffered);
+        } else if(arg == "--verbose") {
+            cpu.setTraceMode(TraceMode::Verbose);
+        } else if(arg == "--selftest") {
+            return selfTest();
+        } else if(arg == "--detect-cycles") {
+            cpu.setCycleDetection(true);
+        } else if(arg == "--fusion-report") {
+            fusionReport = true;
+        } else if(arg == "--bench") {
+            benchmark();
+            return 0;
+        } else if(arg.compare(0, 9, "--engine=") == 0) {
+            Engine engine;
+            if(!parseEngine(arg.substr(9), engine)) {
+                std::cerr << "Unknown engine: " << arg.substr(9) << std::endl;
+                return 1;
+            }
+            cpu.setEngine(engine);
+        } else if(arg.compare(0, 9, "--record=") == 0) {
+            recordPath = arg.substr(9);
+        } else if(arg.compare(0, 9, "--replay=") == 0) {
+            replayPath = arg.substr(9);
+        } else if(arg.compare(0, 9, "--corpus=") == 0) {
+            corpusPath = arg.substr(9);
+        } else if(arg.compare(0, 10, "--results=") == 0) {
+            resultsPath = arg.substr(10);
+        } else if(arg.compare(0, 10, "--threads=") == 0) {
+            threads = std::atoi(arg.c_str() + 10);
+        } else if(arg == "--diff") {
+            differential = true;
+        } else if(arg.compare(0, 7, "--diff=") == 0) {
+            differential = true;
+            diffCount = std::strtoull(arg.c_str() + 7, nullptr, 10);
+        } else if(arg == "--lockstep") {
+            lockstep = true;
+        } else if(arg.compare(0, 7, "--fuzz=") == 0) {
+            fuzzExecs = std::strtoull(arg.c_str() + 7, nullptr, 10);
+        } else {
+            std::cerr << "Usage: " << argv[0] 
+                      << " [--silent|--buffered|--verbose] [--engine=NAME] [--detect-cycles]"
+                      << " [--fusion-report] [--record=FILE] [--replay=FILE]"
+                      << " [--corpus=FILE [--results=FILE|--threads=N]] [--fuzz=EXECS]"
+                      << " [--diff[=COUNT] [--lockstep] [--threads=N]]"
+                      << " [--selftest] [--bench]" << std::endl;
+            return 1;
+        }
+    }
+    
+    if(!replayPath.empty()) {
+        return replayFile(cpu, replayPath);
+    }
+    if(fuzzExecs > 0) {
+        return runFuzzer(cpu, fuzzExecs);
+    }
+    if(differential) {
+        if(corpusPath.empty() && diffCount == 0) {
+            std::cerr << "--diff needs --corpus=FILE or a program count" << std::endl;
+            return 1;
+        }
+        return runDifferential(corpusPath, diffCount, lockstep, threads);
+    }
+    if(!corpusPath.empty()) {
+        if(!resultsPath.empty() && threads >= 0) {
+            std::cerr << "--results writes OUT values in order and runs on one thread" << std::endl;
+            return 1;
+        }
+        return runCorpus(cpu, corpusPath, resultsPath, threads);
+    }
+    
+    ExecutionLog log;
+    if(!recordPath.empty()) {
+        cpu.setRecorder(&log);
+    }
+    
+    std::cout << "===== 4-Bit CPU Simulator =====" << std::endl;
+    std::cout << "\n=== Example 1: Basic Addition ===" << std::endl;
+    
+    runExample(cpu, program1);
+    
+    std::cout << "\n=== Example 2: Countdown Loop ===" << std::endl;
+    cpu.reset();
+    
+    runExample(cpu, program2, 20);  // Limit steps to prevent infinite loop
+    
+    std::cout << "\n=== Example 3: Memory Operations ===" << std::endl;
+    cpu.reset();
+    
+    runExample(cpu, program3);
+    
+    std::cout << "\n=== Example 4: Bitwise Operations (AND, OR, XOR) ===" << std::endl;
+    cpu.reset();
+    
+    runExample(cpu, program4);
+    
+    std::cout << "\n=== Example 5: NOT Operation ===" << std::endl;
+    cpu.reset();
+    
+    runExample(cpu, program5);
     
     std::cout << "\n=== Example 6: Shift Operations ===" << std::endl;
     cpu.reset();
     
-    // Program: Demonstrate shift left and shift right
-    std::vector<uint8_t> program6 = {
-        0x13,  // 0: LDA #3    - Load 3 (0b0011) into A
-        0xB0,  // 1: OUT A     - Output A=3
-        0xE4,  // 2: SHL       - A << 1 = 0b0110 (6)
-        0xB0,  // 3: OUT A     - Output A=6
-        0xE4,  // 4: SHL       - A << 1 = 0b1100 (12)
-        0xB0,  // 5: OUT A     - Output A=12
-        0xE5,  // 6: SHR       - A >> 1 = 0b0110 (6)
-        0xB0,  // 7: OUT A     - Output A=6
-        0xE5,  // 8: SHR       - A >> 1 = 0b0011 (3)
-        0xB0,  // 9: OUT A     - Output A=3
-        0xF0   // A: HLT       - Halt
-    };
-    
-    cpu.loadProgram(program6);
-    cpu.run();
-    cpu.printState();
+    runExample(cpu, program6);
     
     std::cout << "\n=== Example 7: Rotate Operations ===" << std::endl;
     cpu.reset();
     
-    // Program: Demonstrate rotate left and rotate right
-    std::vector<uint8_t> program7 = {
-        0x19,  // 0: LDA #9    - Load 9 (0b1001) into A
-        0xB0,  // 1: OUT A     - Output A=9
-        0xE6,  // 2: ROL       - Rotate left = 0b0011 (3)
-        0xB0,  // 3: OUT A     - Output A=3
-        0xE6,  // 4: ROL       - Rotate left = 0b0110 (6)
-        0xB0,  // 5: OUT A     - Output A=6
-        0xE7,  // 6: ROR       - Rotate right = 0b0011 (3)
-        0xB0,  // 7: OUT A     - Output A=3
-        0xE7,  // 8: ROR       - Rotate right = 0b1001 (9) - back to start
-        0xB0,  // 9: OUT A     - Output A=9
-        0xF0   // A: HLT       - Halt
-    };
-    
-    cpu.loadProgram(program7);
-    cpu.run();
-    cpu.printState();
+    runExample(cpu, program7);
     
     std::cout << "\n=== Example 8: Bit Masking (Practical Use) ===" << std::endl;
     cpu.reset();
     
-    // Program: Extract lower 2 bits using AND
-    std::vector<uint8_t> program8 = {
-        0x1F,  // 0: LDA #15   - Load 15 (0b1111) into A
-        0x23,  // 1: LDB #3    - Load 3 (0b0011) as mask into B
-        0xE0,  // 2: AND       - A & B = 0b0011 (3) - extract lower 2 bits
-        0xB0,  // 3: OUT A     - Output A=3
-        0xF0   // 4: HLT       - Halt
-    };
+    runExample(cpu, program8);
     
-    cpu.loadProgram(program8);
-    cpu.run();
-    cpu.printState();
+    if(fusionReport) {
+        cpu.printFusionReport();
+    }
+    
+    if(!recordPath.empty()) {
+        std::ofstream out(recordPath, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(log.data().data()), log.data().size());
+        if(!out) {
+            std::cerr << "Cannot write " << recordPath << std::endl;
+            return 1;
+        }
+    }
     
     return 0;
 }
\ No newline at end of file